@@ -19,6 +19,9 @@ void Clear_Bit(void *bitSet, uint_t bitPos);
 bool Is_Bit_Set(void *bitSet, uint_t bitPos);
 int Find_First_Free_Bit(void *bitSet, ulong_t totalBits);
 int Find_First_N_Free(void *bitSet, uint_t runLength, ulong_t totalBits);
+int Find_Next_Free_Bit(void *bitSet, ulong_t totalBits, ulong_t *pCursor);
+int Find_Next_N_Free(void *bitSet, uint_t runLength, ulong_t totalBits, ulong_t *pCursor);
+int Find_N_Free_From(void *bitSet, uint_t runLength, ulong_t start, ulong_t totalBits);
 void Destroy_Bit_Set(void *bitSet);
 
 #if 0
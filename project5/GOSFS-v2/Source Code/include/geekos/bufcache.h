@@ -23,6 +23,15 @@ struct Block_Device;
 #define FS_BUFFER_INUSE	0x02	/*!< Buffer is in use. */
 #define FS_BUFFER_INODE	0x04
 #define FS_BUFFER_OLD		0x08	// buffer out of date
+#define FS_BUFFER_DELAYED	0x10	/*!< Data for (owner, lblock); no disk block yet. */
+#define FS_BUFFER_PINNED	0x20	/*!< Must not reach disk until unpinned. */
+#define FS_BUFFER_REVOKED	0x40	/*!< Pinned, but its block was reassigned. */
+
+/*
+ * Delayed buffers a cache may hold before the filesystem
+ * should give them disk blocks.
+ */
+#define FS_BUFFER_CACHE_MAX_DELAYED 64
 
 struct FS_Buffer;
 DEFINE_LIST(FS_Buffer_List, FS_Buffer);
@@ -34,6 +43,8 @@ struct FS_Buffer {
     ulong_t fsBlockNum;		/*!< Filesystem block number. */
     void *data;			/*!< In-memory data of block. May be out of sync with disk. */
     uint_t flags;		/*!< Flags representing state of buffer. */
+    void *owner;		/*!< The file the data belongs to, if known. */
+    ulong_t lblock;		/*!< Delayed buffers: logical block in that file. */
     DEFINE_LINK(FS_Buffer_List, FS_Buffer);
 };
 
@@ -48,6 +59,7 @@ struct FS_Buffer_Cache {
     struct Block_Device *dev;		/*!< Block device. */
     uint_t fsBlockSize;			/*!< Size of filesystem blocks. */
     uint_t numCached;			/*!< Current number of buffers (cached blocks). */
+    uint_t numDelayed;			/*!< How many of them are delayed buffers. */
     struct FS_Buffer_List bufferList;	/*!< List of buffers. */
     struct Mutex lock;			/*!< Lock for synchronization. */
     struct Condition cond;		/*!< Condition: waiting for a buffer. */
@@ -55,11 +67,27 @@ struct FS_Buffer_Cache {
 
 struct FS_Buffer_Cache *Create_FS_Buffer_Cache(struct Block_Device *dev, uint_t fsBlockSize);
 int Sync_FS_Buffer_Cache(struct FS_Buffer_Cache *cache);
+int Sync_FS_Buffers(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, ulong_t count);
+int Sync_FS_Block_List(struct FS_Buffer_Cache *cache, ulong_t *blocks, ulong_t count);
+int Sync_FS_Owner_Buffers(struct FS_Buffer_Cache *cache, void *owner);
 int Destroy_FS_Buffer_Cache(struct FS_Buffer_Cache *cache);
 
 int Get_FS_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_Buffer **pBuf);
 void Modify_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
+void Modify_FS_Owner_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf, void *owner);
 int Sync_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
 int Release_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
 
+int Get_FS_Delayed_Buffer(struct FS_Buffer_Cache *cache, void *owner, ulong_t lblock, bool create,
+    struct FS_Buffer **pBuf);
+int Get_FS_Delayed_Buffers(struct FS_Buffer_Cache *cache, void *owner, struct FS_Buffer **bufs, int max);
+void Assign_FS_Buffer_Block(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf, ulong_t fsBlockNum);
+bool Has_FS_Delayed_Buffers(struct FS_Buffer_Cache *cache, void *owner);
+int Discard_FS_Delayed_Buffers(struct FS_Buffer_Cache *cache, void *owner);
+
+int Direct_FS_IO(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, ulong_t count, void *data, bool write);
+
+void Pin_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
+void Unpin_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
+
 #endif /* GEEKOS_BUFCACHE_H */
@@ -39,6 +39,8 @@
 #define O_READ          0x2	/* Open file for reading. */
 #define O_WRITE         0x4	/* Open file for writing. */
 #define O_EXCL          0x8	/* Don't create file if it already exists. */
+#define O_SYNC          0x10	/* Write data and metadata through to disk. */
+#define O_DIRECT        0x20	/* Move whole blocks without caching them. */
 
 /*
  * An entry in an Access Control List (ACL).
@@ -60,6 +62,18 @@ struct VFS_File_Stat {
     struct VFS_ACL_Entry acls[VFS_MAX_ACL_ENTRIES];
 };
 
+/*
+ * Size and free space of a filesystem, in its own blocks.
+ * This is filled in by the StatFS() VFS function.
+ */
+struct VFS_FS_Stat {
+    ulong_t blockSize;
+    ulong_t totalBlocks;
+    ulong_t freeBlocks;
+    ulong_t totalInodes;
+    ulong_t freeInodes;
+};
+
 /*
  * Generic directory entry structure.
  * This is filled in by the Read_Entry() VFS function.
@@ -69,6 +83,17 @@ struct VFS_Dir_Entry {
     struct VFS_File_Stat stats;
 };
 
+/*
+ * One buffer of a ReadV() or WriteV(); the buffers are filled
+ * or drained in order, as if they were one.
+ */
+#define VFS_MAX_IO_VECTORS 16
+
+struct VFS_IO_Vector {
+    void *base;
+    ulong_t len;
+};
+
 /*
  * A request to mount a filesystem.
  * This is passed as a struct because it would require too many registers
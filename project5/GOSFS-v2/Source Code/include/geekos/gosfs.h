@@ -32,6 +32,10 @@
 #define GOSFS_DIRENTRY_ISDIRECTORY	0x02	/* Directory entry refers to a subdirectory. */
 #define GOSFS_DIRENTRY_SETUID		0x04	/* File executes using uid of file owner. */
 #define GOSFS_DIRENTRY_OLD			0x08
+#define GOSFS_DIRENTRY_HASHED		0x10	/* Directory uses the hashed block format. */
+#define GOSFS_DIRENTRY_EXTENTS		0x20	/* blockList holds an extent root, not block pointers. */
+#define GOSFS_DIRENTRY_INLINE		0x40	/* blockList and acl hold the file's data. */
+#define GOSFS_DIRENTRY_ORPHAN		0x80	/* Deleted; its blocks wait for the reclaim thread. */
 
 #define GOSFS_FILENAME_MAX		127	/* Maximum filename length. */
 
@@ -51,9 +55,16 @@
     (GOSFS_NUM_DIRECT_BLOCKS+GOSFS_NUM_INDIRECT_BLOCKS+GOSFS_NUM_2X_INDIRECT_BLOCKS)
 
 #define GOSFS_NUM_DIR_ENTRY GOSFS_NUM_BLOCK_PTRS
+/*
+ * Bytes of data an inline file keeps in its directory entry,
+ * in place of blockList and acl (which follow each other).
+ */
+#define GOSFS_INLINE_DATA_MAX	\
+	(GOSFS_NUM_DIR_ENTRY*sizeof(ulong_t) + VFS_MAX_ACL_ENTRIES*sizeof(struct VFS_ACL_Entry))
+
 /* Number of directory entries that fit in a filesystem block. */
 #define GOSFS_DIR_ENTRIES_PER_BLOCK	(GOSFS_FS_BLOCK_SIZE / sizeof(struct GOSFS_Dir_Entry))
-#define GOSFS_MAGIC		0x78330000
+#define GOSFS_MAGIC		0x78330002	/* low bits: on-disk layout version */
 
 /*
  * A directory entry.
@@ -78,40 +89,240 @@ struct GOSFS_Indirect_Block{
 	ulong_t blockNumber[GOSFS_NUM_PTRS_PER_BLOCK];
 };
 
+// in-core inode; all opens of a file share the one found in the inode cache
+struct GOSFS_Inode;
+DEFINE_LIST(GOSFS_Inode_List, GOSFS_Inode);
+
 struct GOSFS_Inode{
 	struct GOSFS_Dir_Entry  dirEntry;
 	uint_t inodeNumber;
-	uint_t icount;
-	struct Mutex lock;
+	struct Mount_Point *mountPoint;		/* volume the inode belongs to */
+	uint_t icount;				/* references: open files and transient users */
+	struct RW_Lock lock;			/* shared to read data or entries, exclusive to change them */
 	ulong_t iseek;
-	ulong_t dirty;
+	ulong_t dirty;				/* dirEntry differs from the inode block */
+	bool deleted;				/* Iforget()'d, freed by the last Iput() */
 	// ERROR: struct Thread_Queue waitQueue;
 	struct Condition cond;		/*!< Condition: waiting for a buffer. */
+	struct GOSFS_Inode *hashNext;		/* next in the same hash chain */
+	DEFINE_LINK(GOSFS_Inode_List, GOSFS_Inode);	/* unreferenced inodes, least recent first */
+	uint_t writers;				/* open files with O_WRITE */
+	ulong_t preallocStart, preallocLen;	/* with the superblock lock: blocks reserved in core */
+	struct GOSFS_Inode *preallocNext;	/* next inode with a window */
+	ulong_t preallocSize;			/* size of the next window */
+	ulong_t lastBlock;			/* disk block last allocated, 0 if none */
+	ulong_t lastLblock;			/* its logical block */
+};
+
+IMPLEMENT_LIST(GOSFS_Inode_List, GOSFS_Inode);
+
+#define GOSFS_ICACHE_HASH_SIZE	64
+#define GOSFS_ICACHE_MAX_UNUSED	64	/* unreferenced inodes kept in core */
+
+#define GOSFS_PREALLOC_MIN	8	/* blocks reserved ahead for a file being written */
+#define GOSFS_PREALLOC_MAX	64
+
+#define GOSFS_FLUSH_TICKS	90	/* flusher period, about 5 seconds */
+
+// directory entry cache: (parent inode, name) -> child inode
+// an entry whose inodeNum is 0 is negative, i.e. the name is known not to exist
+struct GOSFS_Dentry;
+DEFINE_LIST(GOSFS_Dentry_List, GOSFS_Dentry);
+
+struct GOSFS_Dentry{
+	ulong_t parent;				/* inode number of the directory */
+	ulong_t inodeNum;			/* inode number of the child, 0 if negative */
+	ulong_t flags;				/* flags of the child, saves reading its inode */
+	ulong_t hash;
+	char name[GOSFS_FILENAME_MAX+1];
+	struct GOSFS_Dentry *hashNext;		/* next in the same hash chain */
+	DEFINE_LINK(GOSFS_Dentry_List, GOSFS_Dentry);	/* LRU order, least recent first */
+};
+
+IMPLEMENT_LIST(GOSFS_Dentry_List, GOSFS_Dentry);
+
+#define GOSFS_DCACHE_HASH_SIZE	64
+#define GOSFS_DCACHE_MAX_ENTRIES	256
+
+/*
+ * Hashed directory format.
+ * Logical block 0 of the directory holds the header with the bucket table
+ * of an extendible hash; every other block is a leaf of packed records.
+ * A full leaf is split in two, doubling the table when needed, so lookup
+ * and insert touch the header and one leaf whatever the directory size.
+ * The size field of a hashed directory is its number of entries.
+ */
+#define GOSFS_HDIR_MAGIC	0x48444952	/* "HDIR" */
+#define GOSFS_HDIR_MAX_DEPTH	9
+#define GOSFS_HDIR_TABLE_SIZE	(1 << GOSFS_HDIR_MAX_DEPTH)
+
+struct GOSFS_Hdir_Header{
+	ulong_t magic;
+	ulong_t globalDepth;			/* table uses the low globalDepth bits of the hash */
+	ulong_t numBlocks;			/* logical blocks in use, header included */
+	ulong_t table[GOSFS_HDIR_TABLE_SIZE];	/* hash bits -> logical block of the leaf */
+};
+
+struct GOSFS_Hdir_Leaf{
+	ulong_t localDepth;			/* hash bits shared by all records in this leaf */
+	ulong_t used;				/* bytes of records[] in use */
+	uchar_t records[GOSFS_FS_BLOCK_SIZE - 2*sizeof(ulong_t)];
 };
 
-// ERROR: my definitions
-#define GOSFS_NUM_INODE_BITMAP_INUSE 225
-#define GOSFS_NUM_INODE_BITMAP_BYTES 256
-#define GOSFS_NUM_BLOCK_BITMAP_INUSE 1011
-#define GOSFS_NUM_BLOCK_BITMAP_BYTES 1024
-#define GOSFS_NUM_INODE 1800
-#define GOSFS_NUM_BLOCK 8192
-#define GOSFS_NUM_INODE_IN_BLOCK 100
+struct GOSFS_Hdir_Record{
+	ulong_t hash;
+	ulong_t inodeNum;
+	ulong_t flags;				/* copy of the child's flags */
+	ushort_t recLen;			/* bytes, a multiple of 4 */
+	ushort_t nameLen;
+	char name[4];				/* nameLen+1 bytes, nul-terminated */
+};
+
+#define GOSFS_HDIR_REC_LEN(nameLen)	((16 + (nameLen) + 1 + 3) & ~3)
+
+/*
+ * Extent-mapped files.
+ * The blockList of an inode with GOSFS_DIRENTRY_EXTENTS is a GOSFS_Extent_Root.
+ * At depth 0 it holds the extents, sorted by logical block; at depth 1 it
+ * holds index entries, each naming a leaf block of sorted extents.
+ */
+struct GOSFS_Extent{
+	ulong_t lblock;				/* first logical block */
+	ulong_t pblock;				/* first disk block */
+	ulong_t len;				/* number of blocks */
+};
+
+struct GOSFS_Extent_Index{
+	ulong_t lblock;				/* first logical block the leaf covers */
+	ulong_t leaf;				/* disk block of the leaf */
+};
 
+struct GOSFS_Extent_Header{
+	ushort_t entries;			/* extents or index entries in use */
+	ushort_t depth;				/* 0: extents follow, 1: index entries follow */
+};
+
+#define GOSFS_EXTENT_ROOT_BYTES	(GOSFS_NUM_DIR_ENTRY*sizeof(ulong_t) - sizeof(struct GOSFS_Extent_Header))
+#define GOSFS_EXTENTS_IN_INODE	(GOSFS_EXTENT_ROOT_BYTES / sizeof(struct GOSFS_Extent))
+#define GOSFS_EXTENT_INDEX_IN_INODE	(GOSFS_EXTENT_ROOT_BYTES / sizeof(struct GOSFS_Extent_Index))
+#define GOSFS_EXTENTS_PER_LEAF	\
+	((GOSFS_FS_BLOCK_SIZE - sizeof(struct GOSFS_Extent_Header)) / sizeof(struct GOSFS_Extent))
+
+struct GOSFS_Extent_Root{
+	struct GOSFS_Extent_Header hdr;
+	union {
+		struct GOSFS_Extent extent[GOSFS_EXTENTS_IN_INODE];
+		struct GOSFS_Extent_Index index[GOSFS_EXTENT_INDEX_IN_INODE];
+	} u;
+};
+
+struct GOSFS_Extent_Leaf{
+	struct GOSFS_Extent_Header hdr;		/* depth is always 0 */
+	struct GOSFS_Extent extent[GOSFS_EXTENTS_PER_LEAF];
+};
+
+/* Bits for GOSFS_Instance features. */
+#define GOSFS_FEATURE_HASHED_DIRS	0x01	/* new directories use the hashed format */
+#define GOSFS_FEATURE_EXTENTS		0x02	/* new files are mapped by extents */
+#define GOSFS_FEATURE_JOURNAL		0x04	/* metadata updates go through a journal */
+#define GOSFS_FEATURE_INLINE_DATA	0x08	/* new files start with inline data */
+
+/*
+ * Volume layout, worked out by GOSFS_Format from the size of the device:
+ * boot block, superblock, inode bitmap, block bitmap, inode table, data.
+ * Bit i of the block bitmap stands for block firstDataBlock + i.
+ */
 #define GOSFS_SUPER_BLOCK_NUM 1
-#define GOSFS_FIRST_DATA_BLOCK 102
 #define GOSFS_ROOT_INODE_NUM 1
+#define GOSFS_BITS_PER_BLOCK	(GOSFS_FS_BLOCK_SIZE * 8)
+#define GOSFS_BLOCKS_PER_INODE	4	/* one inode for every 16K of disk */
+#define GOSFS_MIN_INODES	64
+#define GOSFS_MIN_DATA_BLOCKS	64
+#define GOSFS_MAX_ORPHANS	16	/* deleted files waiting to be reclaimed */
 
 struct GOSFS_Instance{
 	ulong_t magic;
-	ulong_t numLogicBlocks;
+	ulong_t numLogicBlocks;			/* size of the volume */
 	uint_t numInodes;
 	ulong_t firstDataBlock;
 	struct Block_Device * dev;
-	uchar_t inodeBitmapVector[GOSFS_NUM_INODE_BITMAP_BYTES];
-	uchar_t blockBitmapVector[GOSFS_NUM_BLOCK_BITMAP_BYTES];
+	ulong_t inodeBitmapStart, inodeBitmapBlocks;
+	ulong_t blockBitmapStart, blockBitmapBlocks;
+	ulong_t inodeTableStart, inodeTableBlocks;
+	ulong_t numDataBlocks;			/* bits in the block bitmap */
+	ulong_t features;			/* GOSFS_FEATURE_xxx, chosen at format time */
+	ulong_t journalStart;			/* GOSFS_FEATURE_JOURNAL: first block of the journal */
+	ulong_t journalBlocks;			/* and its size */
+	ulong_t numOrphans;			/* inodes deleted but not reclaimed yet */
+	ulong_t orphans[GOSFS_MAX_ORPHANS];
 };
 
+/*
+ * Free bits of a bitmap, in all and per bitmap block (allocation group).
+ * Kept in core only: they are counted from the bitmaps at mount and
+ * kept up to date by every allocation and release after that.
+ */
+struct GOSFS_Free_Count{
+	ulong_t free;
+	ulong_t numGroups;
+	ulong_t *groupFree;
+	struct GOSFS_Inode *windows;	/* inodes with preallocation windows in this bitmap */
+};
+
+/*
+ * Metadata journal.
+ * The first block of the journal region holds a GOSFS_Journal_Header of
+ * type GOSFS_JOURNAL_SUPER; the rest is a circular log. A transaction in
+ * the log is a descriptor block naming the home blocks of the copies that
+ * follow it, the copies, and a commit block with the same sequence number.
+ */
+#define GOSFS_JOURNAL_MAGIC	0x4a4c4f47	/* "GOLJ" */
+#define GOSFS_JOURNAL_BLOCKS	256	/* size of the journal region */
+#define GOSFS_JOURNAL_MAX_TRANS	32	/* blocks in one transaction */
+#define GOSFS_JOURNAL_COMMIT_AT	16	/* commit once this many are waiting */
+#define GOSFS_JOURNAL_MAX_CREDITS	(GOSFS_JOURNAL_MAX_TRANS - 1)	/* one is left for the superblock */
+#define GOSFS_JOURNAL_OP_CREDITS	16	/* blocks one operation may change */
+#define GOSFS_JOURNAL_RUN_CREDITS	6	/* blocks mapping one run of new blocks may change */
+
+#define GOSFS_JOURNAL_SUPER		1
+#define GOSFS_JOURNAL_DESCRIPTOR	2
+#define GOSFS_JOURNAL_COMMIT		3
+
+struct GOSFS_Journal_Header{
+	ulong_t magic;
+	ulong_t type;				/* GOSFS_JOURNAL_xxx */
+	ulong_t sequence;			/* super: sequence of the transaction at tail */
+	ulong_t count;				/* descriptor: number of copies that follow */
+	ulong_t tail;				/* super: log offset of the oldest live transaction */
+	ulong_t blockNum[GOSFS_JOURNAL_MAX_TRANS];	/* descriptor: home blocks */
+};
+
+// in-core journal state
+struct GOSFS_Journal{
+	struct Mutex lock;
+	struct Condition cond;		/* handles gone, or commit done */
+	bool enabled;
+	ulong_t start;				/* journal superblock; the log follows */
+	ulong_t len;				/* blocks in the log */
+	ulong_t head, tail;			/* log offsets: next free, oldest live */
+	ulong_t sequence;			/* of the next commit */
+	ulong_t tailSequence;
+	int handles;				/* operations in progress */
+	bool committing;
+	int count;					/* buffers in the running transaction */
+	int reserved;				/* credits of the open handles */
+	struct FS_Buffer *bufs[GOSFS_JOURNAL_MAX_TRANS];
+	void *page;					/* descriptor and commit blocks are built here */
+};
+
+/*
+ * In-core superblock: mountPoint->fsData of a mounted volume.
+ * Every piece of state of the volume hangs off it, so any number
+ * of GOSFS volumes can be mounted at once.
+ */
+struct GOSFS_Superblock;
+DEFINE_LIST(GOSFS_Superblock_List, GOSFS_Superblock);
+
 struct GOSFS_Superblock{
 	struct GOSFS_Instance gfsInstance;
 	// ERROR:struct Thread_Queue waitQueue;
@@ -119,8 +330,30 @@ struct GOSFS_Superblock{
 	struct Mutex lock;
 	ulong_t flags;
 	uchar_t dirty;
+	ulong_t inodeCursor;			/* next-fit start for inode allocation */
+	ulong_t blockCursor;			/* next-fit start for block allocation */
+	struct GOSFS_Free_Count inodeFree;	/* free inodes */
+	struct GOSFS_Free_Count blockFree;	/* free data blocks */
+
+	// everything else that belongs to one mounted volume
+	struct Mount_Point *mountPoint;
+	struct FS_Buffer_Cache *cache;		/* of the volume's device */
+	struct GOSFS_Journal journal;
+	struct GOSFS_Dentry *dcacheHash[GOSFS_DCACHE_HASH_SIZE];
+	struct GOSFS_Dentry_List dcacheLRU;
+	uint_t dcacheCount;
+	struct Mutex dcacheLock;
+	struct GOSFS_Inode *icacheHash[GOSFS_ICACHE_HASH_SIZE];
+	struct GOSFS_Inode_List icacheUnused;
+	uint_t icacheNumUnused;
+	struct Mutex icacheLock;
+	struct Condition reclaimCond;		/* with lock: the orphan list changed, or orphanIdle */
+	ulong_t orphanIdle;			/* with lock: times an orphan lost its last reference */
+	DEFINE_LINK(GOSFS_Superblock_List, GOSFS_Superblock);	/* mounted volumes */
 };
 
+IMPLEMENT_LIST(GOSFS_Superblock_List, GOSFS_Superblock);
+
 void Init_GOSFS(void);
 int Init_Stdio(void);
 void Init_User_Stdio(struct User_Context *userContext);
@@ -29,6 +29,21 @@ struct Condition {
     struct Thread_Queue waitQueue;
 };
 
+/*
+ * Reader/writer lock: held shared by any number of readers,
+ * or exclusively by one writer.
+ */
+struct RW_Lock {
+    struct Mutex mutex;			/* protects the fields below */
+    struct Condition readCond;		/* readers waiting */
+    struct Condition writeCond;		/* writers waiting */
+    int readers;			/* threads holding it shared */
+    int readersWaiting;
+    int writersWaiting;
+    int admit;				/* waiting readers let in ahead of writers */
+    struct Kernel_Thread* writer;	/* thread holding it exclusively */
+};
+
 void Mutex_Init(struct Mutex* mutex);
 void Mutex_Lock(struct Mutex* mutex);
 void Mutex_Unlock(struct Mutex* mutex);
@@ -38,6 +53,12 @@ void Cond_Wait(struct Condition* cond, struct Mutex* mutex);
 void Cond_Signal(struct Condition* cond);
 void Cond_Broadcast(struct Condition* cond);
 
+void RW_Lock_Init(struct RW_Lock* rwLock);
+void RW_Read_Lock(struct RW_Lock* rwLock);
+void RW_Read_Unlock(struct RW_Lock* rwLock);
+void RW_Write_Lock(struct RW_Lock* rwLock);
+void RW_Write_Unlock(struct RW_Lock* rwLock);
+
 #define IS_HELD(mutex) \
     ((mutex)->state == MUTEX_LOCKED && (mutex)->owner == g_currentThread)
 
@@ -67,6 +67,15 @@ enum {
     SYS_CREATEDIR,	 /* Create directory system call  */
     SYS_SYNC,		 /* Sync filesystems system call  */
     SYS_FORMAT,		 /* Format filesystem system call  */
+    SYS_PREAD,		 /* Read from file at an offset system call  */
+    SYS_PWRITE,		 /* Write to file at an offset system call  */
+    SYS_READV,		 /* Read from file into several buffers system call  */
+    SYS_WRITEV,		 /* Write to file from several buffers system call  */
+    SYS_READENTRIES,	 /* Read several directory entries system call  */
+    SYS_STATFS,		 /* Filesystem size and free space system call  */
+    SYS_COPYFILERANGE,	 /* Copy between files in the kernel system call  */
+    SYS_FSYNC,		 /* Sync one file system call  */
+    SYS_FDATASYNC,	 /* Sync the data of one file system call  */
 };
 
 /*
@@ -104,6 +104,7 @@ int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
     struct User_Context **pUserContext);
 bool Copy_From_User(void* destInKernel, ulong_t srcInUser, ulong_t bufSize);
 bool Copy_To_User(ulong_t destInUser, void* srcInKernel, ulong_t bufSize);
+void *User_To_Kernel(ulong_t userAddr, ulong_t bufSize);
 void Switch_To_Address_Space(struct User_Context *userContext);
 
 
@@ -35,7 +35,8 @@ struct File_Ops;
  */
 
 struct Filesystem_Ops {
-    int (*Format)(struct Block_Device *blockDev);
+    /* options: text after the first ',' of the fstype, "" if none */
+    int (*Format)(struct Block_Device *blockDev, const char *options);
     int (*Mount)(struct Mount_Point *mountPoint);
 };
 
@@ -56,6 +57,7 @@ struct Mount_Point_Ops {
     int (*Stat)(struct Mount_Point *mountPoint, const char *path, struct VFS_File_Stat *stat);
     int (*Sync)(struct Mount_Point *mountPoint);
     int (*Delete)(struct Mount_Point *mountPoint, const char *path);
+    int (*StatFS)(struct Mount_Point *mountPoint, struct VFS_FS_Stat *stat);
     /* TODO: ACLs */
 };
 
@@ -85,14 +87,32 @@ struct File {
 
 IMPLEMENT_LIST(VNode_List, File); // ERROR: Implementation of VNode_List's Ops.
 
+/*
+ * The memory a Read or Write moves file data to or from: a kernel
+ * buffer, or a buffer in the current process's user space, or a
+ * vector of those.
+ * Filesystems copy through VFS_Copy_Out() and VFS_Copy_In(), so data
+ * goes between their caches and user memory without a bounce buffer.
+ */
+struct VFS_Buffer {
+    bool user;			 /* true: userAddr or vec is used, false: kernel */
+    void *kernel;
+    ulong_t userAddr;
+    const struct VFS_IO_Vector *vec; /* if not null, user buffers in order */
+    int vecCount;
+};
+
 /* Operations that can be performed on a File. */
 struct File_Ops {
     int (*FStat)(struct File *file, struct VFS_File_Stat *stat);
-    int (*Read)(struct File *file, void *buf, ulong_t numBytes);
-    int (*Write)(struct File *file, void *buf, ulong_t numBytes);
+    int (*Read)(struct File *file, struct VFS_Buffer *buf, ulong_t numBytes);
+    int (*Write)(struct File *file, struct VFS_Buffer *buf, ulong_t numBytes);
     int (*Seek)(struct File *file, ulong_t pos);
     int (*Close)(struct File *file);
     int (*Read_Entry)(struct File *dir, struct VFS_Dir_Entry *entry);  /* Read next directory entry. */
+    int (*Read_Entries)(struct File *dir, struct VFS_Buffer *buf, int maxEntries);  /* Several at once; optional. */
+    int (*Copy_Range)(struct File *src, struct File *dst, ulong_t len);  /* To a file of the same mount; optional. */
+    int (*Sync)(struct File *file, bool dataOnly);  /* Put this file on disk; optional. */
 };
 
 /*
@@ -121,6 +141,7 @@ int Mount(const char *devname, const char *pathPrefix, const char *fstype);
 int Open(const char *path, int mode, struct File **pFile);
 int Close(struct File *file);
 int Stat(const char *path, struct VFS_File_Stat *stat);
+int StatFS(const char *path, struct VFS_FS_Stat *stat);
 int Sync(void);
 int Delete(const char *path);
 
@@ -128,8 +149,20 @@ int Delete(const char *path);
 struct File *Allocate_File(struct File_Ops *ops, int filePos, int endPos, void *fsData,
     int mode, struct Mount_Point *mountPoint);
 int FStat(struct File *file, struct VFS_File_Stat *stat);
+int FSync(struct File *file);
+int FDataSync(struct File *file);
 int Read(struct File *file, void *buf, ulong_t len);
 int Write(struct File *file, void *buf, ulong_t len);
+int Read_User(struct File *file, ulong_t userAddr, ulong_t len);
+int Write_User(struct File *file, ulong_t userAddr, ulong_t len);
+int PRead_User(struct File *file, ulong_t userAddr, ulong_t len, ulong_t pos);
+int PWrite_User(struct File *file, ulong_t userAddr, ulong_t len, ulong_t pos);
+int ReadV_User(struct File *file, const struct VFS_IO_Vector *vec, int count);
+int WriteV_User(struct File *file, const struct VFS_IO_Vector *vec, int count);
+int Copy_File_Range(struct File *src, struct File *dst, ulong_t len);
+bool VFS_Copy_Out(struct VFS_Buffer *buf, ulong_t offset, void *src, ulong_t len);
+bool VFS_Copy_In(void *dest, struct VFS_Buffer *buf, ulong_t offset, ulong_t len);
+void *VFS_Buffer_Address(struct VFS_Buffer *buf, ulong_t offset, ulong_t len);
 int Seek(struct File *file, ulong_t len);
 int Read_Fully(const char *path, void **pBuffer, ulong_t *pLen);
 
@@ -137,6 +170,7 @@ int Read_Fully(const char *path, void **pBuffer, ulong_t *pLen);
 int Create_Directory(const char *path);
 int Open_Directory(const char *path, struct File **pDir);
 int Read_Entry(struct File *file, struct VFS_Dir_Entry *entry);
+int Read_Entries_User(struct File *file, ulong_t userAddr, int maxEntries);
 
 /*
  * Paging device functions.
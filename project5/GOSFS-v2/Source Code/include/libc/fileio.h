@@ -15,18 +15,27 @@
 
 int Stat(const char *path, struct VFS_File_Stat *stat);
 int FStat(int fd, struct VFS_File_Stat *stat);
+int StatFS(const char *path, struct VFS_FS_Stat *stat);
 int Open(const char *path, int mode);
 int Create_Directory(const char *path);
 int Open_Directory(const char *path);
 int Close(int fd);
 int Read_Entry(int fd, struct VFS_Dir_Entry *dirEntry);
+int Read_Entries(int fd, struct VFS_Dir_Entry *dirEntries, int maxEntries);
 int Read(int fd, void *buf, unsigned long len);
 int Write(int fd, const void *buf, unsigned long len);
 int Sync(void);
+int FSync(int fd);
+int FDataSync(int fd);
 int Format(const char *dev, const char *fstype);
 int Mount(const char *dev, const char *prefix, const char *fstype);
 int Seek(int fd, int pos);
 int Delete(const char *path);
+int PRead(int fd, void *buf, unsigned long len, unsigned long pos);
+int PWrite(int fd, const void *buf, unsigned long len, unsigned long pos);
+int ReadV(int fd, const struct VFS_IO_Vector *vec, int count);
+int WriteV(int fd, const struct VFS_IO_Vector *vec, int count);
+int Copy_File_Range(int srcFd, int dstFd, unsigned long len);
 
 #endif  /* FILEIO_H */
 
@@ -61,46 +61,139 @@ bool Is_Bit_Set(void *bitSet, uint_t bitPos)
     return (((uchar_t*)bitSet)[offset] & (1 << bit)) != 0;
 }
 
-int Find_First_Free_Bit(void *bitSet, ulong_t totalBits)
+/*
+ * The searches below work a 32-bit word at a time.
+ * Bit n lives in byte n/8, so on the x86 it is also bit n%32 of word n/32.
+ */
+
+/* Index of the lowest set bit of a nonzero word. */
+static __inline__ ulong_t Lowest_Bit(ulong_t word)
+{
+    ulong_t bit;
+    __asm__ ("bsfl %1, %0" : "=r" (bit) : "rm" (word));
+    return bit;
+}
+
+/*
+ * Word wordIndex of the set; bytes past the end of the set
+ * read as all ones (in use) rather than being touched.
+ */
+static ulong_t Load_Word(uchar_t *bits, ulong_t wordIndex, ulong_t numBytes)
+{
+    ulong_t offset = wordIndex * 4, word = 0xffffffff;
+    int i;
+
+    if (offset + 4 <= numBytes)
+	return *((ulong_t*) (bits + offset));
+    for (i = 0; offset + i < numBytes; ++i) {
+	word &= ~(0xffUL << (i * 8));
+	word |= ((ulong_t) bits[offset + i]) << (i * 8);
+    }
+    return word;
+}
+
+/* First clear bit (if findSet is false) or set bit in [pos, end); end if none. */
+static ulong_t Find_Next(uchar_t *bits, ulong_t pos, ulong_t end, ulong_t numBytes, bool findSet)
 {
-    uint_t numBytes = FIND_NUM_BYTES(totalBits);
-    ulong_t offset;
-    uchar_t *bits = (uchar_t*) bitSet;
-
-    for (offset = 0; offset < numBytes; ++offset) {
-	if (bits[offset] != 0xff) {
-	    uint_t bit;
-	    for (bit = 0; bit < 8; ++bit) {
-		if ((bits[offset] & (1 << bit)) == 0)
-		    return (offset * 8) + bit;
-	    }
-	    KASSERT(false);
+    ulong_t word;
+
+    while (pos < end) {
+	word = Load_Word(bits, pos / 32, numBytes);
+	if (!findSet)
+	    word = ~word;
+	word >>= pos % 32;
+	if (word != 0) {
+	    pos += Lowest_Bit(word);
+	    return pos < end ? pos : end;
 	}
+	pos = (pos | 31) + 1;
     }
+    return end;
+}
 
+/* First run of runLength clear bits within [pos, end), or -1. */
+static int Find_Run(uchar_t *bits, ulong_t pos, ulong_t end, ulong_t numBytes, uint_t runLength)
+{
+    ulong_t runStart, runEnd;
+
+    while (pos < end) {
+	runStart = Find_Next(bits, pos, end, numBytes, false);
+	if (end - runStart < runLength)
+	    return -1;
+	runEnd = Find_Next(bits, runStart, runStart + runLength, numBytes, true);
+	if (runEnd - runStart == runLength)
+	    return runStart;
+	pos = runEnd;
+    }
     return -1;
 }
 
+int Find_First_Free_Bit(void *bitSet, ulong_t totalBits)
+{
+    ulong_t pos = Find_Next((uchar_t*) bitSet, 0, totalBits, FIND_NUM_BYTES(totalBits), false);
+
+    return pos < totalBits ? (int) pos : -1;
+}
+
 /*
- * This is slow!!
+ * Next-fit: search from *pCursor on, wrapping around to the start,
+ * and leave *pCursor just past the bit found.  Each bitmap keeps its
+ * own cursor, so a filling set isn't rescanned from 0 every time.
  */
+int Find_Next_Free_Bit(void *bitSet, ulong_t totalBits, ulong_t *pCursor)
+{
+    ulong_t numBytes = FIND_NUM_BYTES(totalBits);
+    ulong_t start = *pCursor < totalBits ? *pCursor : 0;
+    ulong_t pos;
+
+    pos = Find_Next((uchar_t*) bitSet, start, totalBits, numBytes, false);
+    if (pos == totalBits) {
+	pos = Find_Next((uchar_t*) bitSet, 0, start, numBytes, false);
+	if (pos == start)
+	    return -1;
+    }
+
+    *pCursor = pos + 1;
+    return pos;
+}
+
 int Find_First_N_Free(void *bitSet, uint_t runLength, ulong_t totalBits)
 {
-    uint_t i,j;
-
-    for (i=0; i < totalBits - runLength; i++) {
-        if (!Is_Bit_Set(bitSet, i)) {
-	    for (j=1; j < runLength; j++) {
-	        if (Is_Bit_Set(bitSet, i+j)) {
-		    break;
-		}
-	    }
-	    if (j == runLength) {
-	        return i;
-	    }
-	}
+    return Find_Run((uchar_t*) bitSet, 0, totalBits, FIND_NUM_BYTES(totalBits), runLength);
+}
+
+/*
+ * Next-fit version of Find_First_N_Free(); *pCursor is left just past the run.
+ */
+int Find_Next_N_Free(void *bitSet, uint_t runLength, ulong_t totalBits, ulong_t *pCursor)
+{
+    ulong_t numBytes = FIND_NUM_BYTES(totalBits);
+    ulong_t start = *pCursor < totalBits ? *pCursor : 0;
+    ulong_t end;
+    int pos;
+
+    pos = Find_Run((uchar_t*) bitSet, start, totalBits, numBytes, runLength);
+    if (pos < 0) {
+	/* a run may straddle the cursor */
+	end = start + runLength - 1 < totalBits ? start + runLength - 1 : totalBits;
+	pos = Find_Run((uchar_t*) bitSet, 0, end, numBytes, runLength);
+	if (pos < 0)
+	    return -1;
     }
-    return -1;
+
+    *pCursor = pos + runLength;
+    return pos;
+}
+
+/*
+ * Find the first run of runLength free bits at or after bit start,
+ * without wrapping around; returns -1 if there is none.
+ */
+int Find_N_Free_From(void *bitSet, uint_t runLength, ulong_t start, ulong_t totalBits)
+{
+    if (start >= totalBits)
+	return -1;
+    return Find_Run((uchar_t*) bitSet, start, totalBits, FIND_NUM_BYTES(totalBits), runLength);
 }
 
 void Destroy_Bit_Set(void *bitSet)
@@ -11,6 +11,7 @@
 #include <geekos/kassert.h>
 #include <geekos/mem.h>
 #include <geekos/malloc.h>
+#include <geekos/string.h>
 #include <geekos/blockdev.h>
 #include <geekos/bufcache.h>
 
@@ -39,15 +40,15 @@ static uint_t Get_Num_Sectors_Per_FS_Block(struct FS_Buffer_Cache *cache)
 }
 
 /*
- * Read or write a filesystem buffer.
+ * Read or write filesystem block fsBlockNum from or to data.
  */
-static int Do_Buffer_IO(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf,
+static int Do_Block_IO(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, void *data,
     int (*IO_Func)(struct Block_Device *dev, int blockNum, void *buf))
 {
     uint_t offset;
     int sectorCount = 0;
-    int blockNum = buf->fsBlockNum * Get_Num_Sectors_Per_FS_Block(cache);
-    char *ptr = (char*) buf->data;
+    int blockNum = fsBlockNum * Get_Num_Sectors_Per_FS_Block(cache);
+    char *ptr = (char*) data;
 
     for (offset = 0; offset < cache->fsBlockSize; offset += SECTOR_SIZE) {
 	int rc = IO_Func(cache->dev, blockNum, ptr + offset);
@@ -62,6 +63,15 @@ static int Do_Buffer_IO(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf,
     return 0;
 }
 
+/*
+ * Read or write a filesystem buffer.
+ */
+static int Do_Buffer_IO(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf,
+    int (*IO_Func)(struct Block_Device *dev, int blockNum, void *buf))
+{
+    return Do_Block_IO(cache, buf->fsBlockNum, buf->data, IO_Func);
+}
+
 /*
  * If necessary, write back uncomitted buffer contents to block device.
  */
@@ -71,6 +81,13 @@ static int Sync_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
 
     KASSERT(IS_HELD(&cache->lock));
 
+    /*
+     * A delayed buffer has nowhere to go until it gets a disk block,
+     * and a pinned one may not go there yet.
+     */
+    if (buf->flags & (FS_BUFFER_DELAYED | FS_BUFFER_PINNED))
+	return 0;
+
     if (buf->flags & FS_BUFFER_DIRTY) {
 	if ((rc = Do_Buffer_IO(cache, buf, Block_Write)) == 0)
 	    buf->flags &= ~(FS_BUFFER_DIRTY);
@@ -90,46 +107,44 @@ static void Move_To_Front(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
 }
 
 /*
- * Get buffer for given block, and mark it in use.
- * Must be called with cache mutex held.
+ * Find the (non-delayed) buffer for given block, or 0.
+ * As a side-effect, finds the least recently used
+ * buffer that is not in use (if any).
  */
-static int Get_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_Buffer **pBuf)
+static struct FS_Buffer *Find_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum,
+    struct FS_Buffer **pLru)
 {
     struct FS_Buffer *buf, *lru = 0;
-    int rc;
-
-    Debug("Request block %lu\n", fsBlockNum);
-
-    KASSERT(IS_HELD(&cache->lock));
 
-    /*
-     * Look for existing buffer.
-     * As a side-effect, finds the least recently used
-     * buffer that is not in use (if any).
-     */
     buf = Get_Front_Of_FS_Buffer_List(&cache->bufferList);
     while (buf != 0) {
-	if (buf->flags & FS_BUFFER_DIRTY) // ERROR: fixed; first check and sync everytime
-	{
-		Sync_Buffer(cache, buf);
-		//buf->flags &= FS_BUFFER_INUSE;
-	}
-	if (buf->fsBlockNum == fsBlockNum) {
-	    /* If buffer is in use, wait until it is available. */
-	    while (buf->flags & FS_BUFFER_INUSE) {
-		Debug("Waiting for block %lu\n", fsBlockNum);
-		Cond_Wait(&cache->cond, &cache->lock);
-	    }
-	    goto done;
-	}
+	if (!(buf->flags & FS_BUFFER_DELAYED)) {
+	    if (buf->fsBlockNum == fsBlockNum)
+		break;
 
-	/* If buffer isn't in use, it's a candidate for LRU. */
-	if (!(buf->flags & FS_BUFFER_INUSE))
-	    lru = buf;
+	    /* If buffer isn't in use (or pinned), it's a candidate for LRU. */
+	    if (!(buf->flags & (FS_BUFFER_INUSE | FS_BUFFER_PINNED)))
+		lru = buf;
+	}
 
 	buf = Get_Next_In_FS_Buffer_List(buf);
     }
 
+    if (pLru != 0)
+	*pLru = lru;
+    return buf;
+}
+
+/*
+ * Get a clean, unused buffer at the front of the list:
+ * a new one if the cache may grow, otherwise the LRU one.
+ * Delayed and pinned buffers are never stolen.
+ */
+static int Alloc_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *lru, struct FS_Buffer **pBuf)
+{
+    struct FS_Buffer *buf;
+    int rc;
+
     /*
      * If number of allocated buffers does not exceed the
      * limit, allocate a new one.
@@ -142,11 +157,12 @@ static int Get_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct
 		Free(buf);
 	    else {
 		/* Successful creation */
-		buf->fsBlockNum = fsBlockNum;
 		buf->flags = 0;
+		buf->owner = 0;
 		Add_To_Front_Of_FS_Buffer_List(&cache->bufferList, buf);
 		++cache->numCached;
-		goto readAndAcquire;
+		*pBuf = buf;
+		return 0;
 	    }
 	}
     }
@@ -167,9 +183,40 @@ static int Get_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct
     /* LRU buffer is clean, so we can steal it. */
     buf = lru;
     buf->flags = 0;
+    buf->owner = 0;
     Move_To_Front(cache, buf);
+    *pBuf = buf;
+    return 0;
+}
+
+/*
+ * Get buffer for given block, and mark it in use.
+ * Must be called with cache mutex held.
+ */
+static int Get_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_Buffer **pBuf)
+{
+    struct FS_Buffer *buf, *lru;
+    int rc;
+
+    Debug("Request block %lu\n", fsBlockNum);
+
+    KASSERT(IS_HELD(&cache->lock));
+
+    /* Look for existing buffer. */
+    buf = Find_Buffer(cache, fsBlockNum, &lru);
+    if (buf != 0) {
+	/* If buffer is in use, wait until it is available. */
+	while (buf->flags & FS_BUFFER_INUSE) {
+	    Debug("Waiting for block %lu\n", fsBlockNum);
+	    Cond_Wait(&cache->cond, &cache->lock);
+	}
+	goto done;
+    }
+
+    if ((rc = Alloc_Buffer(cache, lru, &buf)) != 0)
+	return rc;
+    buf->fsBlockNum = fsBlockNum;
 
-readAndAcquire:
     /*
      * The buffer selected should be clean (no uncommitted data),
      * and should have been moved to the front of the buffer list
@@ -222,6 +269,24 @@ static void Free_Buffer(struct FS_Buffer *buf)
     Free(buf);
 }
 
+/*
+ * Take a stale, unused buffer out of the cache.
+ * If it is pinned, whoever pinned it still refers to it;
+ * it is freed when unpinned.
+ */
+static void Forget_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
+{
+    KASSERT(!(buf->flags & FS_BUFFER_INUSE));
+    Remove_From_FS_Buffer_List(&cache->bufferList, buf);
+    --cache->numCached;
+    if (buf->flags & FS_BUFFER_PINNED)
+	buf->flags |= FS_BUFFER_REVOKED;
+    else {
+	buf->flags = 0;
+	Free_Buffer(buf);
+    }
+}
+
 /* ----------------------------------------------------------------------
  * Public functions
  * ---------------------------------------------------------------------- */
@@ -249,6 +314,7 @@ struct FS_Buffer_Cache *Create_FS_Buffer_Cache(struct Block_Device *dev, uint_t
     cache->dev = dev;
     cache->fsBlockSize = fsBlockSize;
     cache->numCached = 0;
+    cache->numDelayed = 0;
     Clear_FS_Buffer_List(&cache->bufferList);
     Mutex_Init(&cache->lock);
     Cond_Init(&cache->cond);
@@ -271,6 +337,89 @@ int Sync_FS_Buffer_Cache(struct FS_Buffer_Cache *cache)
     return rc;
 }
 
+/*
+ * Write out the dirty buffers of count filesystem blocks from
+ * fsBlockNum on; those not in the cache are on disk already.
+ */
+int Sync_FS_Buffers(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, ulong_t count)
+{
+    int rc = 0;
+    struct FS_Buffer *buf;
+
+    Mutex_Lock(&cache->lock);
+    buf = Get_Front_Of_FS_Buffer_List(&cache->bufferList);
+    while (buf != 0) {
+	if (!(buf->flags & FS_BUFFER_DELAYED)
+	    && buf->fsBlockNum >= fsBlockNum && buf->fsBlockNum - fsBlockNum < count) {
+	    if ((rc = Sync_Buffer(cache, buf)) != 0)
+		break;
+	}
+	buf = Get_Next_In_FS_Buffer_List(buf);
+    }
+    Mutex_Unlock(&cache->lock);
+
+    return rc;
+}
+
+/*
+ * Write out the dirty buffers of the count filesystem blocks in blocks,
+ * in one pass over the cache; blocks is sorted in place first.
+ */
+int Sync_FS_Block_List(struct FS_Buffer_Cache *cache, ulong_t *blocks, ulong_t count)
+{
+    int rc = 0;
+    struct FS_Buffer *buf;
+    ulong_t i, j, lo, hi, block;
+
+    for (i = 1; i < count; i++) {
+	block = blocks[i];
+	for (j = i; j > 0 && blocks[j - 1] > block; j--)
+	    blocks[j] = blocks[j - 1];
+	blocks[j] = block;
+    }
+
+    Mutex_Lock(&cache->lock);
+    buf = Get_Front_Of_FS_Buffer_List(&cache->bufferList);
+    while (buf != 0) {
+	if (!(buf->flags & FS_BUFFER_DELAYED) && (buf->flags & FS_BUFFER_DIRTY)) {
+	    for (lo = 0, hi = count; lo < hi; ) {
+		j = (lo + hi) / 2;
+		if (blocks[j] < buf->fsBlockNum)
+		    lo = j + 1;
+		else
+		    hi = j;
+	    }
+	    if (lo < count && blocks[lo] == buf->fsBlockNum && (rc = Sync_Buffer(cache, buf)) != 0)
+		break;
+	}
+	buf = Get_Next_In_FS_Buffer_List(buf);
+    }
+    Mutex_Unlock(&cache->lock);
+
+    return rc;
+}
+
+/*
+ * Write out the dirty buffers holding owner's data
+ * (see Modify_FS_Owner_Buffer()), in one pass over the cache.
+ */
+int Sync_FS_Owner_Buffers(struct FS_Buffer_Cache *cache, void *owner)
+{
+    int rc = 0;
+    struct FS_Buffer *buf;
+
+    Mutex_Lock(&cache->lock);
+    buf = Get_Front_Of_FS_Buffer_List(&cache->bufferList);
+    while (buf != 0) {
+	if (buf->owner == owner && (rc = Sync_Buffer(cache, buf)) != 0)
+	    break;
+	buf = Get_Next_In_FS_Buffer_List(buf);
+    }
+    Mutex_Unlock(&cache->lock);
+
+    return rc;
+}
+
 /*
  * Destroy a filesystem buffer cache.
  * None of the buffers in the cache must be in use.
@@ -326,6 +475,17 @@ void Modify_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
     buf->flags |= FS_BUFFER_DIRTY;
 }
 
+/*
+ * Mark the given buffer as being modified on behalf of owner,
+ * whose data it then holds until it is reused for another block.
+ */
+void Modify_FS_Owner_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf, void *owner)
+{
+    KASSERT(buf->flags & FS_BUFFER_INUSE);
+    buf->flags |= FS_BUFFER_DIRTY;
+    buf->owner = owner;
+}
+
 /*
  * Explicitly synchronize given buffer with its on-disk storage,
  * without releasing the buffer.
@@ -370,3 +530,267 @@ int Release_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
     return rc;
 }
 
+/* ----------------------------------------------------------------------
+ * Delayed allocation
+ * ---------------------------------------------------------------------- */
+
+/*
+ * A filesystem may keep newly written data in a delayed buffer, named by
+ * (owner, logical block) rather than by a disk block, and give it a disk
+ * block later with Assign_FS_Buffer_Block(), many blocks at a time.
+ * Delayed buffers are never written back or evicted by the cache;
+ * the filesystem must assign or discard them.
+ */
+
+static struct FS_Buffer *Find_Delayed_Buffer(struct FS_Buffer_Cache *cache, void *owner, ulong_t lblock)
+{
+    struct FS_Buffer *buf = Get_Front_Of_FS_Buffer_List(&cache->bufferList);
+
+    while (buf != 0) {
+	if ((buf->flags & FS_BUFFER_DELAYED) && buf->owner == owner && buf->lblock == lblock)
+	    break;
+	buf = Get_Next_In_FS_Buffer_List(buf);
+    }
+    return buf;
+}
+
+/*
+ * Get the delayed buffer for logical block lblock of owner, and mark it
+ * in use. With create set a missing one is made, zero filled; otherwise
+ * that gives ENOTFOUND. Returns 1 if the buffer was created, 0 if found.
+ */
+int Get_FS_Delayed_Buffer(struct FS_Buffer_Cache *cache, void *owner, ulong_t lblock, bool create,
+    struct FS_Buffer **pBuf)
+{
+    struct FS_Buffer *buf, *lru;
+    int rc = 0;
+
+    Mutex_Lock(&cache->lock);
+
+    while ((buf = Find_Delayed_Buffer(cache, owner, lblock)) != 0 && (buf->flags & FS_BUFFER_INUSE))
+	Cond_Wait(&cache->cond, &cache->lock);
+
+    if (buf == 0) {
+	if (!create) {
+	    rc = ENOTFOUND;
+	    goto done;
+	}
+	Find_Buffer(cache, (ulong_t) -1, &lru);
+	if ((rc = Alloc_Buffer(cache, lru, &buf)) != 0)
+	    goto done;
+	memset(buf->data, '\0', cache->fsBlockSize);
+	buf->flags = FS_BUFFER_DELAYED | FS_BUFFER_DIRTY;
+	buf->owner = owner;
+	buf->lblock = lblock;
+	++cache->numDelayed;
+	rc = 1;
+    }
+
+    buf->flags |= FS_BUFFER_INUSE;
+    *pBuf = buf;
+
+done:
+    Mutex_Unlock(&cache->lock);
+    return rc;
+}
+
+/*
+ * Acquire up to max delayed buffers of owner, lowest logical blocks
+ * first, sorted by logical block. Buffers in use by someone else are
+ * passed over. Returns how many were stored in bufs.
+ */
+int Get_FS_Delayed_Buffers(struct FS_Buffer_Cache *cache, void *owner, struct FS_Buffer **bufs, int max)
+{
+    struct FS_Buffer *buf;
+    int count = 0, i;
+
+    Mutex_Lock(&cache->lock);
+
+    buf = Get_Front_Of_FS_Buffer_List(&cache->bufferList);
+    while (buf != 0) {
+	if ((buf->flags & FS_BUFFER_DELAYED) && buf->owner == owner && !(buf->flags & FS_BUFFER_INUSE)) {
+	    /* insertion sort, dropping the highest block when full */
+	    i = count < max ? count++ : max;
+	    while (i > 0 && bufs[i - 1]->lblock > buf->lblock) {
+		if (i < max)
+		    bufs[i] = bufs[i - 1];
+		--i;
+	    }
+	    if (i < max)
+		bufs[i] = buf;
+	}
+	buf = Get_Next_In_FS_Buffer_List(buf);
+    }
+
+    for (i = 0; i < count; ++i)
+	bufs[i]->flags |= FS_BUFFER_INUSE;
+
+    Mutex_Unlock(&cache->lock);
+    return count;
+}
+
+/*
+ * Tell whether owner has delayed buffers, in use or not.
+ */
+bool Has_FS_Delayed_Buffers(struct FS_Buffer_Cache *cache, void *owner)
+{
+    struct FS_Buffer *buf;
+    bool found = false;
+
+    Mutex_Lock(&cache->lock);
+
+    buf = cache->numDelayed > 0 ? Get_Front_Of_FS_Buffer_List(&cache->bufferList) : 0;
+    while (buf != 0 && !found) {
+	found = (buf->flags & FS_BUFFER_DELAYED) && buf->owner == owner;
+	buf = Get_Next_In_FS_Buffer_List(buf);
+    }
+
+    Mutex_Unlock(&cache->lock);
+    return found;
+}
+
+/*
+ * Turn a delayed buffer, in use by the caller, into the (dirty)
+ * buffer for disk block fsBlockNum.
+ */
+void Assign_FS_Buffer_Block(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf, ulong_t fsBlockNum)
+{
+    struct FS_Buffer *old;
+
+    KASSERT((buf->flags & (FS_BUFFER_DELAYED | FS_BUFFER_INUSE)) == (FS_BUFFER_DELAYED | FS_BUFFER_INUSE));
+
+    Mutex_Lock(&cache->lock);
+
+    /* A buffer left over from the block's previous owner is stale. */
+    old = Find_Buffer(cache, fsBlockNum, 0);
+    if (old != 0)
+	Forget_Buffer(cache, old);
+
+    buf->fsBlockNum = fsBlockNum;
+    buf->flags = (buf->flags & ~FS_BUFFER_DELAYED) | FS_BUFFER_DIRTY;
+    --cache->numDelayed;
+
+    Mutex_Unlock(&cache->lock);
+}
+
+/*
+ * Throw away all delayed buffers of owner, whose data is no longer wanted.
+ * Returns how many there were.
+ */
+int Discard_FS_Delayed_Buffers(struct FS_Buffer_Cache *cache, void *owner)
+{
+    struct FS_Buffer *buf;
+    int count = 0;
+
+    Mutex_Lock(&cache->lock);
+
+    buf = Get_Front_Of_FS_Buffer_List(&cache->bufferList);
+    while (buf != 0) {
+	if (!(buf->flags & FS_BUFFER_DELAYED) || buf->owner != owner) {
+	    buf = Get_Next_In_FS_Buffer_List(buf);
+	    continue;
+	}
+
+	if (buf->flags & FS_BUFFER_INUSE) {
+	    /* The list may change while we wait, so start over. */
+	    Cond_Wait(&cache->cond, &cache->lock);
+	} else {
+	    Remove_From_FS_Buffer_List(&cache->bufferList, buf);
+	    Free_Buffer(buf);
+	    --cache->numCached;
+	    --cache->numDelayed;
+	    ++count;
+	}
+	buf = Get_Front_Of_FS_Buffer_List(&cache->bufferList);
+    }
+
+    Mutex_Unlock(&cache->lock);
+    return count;
+}
+
+/* ----------------------------------------------------------------------
+ * Direct I/O
+ * ---------------------------------------------------------------------- */
+
+/*
+ * A filesystem may move whole blocks between the disk and memory of
+ * its own without caching them, for data that is streamed through
+ * once. The cache stays coherent: a block it holds is read from its
+ * buffer, and a block written directly loses its buffer.
+ * The caller makes sure nobody else uses the blocks meanwhile.
+ */
+
+/*
+ * Read or write count blocks from fsBlockNum on
+ * from or to data, bypassing the cache.
+ */
+int Direct_FS_IO(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, ulong_t count, void *data, bool write)
+{
+    struct FS_Buffer *buf;
+    char *ptr = (char*) data;
+    ulong_t i;
+    int rc = 0;
+
+    for (i = 0; i < count && rc == 0; ++i, ++fsBlockNum, ptr += cache->fsBlockSize) {
+	Mutex_Lock(&cache->lock);
+	buf = Find_Buffer(cache, fsBlockNum, 0);
+	while (buf != 0 && (buf->flags & FS_BUFFER_INUSE)) {
+	    Cond_Wait(&cache->cond, &cache->lock);
+	    buf = Find_Buffer(cache, fsBlockNum, 0);
+	}
+
+	if (write) {
+	    /* What the buffer holds is out of date once the disk is written. */
+	    if (buf != 0)
+		Forget_Buffer(cache, buf);
+	} else if (buf != 0) {
+	    /* The buffer may be newer than the disk. */
+	    memcpy(ptr, buf->data, cache->fsBlockSize);
+	    Mutex_Unlock(&cache->lock);
+	    continue;
+	}
+	Mutex_Unlock(&cache->lock);
+
+	/* The cache holds nothing of it now; the rest of the cache is free meanwhile. */
+	rc = Do_Block_IO(cache, fsBlockNum, ptr, write ? Block_Write : Block_Read);
+    }
+
+    return rc;
+}
+
+/* ----------------------------------------------------------------------
+ * Pinning
+ * ---------------------------------------------------------------------- */
+
+/*
+ * A pinned buffer is dirty but is neither written back nor evicted
+ * until it is unpinned; a journal uses this to keep modified metadata
+ * off its home location until the journal has a copy.
+ * Pin_FS_Buffer() is called with the buffer in use; pinning a
+ * pinned buffer does nothing.
+ */
+void Pin_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
+{
+    KASSERT(buf->flags & FS_BUFFER_INUSE);
+
+    Mutex_Lock(&cache->lock);
+    buf->flags |= FS_BUFFER_PINNED | FS_BUFFER_DIRTY;
+    Mutex_Unlock(&cache->lock);
+}
+
+/*
+ * Let a pinned buffer go to disk with the rest of the cache.
+ */
+void Unpin_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
+{
+    KASSERT(buf->flags & FS_BUFFER_PINNED);
+
+    Mutex_Lock(&cache->lock);
+    if (buf->flags & FS_BUFFER_REVOKED) {
+	/* No longer in the cache; see Assign_FS_Buffer_Block(). */
+	buf->flags = 0;
+	Free_Buffer(buf);
+    } else
+	buf->flags &= ~(FS_BUFFER_PINNED);
+    Mutex_Unlock(&cache->lock);
+}
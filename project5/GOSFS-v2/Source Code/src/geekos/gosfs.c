@@ -15,6 +15,11 @@
 #include <geekos/string.h>
 #include <geekos/bitset.h>
 #include <geekos/synch.h>
+#include <geekos/int.h>
+#include <geekos/kthread.h>
+#include <geekos/timer.h>
+#include <geekos/mem.h>
+#include <geekos/blockdev.h>
 #include <geekos/bufcache.h>
 #include <geekos/gosfs.h>
 #include <geekos/user.h>
@@ -26,14 +31,20 @@ int debugGOSFS = 0;
 /* ----------------------------------------------------------------------
  * Private data and functions
  * ---------------------------------------------------------------------- */
-static struct FS_Buffer_Cache * gosfsBufferCache;
 static struct VNode_List vnodeList;
 static struct File *stdIn, *stdOut;
+// what a read of a hole returns: a block that is never written
+static char s_zeroBlock[GOSFS_FS_BLOCK_SIZE];
 //static struct GOSFS_Inode * currentDir;
 
-#define FIND_INODEBLOCK_AND_INODEOFFSET(bitPos,blockNum,inodeOffset)	\
+// the in-core superblock, buffer cache and geometry of the volume at mountPoint
+#define GOSFS_SB(mountPoint)	((struct GOSFS_Superblock *)(mountPoint)->fsData)
+#define GOSFS_CACHE(mountPoint)	(GOSFS_SB(mountPoint)->cache)
+#define GOSFS_GEOMETRY(mountPoint)	(GOSFS_SB(mountPoint)->gfsInstance)
+
+#define FIND_INODEBLOCK_AND_INODEOFFSET(mountPoint,bitPos,blockNum,inodeOffset)	\
 do {						\
-    blockNum = bitPos / GOSFS_DIR_ENTRIES_PER_BLOCK + 2;			\
+    blockNum = bitPos / GOSFS_DIR_ENTRIES_PER_BLOCK + GOSFS_GEOMETRY(mountPoint).inodeTableStart;	\
     inodeOffset = bitPos % GOSFS_DIR_ENTRIES_PER_BLOCK;				\
 } while (0)
 
@@ -49,6 +60,596 @@ do {						\
 	blockOffset = filePoz % GOSFS_NUM_PTRS_PER_BLOCK;				\
 }while(0)
 
+/* ----------------------------------------------------------------------
+ * Metadata journal
+ * ---------------------------------------------------------------------- */
+// On a volume formatted with the "journal" option, changed metadata blocks
+// (the superblock, inode blocks, directory, indirect and extent blocks) are
+// pinned in the buffer cache with Journal_Dirty instead of going straight
+// home. Every operation that changes metadata runs between Journal_Start
+// and Journal_Stop, and all changes made meanwhile form one transaction.
+// Once GOSFS_JOURNAL_COMMIT_AT blocks are waiting, or on sync, the
+// transaction is committed: copies of its blocks are written one after the
+// other into the log, followed by a commit block, and the blocks are
+// unpinned so they reach home with the rest of the cache. When a commit
+// leaves too little log for the biggest transaction, and on sync, the
+// cache is synced and the log emptied (checkpointed) right away, while
+// the commit still keeps out new operations: nothing is pinned then, so
+// every block the log holds reaches home before the tail moves past it.
+// GOSFS_Mount replays committed transactions the log still holds.
+// Lock order: journal lock before the superblock lock and any FS_Buffer;
+// a commit only runs while no operation is in progress.
+// Each mounted volume has its journal in its GOSFS_Superblock.
+// An operation names, in credits, how many blocks it may change at most,
+// and Journal_Start sets that much room aside in the running transaction,
+// committing it first if it is too full; so a transaction never outgrows
+// GOSFS_JOURNAL_MAX_TRANS. What may change any number of blocks (writing,
+// giving delayed data its blocks) checks Journal_Room as it goes and
+// leaves the rest to a handle of its own. A thread has one handle at a time.
+
+// Credits of the calling thread's open handle, 0 if it has none
+static tlocal_key_t s_journalCreditsKey;
+
+// Read or write journal block blockNum of dev directly, bypassing the cache
+static int Journal_IO(struct Block_Device *dev, ulong_t blockNum, void *data, bool write)
+{
+	int sectors = GOSFS_FS_BLOCK_SIZE / SECTOR_SIZE;
+	int sector = blockNum * sectors;
+	char *ptr = (char *)data;
+	int i, rc;
+
+	for (i = 0; i < sectors; i++, sector++, ptr += SECTOR_SIZE)
+	{
+		rc = write ? Block_Write(dev, sector, ptr) : Block_Read(dev, sector, ptr);
+		if (rc != 0) return rc;
+	}
+	return 0;
+}
+
+// Disk block of log offset pos
+static ulong_t Journal_Block(struct GOSFS_Journal *journal, ulong_t pos)
+{
+	return journal->start + 1 + pos % journal->len;
+}
+
+static int Journal_Write_Super(struct Mount_Point *mountPoint)
+{
+	struct GOSFS_Journal *journal = &GOSFS_SB(mountPoint)->journal;
+	struct GOSFS_Journal_Header *hdr = (struct GOSFS_Journal_Header *)journal->page;
+
+	memset(hdr, '\0', GOSFS_FS_BLOCK_SIZE);
+	hdr->magic = GOSFS_JOURNAL_MAGIC;
+	hdr->type = GOSFS_JOURNAL_SUPER;
+	hdr->sequence = journal->tailSequence;
+	hdr->tail = journal->tail;
+	return Journal_IO(mountPoint->dev, journal->start, hdr, true);
+}
+
+static int Journal_Commit_Locked(struct Mount_Point *mountPoint, bool checkpoint);
+
+// Begin an operation that may change up to credits metadata blocks.
+// A commit waits for the operations in progress, so the caller may hold
+// no inode lock here.
+static void Journal_Start(struct Mount_Point *mountPoint, int credits)
+{
+	struct GOSFS_Journal *journal = &GOSFS_SB(mountPoint)->journal;
+
+	if (!journal->enabled) return;
+
+	KASSERT(credits > 0 && credits <= GOSFS_JOURNAL_MAX_CREDITS);
+	KASSERT(Tlocal_Get(s_journalCreditsKey) == 0);
+	Mutex_Lock(&journal->lock);
+	for (;;)
+	{
+		while (journal->committing)
+			Cond_Wait(&journal->cond, &journal->lock);
+		if (journal->count + journal->reserved + credits <= GOSFS_JOURNAL_MAX_CREDITS)
+			break;
+		// too full for us: commit what the others have done so far
+		if (Journal_Commit_Locked(mountPoint, false) < 0)
+			break;
+	}
+	journal->reserved += credits;
+	journal->handles++;
+	Mutex_Unlock(&journal->lock);
+	Tlocal_Put(s_journalCreditsKey, (void *)credits);
+}
+
+// How many more blocks the caller's operation can change
+static int Journal_Room(struct Mount_Point *mountPoint)
+{
+	struct GOSFS_Journal *journal = &GOSFS_SB(mountPoint)->journal;
+	int room;
+
+	if (!journal->enabled) return GOSFS_JOURNAL_MAX_CREDITS;
+
+	// what the others have set aside is theirs
+	Mutex_Lock(&journal->lock);
+	room = GOSFS_JOURNAL_MAX_CREDITS - journal->count - journal->reserved
+		+ (int)Tlocal_Get(s_journalCreditsKey);
+	Mutex_Unlock(&journal->lock);
+	return room;
+}
+
+// Credits for an operation that frees any number of blocks: it may clear
+// bits in every block bitmap block, up to as many as a transaction holds
+static int Journal_Free_Credits(struct Mount_Point *mountPoint)
+{
+	int credits = GOSFS_JOURNAL_OP_CREDITS + GOSFS_SB(mountPoint)->gfsInstance.blockBitmapBlocks;
+
+	return credits < GOSFS_JOURNAL_MAX_CREDITS ? credits : GOSFS_JOURNAL_MAX_CREDITS;
+}
+
+// Mark metadata buffer buf, which the caller has in use, as changed
+static void Journal_Dirty(struct Mount_Point *mountPoint, struct FS_Buffer *buf)
+{
+	struct GOSFS_Journal *journal = &GOSFS_SB(mountPoint)->journal;
+
+	if (!journal->enabled)
+	{
+		Modify_FS_Buffer(GOSFS_CACHE(mountPoint), buf);
+		return;
+	}
+
+	Mutex_Lock(&journal->lock);
+	if (buf->flags & FS_BUFFER_PINNED)
+		; // already in the running transaction
+	else
+	{
+		// room for it was set aside by Journal_Start; a full transaction
+		// means an operation changed more than it took credits for
+		KASSERT(journal->count < GOSFS_JOURNAL_MAX_CREDITS);
+		Pin_FS_Buffer(GOSFS_CACHE(mountPoint), buf);
+		journal->bufs[journal->count++] = buf;
+	}
+	Mutex_Unlock(&journal->lock);
+}
+
+// Write everything home and empty the log. Only called by a commit, once
+// its transaction is in the log: no buffer is pinned and no operation can
+// pin one meanwhile.
+static int Journal_Checkpoint_Locked(struct Mount_Point *mountPoint)
+{
+	struct GOSFS_Journal *journal = &GOSFS_SB(mountPoint)->journal;
+	int rc;
+
+	KASSERT(journal->committing && journal->handles == 0 && journal->count == 0);
+	rc = Sync_FS_Buffer_Cache(GOSFS_CACHE(mountPoint));
+	if (rc < 0) return rc;
+	journal->tail = journal->head;
+	journal->tailSequence = journal->sequence;
+	return Journal_Write_Super(mountPoint);
+}
+
+// Write the running transaction to the log, and checkpoint if asked to or
+// if the log is getting full. Called with the journal lock held.
+static int Journal_Commit_Locked(struct Mount_Point *mountPoint, bool checkpoint)
+{
+	struct GOSFS_Journal *journal = &GOSFS_SB(mountPoint)->journal;
+	struct GOSFS_Superblock *gosfsSuperBlock = GOSFS_SB(mountPoint);
+	struct GOSFS_Journal_Header *hdr = (struct GOSFS_Journal_Header *)journal->page;
+	struct FS_Buffer *sbBuf;
+	ulong_t used;
+	int i, rc = 0;
+
+	// one commit at a time, and no operation half done
+	while (journal->committing)
+		Cond_Wait(&journal->cond, &journal->lock);
+	journal->committing = true;
+	while (journal->handles > 0)
+		Cond_Wait(&journal->cond, &journal->lock);
+
+	// the in-core superblock goes in with its block
+	if (gosfsSuperBlock->dirty)
+	{
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), GOSFS_SUPER_BLOCK_NUM, &sbBuf);
+		if (rc < 0) goto done;
+		memcpy(sbBuf->data, &gosfsSuperBlock->gfsInstance, sizeof(struct GOSFS_Instance));
+		if (!(sbBuf->flags & FS_BUFFER_PINNED))
+		{
+			Pin_FS_Buffer(GOSFS_CACHE(mountPoint), sbBuf);
+			journal->bufs[journal->count++] = sbBuf;
+		}
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), sbBuf);
+		gosfsSuperBlock->dirty = false;
+	}
+	if (journal->count == 0)
+		goto checkpoint;
+
+	// the checkpoint after the last commit left room, unless it failed;
+	// the blocks stay pinned then, and the next commit tries again
+	used = (journal->head + journal->len - journal->tail) % journal->len;
+	if (used + journal->count + 2 >= journal->len)
+	{
+		rc = EIO;
+		goto done;
+	}
+
+	// descriptor, copies, commit block
+	memset(hdr, '\0', GOSFS_FS_BLOCK_SIZE);
+	hdr->magic = GOSFS_JOURNAL_MAGIC;
+	hdr->type = GOSFS_JOURNAL_DESCRIPTOR;
+	hdr->sequence = journal->sequence;
+	hdr->count = journal->count;
+	for (i = 0; i < journal->count; i++)
+		hdr->blockNum[i] = journal->bufs[i]->fsBlockNum;
+	rc = Journal_IO(mountPoint->dev, Journal_Block(journal, journal->head), hdr, true);
+	for (i = 0; rc == 0 && i < journal->count; i++)
+		rc = Journal_IO(mountPoint->dev, Journal_Block(journal, journal->head + 1 + i),
+			journal->bufs[i]->data, true);
+	if (rc == 0)
+	{
+		hdr->type = GOSFS_JOURNAL_COMMIT;
+		rc = Journal_IO(mountPoint->dev, Journal_Block(journal, journal->head + 1 + journal->count), hdr, true);
+	}
+	if (rc != 0) goto done; // still pinned; the next commit tries again
+
+	Debug("journal: committed %d blocks, sequence %lu\n", journal->count, journal->sequence);
+	for (i = 0; i < journal->count; i++)
+		Unpin_FS_Buffer(GOSFS_CACHE(mountPoint), journal->bufs[i]);
+	journal->head = (journal->head + journal->count + 2) % journal->len;
+	journal->sequence++;
+	journal->count = 0;
+
+checkpoint:
+	used = (journal->head + journal->len - journal->tail) % journal->len;
+	if (used > 0 && (checkpoint || used + GOSFS_JOURNAL_MAX_TRANS + 2 >= journal->len))
+		rc = Journal_Checkpoint_Locked(mountPoint);
+
+done:
+	journal->committing = false;
+	Cond_Broadcast(&journal->cond);
+	return rc;
+}
+
+// End an operation begun with Journal_Start; commits when enough is waiting
+static void Journal_Stop(struct Mount_Point *mountPoint)
+{
+	struct GOSFS_Journal *journal = &GOSFS_SB(mountPoint)->journal;
+
+	if (!journal->enabled) return;
+
+	Mutex_Lock(&journal->lock);
+	KASSERT(journal->handles > 0);
+	journal->reserved -= (int)Tlocal_Get(s_journalCreditsKey);
+	Tlocal_Put(s_journalCreditsKey, 0);
+	if (--journal->handles == 0)
+	{
+		Cond_Broadcast(&journal->cond);
+		if (journal->count >= GOSFS_JOURNAL_COMMIT_AT && !journal->committing)
+			Journal_Commit_Locked(mountPoint, false);
+	}
+	Mutex_Unlock(&journal->lock);
+}
+
+// Commit the running transaction, without writing anything home
+static int Journal_Commit(struct Mount_Point *mountPoint)
+{
+	struct GOSFS_Journal *journal = &GOSFS_SB(mountPoint)->journal;
+	int rc;
+
+	Mutex_Lock(&journal->lock);
+	rc = Journal_Commit_Locked(mountPoint, false);
+	Mutex_Unlock(&journal->lock);
+	return rc;
+}
+
+// Commit, write everything home and empty the log; no operation
+// starts until it is done
+static int Journal_Sync(struct Mount_Point *mountPoint)
+{
+	struct GOSFS_Journal *journal = &GOSFS_SB(mountPoint)->journal;
+	int rc;
+
+	Mutex_Lock(&journal->lock);
+	rc = Journal_Commit_Locked(mountPoint, true);
+	Mutex_Unlock(&journal->lock);
+	return rc;
+}
+
+// Replay the transactions committed to the journal at start, of size blocks,
+// into the buffer cache and get the journal going
+static int Journal_Load(struct Mount_Point *mountPoint, ulong_t start, ulong_t blocks)
+{
+	struct GOSFS_Journal *journal = &GOSFS_SB(mountPoint)->journal;
+	struct GOSFS_Journal_Header *hdr;
+	struct FS_Buffer *homeBuf;
+	ulong_t homes[GOSFS_JOURNAL_MAX_TRANS];
+	ulong_t pos, sequence, count, i;
+	int rc, replayed = 0;
+
+	if (journal->page == 0)
+		journal->page = Alloc_Page();
+	if (journal->page == 0) return ENOMEM;
+	hdr = (struct GOSFS_Journal_Header *)journal->page;
+	journal->start = start;
+	journal->len = blocks - 1;
+
+	rc = Journal_IO(mountPoint->dev, start, hdr, false);
+	if (rc != 0) return rc;
+	if (hdr->magic != GOSFS_JOURNAL_MAGIC || hdr->type != GOSFS_JOURNAL_SUPER)
+		return EINVALID;
+	pos = hdr->tail;
+	sequence = hdr->sequence;
+
+	for (;;)
+	{
+		rc = Journal_IO(mountPoint->dev, Journal_Block(journal, pos), hdr, false);
+		if (rc != 0) return rc;
+		if (hdr->magic != GOSFS_JOURNAL_MAGIC || hdr->type != GOSFS_JOURNAL_DESCRIPTOR
+			|| hdr->sequence != sequence || hdr->count > GOSFS_JOURNAL_MAX_TRANS)
+			break;
+		count = hdr->count;
+		memcpy(homes, hdr->blockNum, count * sizeof(ulong_t));
+
+		// a transaction without its commit block never happened
+		rc = Journal_IO(mountPoint->dev, Journal_Block(journal, pos + 1 + count), hdr, false);
+		if (rc != 0) return rc;
+		if (hdr->magic != GOSFS_JOURNAL_MAGIC || hdr->type != GOSFS_JOURNAL_COMMIT
+			|| hdr->sequence != sequence)
+			break;
+
+		for (i = 0; i < count; i++)
+		{
+			rc = Journal_IO(mountPoint->dev, Journal_Block(journal, pos + 1 + i), hdr, false);
+			if (rc != 0) return rc;
+			rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), homes[i], &homeBuf);
+			if (rc < 0) return rc;
+			memcpy(homeBuf->data, hdr, GOSFS_FS_BLOCK_SIZE);
+			Modify_FS_Buffer(GOSFS_CACHE(mountPoint), homeBuf);
+			Release_FS_Buffer(GOSFS_CACHE(mountPoint), homeBuf);
+		}
+		pos = (pos + count + 2) % journal->len;
+		sequence++;
+		replayed++;
+	}
+	if (replayed > 0)
+	{
+		Print("gosfs: replayed %d journal transactions\n", replayed);
+		rc = Sync_FS_Buffer_Cache(GOSFS_CACHE(mountPoint));
+		if (rc < 0) return rc;
+	}
+
+	// the log is empty from here on
+	journal->head = journal->tail = pos;
+	journal->sequence = journal->tailSequence = sequence;
+	journal->handles = 0;
+	journal->committing = false;
+	journal->count = 0;
+	rc = Journal_Write_Super(mountPoint);
+	if (rc != 0) return rc;
+	journal->enabled = true;
+	return 0;
+}
+
+// Write an empty journal of size blocks at start, at format time
+static int Journal_Create(struct Block_Device *dev, ulong_t start, ulong_t blocks)
+{
+	struct GOSFS_Journal_Header *hdr;
+	int rc;
+
+	hdr = (struct GOSFS_Journal_Header *)Alloc_Page();
+	if (hdr == 0) return ENOMEM;
+
+	// sequence numbers start somewhere new, so no leftover of an
+	// earlier journal on this disk can pass for a transaction
+	memset(hdr, '\0', GOSFS_FS_BLOCK_SIZE);
+	rc = Journal_IO(dev, start + 1, hdr, true);
+	if (rc == 0)
+	{
+		hdr->magic = GOSFS_JOURNAL_MAGIC;
+		hdr->type = GOSFS_JOURNAL_SUPER;
+		hdr->sequence = (g_numTicks << 16) + 1;
+		hdr->tail = 0;
+		rc = Journal_IO(dev, start, hdr, true);
+	}
+	Free_Page(hdr);
+	return rc;
+}
+
+/* ----------------------------------------------------------------------
+ * On-disk bitmaps
+ * ---------------------------------------------------------------------- */
+// The inode and block bitmaps live in blocks of their own, from
+// inodeBitmapStart and blockBitmapStart on, and are read and changed
+// through the buffer cache a block at a time, so only the parts in use
+// take memory. The superblock lock serializes allocation. Each bitmap block
+// is an allocation group with its own free count, so a full one is passed
+// over without being read. Free data blocks in a preallocation window
+// (see Allocate_File_Block) are only taken once no others are left.
+
+// If bits from bit on, len of them, overlap a preallocation window in
+// count, return the bit right after the window, otherwise 0
+static ulong_t Prealloc_Overlap(struct Mount_Point *mountPoint, struct GOSFS_Free_Count *count,
+	ulong_t bit, ulong_t len)
+{
+	ulong_t first = GOSFS_SB(mountPoint)->gfsInstance.firstDataBlock;
+	struct GOSFS_Inode *iNode;
+
+	for (iNode = count->windows; iNode != 0; iNode = iNode->preallocNext)
+	{
+		if (bit < iNode->preallocStart - first + iNode->preallocLen
+			&& iNode->preallocStart - first < bit + len)
+			return iNode->preallocStart - first + iNode->preallocLen;
+	}
+	return 0;
+}
+
+// Find a run of len free bits of the bitmap at start, which has totalBits
+// bits and whose free bits are counted in count, without marking them.
+// The search begins at *pCursor and wraps around; a run never spans two
+// bitmap blocks. Returns the first bit of the run (and moves the cursor
+// past it), or ENOSPACE.
+static int Bitmap_Find(struct Mount_Point *mountPoint, ulong_t start, ulong_t totalBits,
+	struct GOSFS_Free_Count *count, ulong_t *pCursor, uint_t len)
+{
+	ulong_t numBlocks = (totalBits + GOSFS_BITS_PER_BLOCK - 1) / GOSFS_BITS_PER_BLOCK;
+	ulong_t first = *pCursor < totalBits ? *pCursor : 0;
+	ulong_t k, b, from, bits, end;
+	int pass, pos, rc;
+	struct FS_Buffer *buf;
+
+	if (count->free < len)
+		return ENOSPACE;
+
+	// the cursor's block from the cursor on, all the others,
+	// then the cursor's block again from its beginning; once more
+	// over the preallocation windows if that found nothing
+	for (pass = 0; pass < (count->windows != 0 ? 2 : 1); pass++)
+	{
+		for (k = 0; k <= numBlocks; k++)
+		{
+			b = (first / GOSFS_BITS_PER_BLOCK + k) % numBlocks;
+			if (count->groupFree[b] < len)
+				continue;
+			from = k == 0 ? first % GOSFS_BITS_PER_BLOCK : 0;
+			bits = totalBits - b * GOSFS_BITS_PER_BLOCK;
+			if (bits > GOSFS_BITS_PER_BLOCK)
+				bits = GOSFS_BITS_PER_BLOCK;
+
+			rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), start + b, &buf);
+			if (rc < 0) return rc;
+			pos = Find_N_Free_From(buf->data, len, from, bits);
+			while (pass == 0 && pos >= 0
+				&& (end = Prealloc_Overlap(mountPoint, count, b * GOSFS_BITS_PER_BLOCK + pos, len)) != 0)
+				pos = Find_N_Free_From(buf->data, len, end - b * GOSFS_BITS_PER_BLOCK, bits);
+			Release_FS_Buffer(GOSFS_CACHE(mountPoint), buf);
+			if (pos >= 0)
+			{
+				*pCursor = b * GOSFS_BITS_PER_BLOCK + pos + len;
+				return b * GOSFS_BITS_PER_BLOCK + pos;
+			}
+		}
+	}
+	return ENOSPACE;
+}
+
+// Mark the len bits from bit on, which are in one bitmap block, as used,
+// if they are all free; otherwise return ENOSPACE
+static int Bitmap_Mark(struct Mount_Point *mountPoint, ulong_t start, struct GOSFS_Free_Count *count,
+	ulong_t bit, ulong_t len)
+{
+	ulong_t b = bit / GOSFS_BITS_PER_BLOCK, pos = bit % GOSFS_BITS_PER_BLOCK, i;
+	struct FS_Buffer *buf;
+	int rc;
+
+	if (count->free < len)
+		return ENOSPACE;
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), start + b, &buf);
+	if (rc < 0) return rc;
+	for (i = 0; i < len; i++)
+	{
+		if (Is_Bit_Set(buf->data, pos + i))
+		{
+			Release_FS_Buffer(GOSFS_CACHE(mountPoint), buf);
+			return ENOSPACE;
+		}
+	}
+	for (i = 0; i < len; i++)
+		Set_Bit(buf->data, pos + i);
+	Journal_Dirty(mountPoint, buf);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), buf);
+	count->groupFree[b] -= len;
+	count->free -= len;
+	return 0;
+}
+
+// Find a run of len free bits as Bitmap_Find does, and mark it as used
+static int Bitmap_Alloc(struct Mount_Point *mountPoint, ulong_t start, ulong_t totalBits,
+	struct GOSFS_Free_Count *count, ulong_t *pCursor, uint_t len)
+{
+	int bit, rc;
+
+	bit = Bitmap_Find(mountPoint, start, totalBits, count, pCursor, len);
+	if (bit < 0) return bit;
+	rc = Bitmap_Mark(mountPoint, start, count, bit, len);
+	return rc < 0 ? rc : bit;
+}
+
+// Mark len bits from bit on as free; only the ones that were used are counted
+static int Bitmap_Free(struct Mount_Point *mountPoint, ulong_t start, struct GOSFS_Free_Count *count,
+	ulong_t bit, ulong_t len)
+{
+	struct FS_Buffer *buf;
+	ulong_t b, n;
+	int rc;
+
+	while (len > 0)
+	{
+		b = bit / GOSFS_BITS_PER_BLOCK;
+		n = GOSFS_BITS_PER_BLOCK - bit % GOSFS_BITS_PER_BLOCK;
+		if (n > len) n = len;
+
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), start + b, &buf);
+		if (rc < 0) return rc;
+		for (len -= n; n > 0; n--, bit++)
+		{
+			if (!Is_Bit_Set(buf->data, bit % GOSFS_BITS_PER_BLOCK))
+				continue;
+			Clear_Bit(buf->data, bit % GOSFS_BITS_PER_BLOCK);
+			count->groupFree[b]++;
+			count->free++;
+		}
+		Journal_Dirty(mountPoint, buf);
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), buf);
+	}
+	return 0;
+}
+
+// Count the free bits of the bitmap at start, which has totalBits bits, into count
+static int Bitmap_Count(struct Mount_Point *mountPoint, ulong_t start, ulong_t totalBits,
+	struct GOSFS_Free_Count *count)
+{
+	struct FS_Buffer *buf;
+	ulong_t b, i, bits;
+	int rc;
+
+	count->numGroups = (totalBits + GOSFS_BITS_PER_BLOCK - 1) / GOSFS_BITS_PER_BLOCK;
+	count->groupFree = (ulong_t *)Malloc(count->numGroups * sizeof(ulong_t));
+	if (count->groupFree == 0)
+		return ENOMEM;
+	count->free = 0;
+
+	for (b = 0; b < count->numGroups; b++)
+	{
+		bits = totalBits - b * GOSFS_BITS_PER_BLOCK;
+		if (bits > GOSFS_BITS_PER_BLOCK)
+			bits = GOSFS_BITS_PER_BLOCK;
+
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), start + b, &buf);
+		if (rc < 0) return rc;
+		count->groupFree[b] = 0;
+		for (i = 0; i < bits; i++)
+			if (!Is_Bit_Set(buf->data, i))
+				count->groupFree[b]++;
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), buf);
+		count->free += count->groupFree[b];
+	}
+	return 0;
+}
+
+// Write blocks zeroed bitmap blocks from start on, with the first used bits set
+static int Bitmap_Format(struct FS_Buffer_Cache *cache, ulong_t start, ulong_t blocks, ulong_t used)
+{
+	struct FS_Buffer *buf;
+	ulong_t b, i;
+	int rc;
+
+	for (b = 0; b < blocks; b++)
+	{
+		rc = Get_FS_Buffer(cache, start + b, &buf);
+		if (rc < 0) return rc;
+		memset(buf->data, '\0', GOSFS_FS_BLOCK_SIZE);
+		for (i = b * GOSFS_BITS_PER_BLOCK; i < used && i < (b + 1) * GOSFS_BITS_PER_BLOCK; i++)
+			Set_Bit(buf->data, i % GOSFS_BITS_PER_BLOCK);
+		Modify_FS_Buffer(cache, buf);
+		rc = Sync_FS_Buffer(cache, buf);
+		Release_FS_Buffer(cache, buf);
+		if (rc < 0) return rc;
+	}
+	return 0;
+}
+
 void Init_GOSFS_BootSector(struct FS_Buffer * gosfsBootSector)
 {
 	memset(gosfsBootSector->data, '\0', GOSFS_FS_BLOCK_SIZE);
@@ -56,26 +657,37 @@ void Init_GOSFS_BootSector(struct FS_Buffer * gosfsBootSector)
 	return ;
 }
 
-void Init_GOSFS_Instance(struct GOSFS_Instance * gosInstance, struct FS_Buffer * gosSuperBlock, struct Block_Device * dev)
+// Work out the layout of a volume on dev
+int Init_GOSFS_Instance(struct GOSFS_Instance * gosInstance, struct Block_Device * dev)
 {
-	int i;
+	ulong_t numBlocks = Get_Num_Blocks(dev) / (GOSFS_FS_BLOCK_SIZE / SECTOR_SIZE);
+	ulong_t numInodes;
+
+	memset(gosInstance, '\0', sizeof(struct GOSFS_Instance));
 	gosInstance->magic = GOSFS_MAGIC;
-	gosInstance->numLogicBlocks = GOSFS_NUM_BLOCK;
-	gosInstance->numInodes = GOSFS_NUM_INODE;
+	gosInstance->numLogicBlocks = numBlocks;
 	gosInstance->dev = dev;
-	gosInstance->firstDataBlock = GOSFS_FIRST_DATA_BLOCK; // this is 102;
-	
-	memset(gosInstance->inodeBitmapVector, '\0', GOSFS_NUM_INODE_BITMAP_BYTES);
-	gosInstance->inodeBitmapVector[0] = 3; // 0000 0011 first two nodes(0, 1) in use
-	for(i = GOSFS_NUM_INODE_BITMAP_INUSE -1; i < GOSFS_NUM_INODE_BITMAP_BYTES; i++)
-		gosInstance->inodeBitmapVector[i] = 0xff; // 11111111, in use
-	
-	memset(gosInstance->blockBitmapVector, '\0', GOSFS_NUM_BLOCK_BITMAP_BYTES);
-	// ERROR:gosInstance->blockBitmapVector[0] = 1; // 0000 0001 first block(num 102) is for the root dir
-	for(i = GOSFS_NUM_BLOCK_BITMAP_INUSE -1; i < GOSFS_NUM_BLOCK_BITMAP_BYTES; i++)
-		gosInstance->blockBitmapVector[i] = 0xff; // 11111111 in use
 
-	return;
+	// whole inode table blocks
+	numInodes = numBlocks / GOSFS_BLOCKS_PER_INODE;
+	if (numInodes < GOSFS_MIN_INODES)
+		numInodes = GOSFS_MIN_INODES;
+	gosInstance->inodeTableBlocks = (numInodes + GOSFS_DIR_ENTRIES_PER_BLOCK - 1) / GOSFS_DIR_ENTRIES_PER_BLOCK;
+	gosInstance->numInodes = gosInstance->inodeTableBlocks * GOSFS_DIR_ENTRIES_PER_BLOCK;
+
+	// the block bitmap covers the whole volume; a little of it is never used
+	gosInstance->inodeBitmapStart = GOSFS_SUPER_BLOCK_NUM + 1;
+	gosInstance->inodeBitmapBlocks = (gosInstance->numInodes + GOSFS_BITS_PER_BLOCK - 1) / GOSFS_BITS_PER_BLOCK;
+	gosInstance->blockBitmapStart = gosInstance->inodeBitmapStart + gosInstance->inodeBitmapBlocks;
+	gosInstance->blockBitmapBlocks = (numBlocks + GOSFS_BITS_PER_BLOCK - 1) / GOSFS_BITS_PER_BLOCK;
+	gosInstance->inodeTableStart = gosInstance->blockBitmapStart + gosInstance->blockBitmapBlocks;
+	gosInstance->firstDataBlock = gosInstance->inodeTableStart + gosInstance->inodeTableBlocks;
+
+	if (numBlocks < gosInstance->firstDataBlock + GOSFS_MIN_DATA_BLOCKS)
+		return ENOSPACE;
+	gosInstance->numDataBlocks = numBlocks - gosInstance->firstDataBlock;
+
+	return 0;
 }
 
 void Init_GOSFS_Rootdir(struct GOSFS_Dir_Entry * rootDirEntry)
@@ -106,18 +718,19 @@ int Init_GOSFS_Dir_Entry(struct GOSFS_Dir_Entry * dirEntry, char* filename, ulon
 	Debug("  name:%s\n", dirEntry->filename);
 	dirEntry->flags = flags;
 	dirEntry->size = 0; // at first the size of the file is 0
-	for(i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; i++)
+	for(i = 0; i < GOSFS_NUM_BLOCK_PTRS; i++)
 		dirEntry->blockList[i] = 0; // no block is allocated to the file
+	memset(dirEntry->acl, '\0', sizeof(dirEntry->acl)); // nor inline data
 
 	return 0;
 }
 
-// Allocate an inode from superBlock and initialize it
-int Allocate_Inode(struct Mount_Point * mountPoint, struct GOSFS_Dir_Entry **pDirEntry, char * filename, ulong_t flags)
+// Allocate an inode from superBlock and initialize it on disk;
+// use Iget() to get it in core
+int Allocate_Inode(struct Mount_Point * mountPoint, char * filename, ulong_t flags)
 {
 	struct GOSFS_Superblock *gosSuperBlock = (struct GOSFS_Superblock *)(mountPoint->fsData);
 	struct GOSFS_Dir_Block *dirBlock;
-	struct GOSFS_Dir_Entry *dirEntry = NULL;
 	struct FS_Buffer *nodeBuffer;
 	int inode, inodeBlock, inodeOffset;
 	
@@ -125,156 +738,504 @@ int Allocate_Inode(struct Mount_Point * mountPoint, struct GOSFS_Dir_Entry **pDi
 	Mutex_Lock(&gosSuperBlock->lock);
 
 	// find free inode on disk and allocate
-	inode = Find_First_Free_Bit(&(gosSuperBlock->gfsInstance.inodeBitmapVector), GOSFS_NUM_INODE);
-	Set_Bit(&(gosSuperBlock->gfsInstance.inodeBitmapVector), inode);
-	FIND_INODEBLOCK_AND_INODEOFFSET(inode, inodeBlock, inodeOffset);
-	int rc = Get_FS_Buffer(gosfsBufferCache, inodeBlock, &nodeBuffer);
-	if(rc < 0) return rc;
+	inode = Bitmap_Alloc(mountPoint, gosSuperBlock->gfsInstance.inodeBitmapStart, gosSuperBlock->gfsInstance.numInodes,
+		&gosSuperBlock->inodeFree, &gosSuperBlock->inodeCursor, 1);
+	if(inode < 0) { Mutex_Unlock(&gosSuperBlock->lock); return inode; }
+	FIND_INODEBLOCK_AND_INODEOFFSET(mountPoint, inode, inodeBlock, inodeOffset);
+	int rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), inodeBlock, &nodeBuffer);
+	if(rc < 0) { Mutex_Unlock(&gosSuperBlock->lock); return rc; }
 	dirBlock = (struct GOSFS_Dir_Block *)nodeBuffer->data;
 	Init_GOSFS_Dir_Entry(&(dirBlock->entryTable[inodeOffset]), filename, flags);
 	// ERROR: useless old struct field dirBlock->numExistEntry++;
-	
-	// allocate inode in mem
-	dirEntry = (struct GOSFS_Dir_Entry *)Malloc(sizeof(struct GOSFS_Dir_Entry));
-	if (dirEntry == NULL)
-		return ENOMEM;
-	memcpy(dirEntry, &(dirBlock->entryTable[inodeOffset]), sizeof(struct GOSFS_Dir_Entry));
-
-	// write back the inode immediately
-	Modify_FS_Buffer(gosfsBufferCache, nodeBuffer);
-	Sync_FS_Buffer(gosfsBufferCache, nodeBuffer);
-	Release_FS_Buffer(gosfsBufferCache, nodeBuffer);
 
-	// write back the superblock later
-	gosSuperBlock->dirty = true;
+	// the inode block goes out with the next sync
+	Journal_Dirty(mountPoint, nodeBuffer);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), nodeBuffer);
 
 	Mutex_Unlock(&(gosSuperBlock->lock));
 
-	*pDirEntry = dirEntry;
-
 	return inode;
 }
 
-// get an existing Dir_Entry from disk
-int Get_Exist_Inode(int inodeNum, struct GOSFS_Dir_Entry** pDirEntry)
+// copy an existing Dir_Entry from disk into caller's storage; no Malloc
+static int Read_Inode(struct Mount_Point *mountPoint, ulong_t inodeNum, struct GOSFS_Dir_Entry *dest)
 {
 	struct FS_Buffer *inodeBuf;
-	struct GOSFS_Dir_Entry *dirEntry;
 	struct GOSFS_Dir_Block *srcBlock;
 	int inodeBlock, inodeOffset;
 
-	// allocate the space of dirEntry
-	dirEntry = (struct GOSFS_Dir_Entry *)Malloc(sizeof(struct GOSFS_Dir_Entry));
-	if (dirEntry == NULL) return ENOMEM;
-
-	// if inodeNum exist, find it and load it into dirEntry
-	FIND_INODEBLOCK_AND_INODEOFFSET(inodeNum, inodeBlock, inodeOffset);
-	int rc = Get_FS_Buffer(gosfsBufferCache, inodeBlock, &inodeBuf);
+	FIND_INODEBLOCK_AND_INODEOFFSET(mountPoint, inodeNum, inodeBlock, inodeOffset);
+	int rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), inodeBlock, &inodeBuf);
 	if (rc < 0) return rc;
 	srcBlock = (struct GOSFS_Dir_Block*)(inodeBuf->data);
-	if(&srcBlock->entryTable[inodeNum] == NULL)
-		return ENOTFOUND;
-	memcpy(dirEntry, &(srcBlock->entryTable[inodeOffset]), sizeof(struct GOSFS_Dir_Entry));
-	Release_FS_Buffer(gosfsBufferCache, inodeBuf);
+	memcpy(dest, &(srcBlock->entryTable[inodeOffset]), sizeof(struct GOSFS_Dir_Entry));
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), inodeBuf);
 
-	// We don't konw if it is a deleted inode
-	// see code in Delete_GOSFS_Inode to get more information
-	// an inode in inode block will only be marked as GOSFS_DIRENTRY_OLD during its deletion
-	// so if we didn't check this flag, we may use a deleted inode
-	if (dirEntry->flags & GOSFS_DIRENTRY_OLD)
-	{
-		*pDirEntry = NULL;
+	if (dest->flags & GOSFS_DIRENTRY_OLD)
 		return ENOTFOUND;
-	}
-	
-	Debug("  exist:%s\n", dirEntry->filename);
-	*pDirEntry = dirEntry;
 
 	return 0;
 }
 
-// This function can be used in two ways:
-// 	Init a newly created GOSFS_Dir_Entry on disk and init GOSFS_Inode
-//	Load an exist GOSFS_Dir_Entry on disk and init GOSFS_Inode
-// Watch out the parameters, some of them are used in different ways
-struct GOSFS_Inode * Init_GOSFS_Inode(struct GOSFS_Dir_Entry *dirEntry, int inodeNum)
+/* ----------------------------------------------------------------------
+ * Directory entry cache
+ * ---------------------------------------------------------------------- */
+// Every path walk used to load every child of every directory on the way
+// down just to compare its name. The dcache remembers (parent, name) -> child,
+// including names that are known not to exist, so a repeated walk of the
+// same path doesn't touch the buffer cache at all.
+// Each volume has a dcache of its own, in its GOSFS_Superblock.
+// Lock order: a caller may hold an FS_Buffer while taking dcacheLock,
+// never the other way round.
+
+static ulong_t Dcache_Hash(ulong_t parent, const char *name)
 {
-	struct GOSFS_Inode *gosInode;
-	// struct GOSFS_Dir_Entry *dirEntry;
+	ulong_t hash = parent;
 
-	// Allocate space for gosInode
-	gosInode = (struct GOSFS_Inode *)Malloc(sizeof(struct GOSFS_Inode));
-	
-	// Initialize gosInode
-	memcpy(&(gosInode->dirEntry), dirEntry, sizeof(struct GOSFS_Dir_Entry));
-	gosInode->inodeNumber = inodeNum;
-	gosInode->icount = 0;
-	Mutex_Init(&(gosInode->lock));
-	gosInode->iseek = 0;
-	gosInode->dirty = false;
-	Cond_Init(&gosInode->cond);
+	while (*name != '\0')
+		hash = hash * 31 + (uchar_t)*name++;
 
-	return gosInode;	
+	return hash;
 }
 
-void Init_Directory_Block(struct GOSFS_Dir_Block * dirBlock)
+// caller holds dcacheLock
+static struct GOSFS_Dentry *Dcache_Find(struct Mount_Point *mountPoint, ulong_t parent, const char *name,
+	ulong_t hash)
 {
-	int i;
-	struct GOSFS_Dir_Entry * pEntry = dirBlock->entryTable;
-	for(i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; i++)
+	struct GOSFS_Dentry *dentry = GOSFS_SB(mountPoint)->dcacheHash[hash % GOSFS_DCACHE_HASH_SIZE];
+
+	while (dentry != 0)
 	{
-		pEntry = NULL;
-		pEntry++;
+		if (dentry->hash == hash && dentry->parent == parent && strcmp(dentry->name, name) == 0)
+			return dentry;
+		dentry = dentry->hashNext;
 	}
-	// ERROR: old struct field dirBlock->numExistEntry = 0; // at the beginning the is no entry at all
+
+	return 0;
 }
 
-void Init_VNode_List()
+// unlink dentry from its hash chain and the LRU list, then free it
+// caller holds dcacheLock
+static void Dcache_Free(struct Mount_Point *mountPoint, struct GOSFS_Dentry *dentry)
 {
-	Clear_VNode_List(&vnodeList);
-}
+	struct GOSFS_Superblock *sb = GOSFS_SB(mountPoint);
+	struct GOSFS_Dentry **pp = &sb->dcacheHash[dentry->hash % GOSFS_DCACHE_HASH_SIZE];
 
+	while (*pp != dentry)
+		pp = &(*pp)->hashNext;
+	*pp = dentry->hashNext;
 
-// release direct block according to it's block number
-int Release_Block(struct Mount_Point *mountPoint, ulong_t blockNum)
+	Remove_From_GOSFS_Dentry_List(&sb->dcacheLRU, dentry);
+	sb->dcacheCount--;
+	Free(dentry);
+}
+
+// Look name up in directory parent.
+// Returns true on a hit; *pInodeNum is 0 if the hit is a negative entry.
+static bool Dcache_Lookup(struct Mount_Point *mountPoint, ulong_t parent, const char *name,
+	ulong_t *pInodeNum, ulong_t *pFlags)
 {
-	struct GOSFS_Superblock *gosfsSuperBlock;
-	struct FS_Buffer *blockBuf;
-	int rc = 0;
+	struct GOSFS_Superblock *sb = GOSFS_SB(mountPoint);
+	struct GOSFS_Dentry *dentry;
+	ulong_t hash = Dcache_Hash(parent, name);
 
-	gosfsSuperBlock = (struct GOSFS_Superblock *)mountPoint->fsData;
+	Mutex_Lock(&sb->dcacheLock);
+	dentry = Dcache_Find(mountPoint, parent, name, hash);
+	if (dentry != 0)
+	{
+		// move to the most recently used end
+		Remove_From_GOSFS_Dentry_List(&sb->dcacheLRU, dentry);
+		Add_To_Back_Of_GOSFS_Dentry_List(&sb->dcacheLRU, dentry);
+		*pInodeNum = dentry->inodeNum;
+		*pFlags = dentry->flags;
+	}
+	Mutex_Unlock(&sb->dcacheLock);
 
-	// fetch the superblock
-	Mutex_Lock(&gosfsSuperBlock->lock);
+	return dentry != 0;
+}
 
-	// get the block to release
-	rc = Get_FS_Buffer(gosfsBufferCache, blockNum, &blockBuf);
-	if (rc < 0) { Mutex_Unlock(&gosfsSuperBlock->lock); return rc;}
-	blockBuf->flags |= FS_BUFFER_OLD;
-	Release_FS_Buffer(gosfsBufferCache, blockBuf);
+// Remember that name in directory parent is inodeNum (0: name doesn't exist)
+static void Dcache_Insert(struct Mount_Point *mountPoint, ulong_t parent, const char *name,
+	ulong_t inodeNum, ulong_t flags)
+{
+	struct GOSFS_Superblock *sb = GOSFS_SB(mountPoint);
+	struct GOSFS_Dentry *dentry;
+	ulong_t hash;
 
-	// modify the superblock
-	Set_Bit(gosfsSuperBlock->gfsInstance.blockBitmapVector, blockNum);
+	if (strlen(name) > GOSFS_FILENAME_MAX)
+		return;
+	hash = Dcache_Hash(parent, name);
 
-	gosfsSuperBlock->dirty = true;
+	Mutex_Lock(&sb->dcacheLock);
+	dentry = Dcache_Find(mountPoint, parent, name, hash);
+	if (dentry == 0)
+	{
+		// recycle the least recently used entry when full
+		if (sb->dcacheCount >= GOSFS_DCACHE_MAX_ENTRIES)
+			Dcache_Free(mountPoint, Get_Front_Of_GOSFS_Dentry_List(&sb->dcacheLRU));
+
+		dentry = (struct GOSFS_Dentry *)Malloc(sizeof(struct GOSFS_Dentry));
+		if (dentry == 0)
+			goto done;	// the cache is only a hint
+		dentry->parent = parent;
+		dentry->hash = hash;
+		strcpy(dentry->name, name);
+		dentry->hashNext = sb->dcacheHash[hash % GOSFS_DCACHE_HASH_SIZE];
+		sb->dcacheHash[hash % GOSFS_DCACHE_HASH_SIZE] = dentry;
+		sb->dcacheCount++;
+	}
+	else
+		Remove_From_GOSFS_Dentry_List(&sb->dcacheLRU, dentry);
 
-	Mutex_Unlock(&gosfsSuperBlock->lock);
+	dentry->inodeNum = inodeNum;
+	dentry->flags = flags;
+	Add_To_Back_Of_GOSFS_Dentry_List(&sb->dcacheLRU, dentry);
 
-	return rc;
+done:
+	Mutex_Unlock(&sb->dcacheLock);
 }
 
-
-// release first indirect block's entries according to it's block numbers and the first indirect block
-int Release_First_Indirect_Block(struct Mount_Point *mountPoint, ulong_t blockNum)
+// Forget all names cached under directory parent (it has been deleted,
+// and its inode number may be reused); parent == 0 empties the whole cache
+static void Dcache_Purge(struct Mount_Point *mountPoint, ulong_t parent)
 {
-	struct GOSFS_Indirect_Block *indBlock;
-	struct FS_Buffer *blockBuf;
-	int i, rc;
+	struct GOSFS_Superblock *sb = GOSFS_SB(mountPoint);
+	struct GOSFS_Dentry *dentry, *next;
 
-	i = 0;
-	// Fetch the first indirect block
-	rc = Get_FS_Buffer(gosfsBufferCache, blockNum, &blockBuf);
-	if (rc < 0) return rc;
+	Mutex_Lock(&sb->dcacheLock);
+	dentry = Get_Front_Of_GOSFS_Dentry_List(&sb->dcacheLRU);
+	while (dentry != 0)
+	{
+		next = Get_Next_In_GOSFS_Dentry_List(dentry);
+		if (parent == 0 || dentry->parent == parent)
+			Dcache_Free(mountPoint, dentry);
+		dentry = next;
+	}
+	Mutex_Unlock(&sb->dcacheLock);
+}
+
+/* ----------------------------------------------------------------------
+ * In-core inode cache
+ * ---------------------------------------------------------------------- */
+// All users of an inode share the one GOSFS_Inode found by its number in
+// icacheHash of its volume; icount counts them. An inode nobody references
+// any more is kept on icacheUnused so reopening it costs no disk access,
+// until more than GOSFS_ICACHE_MAX_UNUSED of them pile up and the least
+// recent clean one is evicted.
+// A dirty inode reaches its inode block on GOSFS_Sync, and so does data
+// written to it that has no disk blocks yet (see Flush_Delayed); only then
+// can it be evicted, so Iput never needs a journal handle.
+// Lock order: icacheLock before any FS_Buffer.
+// The lock of a GOSFS_Inode is taken after the journal handle and before
+// icacheLock, a directory's before that of a child in it, and of two
+// files, that of the lower inode number first. Readers of data or entries
+// share it; writing, creating and deleting take it alone.
+static int Flush_Delayed(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode);
+static void Delayed_Unreserve(struct Mount_Point *mountPoint, ulong_t count);
+
+// Copy the in-core inode into its inode block.
+// With sync set the block is written out now, otherwise with the buffer cache.
+static int Write_Inode(struct GOSFS_Inode *iNode, bool sync)
+{
+	struct Mount_Point *mountPoint = iNode->mountPoint;
+	struct FS_Buffer *nodeBuf;
+	struct GOSFS_Dir_Block *dirBlock;
+	int inodeBlock, inodeOffset;
+
+	FIND_INODEBLOCK_AND_INODEOFFSET(mountPoint, iNode->inodeNumber, inodeBlock, inodeOffset);
+	int rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), inodeBlock, &nodeBuf);
+	if (rc < 0) return rc;
+	dirBlock = (struct GOSFS_Dir_Block *)nodeBuf->data;
+	memcpy(&dirBlock->entryTable[inodeOffset], &iNode->dirEntry, sizeof(struct GOSFS_Dir_Entry));
+	Journal_Dirty(mountPoint, nodeBuf);
+	if (sync)
+		rc = Sync_FS_Buffer(GOSFS_CACHE(mountPoint), nodeBuf);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), nodeBuf);
+	iNode->dirty = false;
+
+	return rc;
+}
+
+static struct GOSFS_Inode **Icache_Slot(struct Mount_Point *mountPoint, ulong_t inodeNum)
+{
+	struct GOSFS_Inode **pp = &GOSFS_SB(mountPoint)->icacheHash[inodeNum % GOSFS_ICACHE_HASH_SIZE];
+
+	while (*pp != 0 && (*pp)->inodeNumber != inodeNum)
+		pp = &(*pp)->hashNext;
+	return pp;
+}
+
+// Take a clean unreferenced inode out of the cache.
+// Caller holds icacheLock.
+static void Icache_Evict(struct GOSFS_Inode *iNode)
+{
+	struct Mount_Point *mountPoint = iNode->mountPoint;
+	struct GOSFS_Superblock *sb = GOSFS_SB(mountPoint);
+	struct GOSFS_Inode **pp = Icache_Slot(mountPoint, iNode->inodeNumber);
+
+	KASSERT(*pp == iNode && iNode->icount == 0 && !iNode->dirty);
+	*pp = iNode->hashNext;
+	Remove_From_GOSFS_Inode_List(&sb->icacheUnused, iNode);
+	sb->icacheNumUnused--;
+	Free(iNode);
+}
+
+// Evict the least recent clean unused inodes until no more than
+// GOSFS_ICACHE_MAX_UNUSED are left, or only dirty ones
+static void Icache_Shrink(struct Mount_Point *mountPoint)
+{
+	struct GOSFS_Superblock *sb = GOSFS_SB(mountPoint);
+	struct GOSFS_Inode *iNode, *next;
+
+	iNode = Get_Front_Of_GOSFS_Inode_List(&sb->icacheUnused);
+	while (iNode != 0 && sb->icacheNumUnused > GOSFS_ICACHE_MAX_UNUSED)
+	{
+		next = Get_Next_In_GOSFS_Inode_List(iNode);
+		if (!iNode->dirty && !Has_FS_Delayed_Buffers(GOSFS_CACHE(mountPoint), iNode))
+			Icache_Evict(iNode);
+		iNode = next;
+	}
+}
+
+// Get the in-core inode inodeNum, reading it from disk on a miss.
+// The caller owns a reference and must drop it with Iput().
+static int Iget(struct Mount_Point *mountPoint, ulong_t inodeNum, struct GOSFS_Inode **pINode)
+{
+	struct GOSFS_Superblock *sb = GOSFS_SB(mountPoint);
+	struct GOSFS_Inode **pp, *iNode;
+	int rc = 0;
+
+	Mutex_Lock(&sb->icacheLock);
+	pp = Icache_Slot(mountPoint, inodeNum);
+	iNode = *pp;
+	if (iNode != 0)
+	{
+		if (iNode->icount == 0)
+		{
+			Remove_From_GOSFS_Inode_List(&sb->icacheUnused, iNode);
+			sb->icacheNumUnused--;
+		}
+	}
+	else
+	{
+		iNode = (struct GOSFS_Inode *)Malloc(sizeof(struct GOSFS_Inode));
+		if (iNode == NULL) { rc = ENOMEM; goto done; }
+		rc = Read_Inode(mountPoint, inodeNum, &iNode->dirEntry);
+		if (rc < 0) { Free(iNode); goto done; }
+		iNode->inodeNumber = inodeNum;
+		iNode->mountPoint = mountPoint;
+		iNode->icount = 0;
+		RW_Lock_Init(&iNode->lock);
+		iNode->iseek = 0;
+		iNode->dirty = false;
+		iNode->deleted = false;
+		Cond_Init(&iNode->cond);
+		iNode->hashNext = 0;
+		iNode->writers = 0;
+		iNode->preallocStart = iNode->preallocLen = 0;
+		iNode->preallocNext = 0;
+		iNode->preallocSize = GOSFS_PREALLOC_MIN;
+		iNode->lastBlock = 0;
+		iNode->lastLblock = (ulong_t)-1; // block 0 comes next
+		*pp = iNode;
+	}
+	iNode->icount++;
+	*pINode = iNode;
+
+done:
+	Mutex_Unlock(&sb->icacheLock);
+	return rc;
+}
+
+// Drop a reference taken by Iget()
+static void Iput(struct GOSFS_Inode *iNode)
+{
+	struct Mount_Point *mountPoint = iNode->mountPoint;
+	struct GOSFS_Superblock *sb = GOSFS_SB(mountPoint);
+	bool idleOrphan = false;
+
+	Mutex_Lock(&sb->icacheLock);
+	KASSERT(iNode->icount > 0);
+	if (--iNode->icount == 0 && iNode->deleted)
+		Free(iNode); // Iforget left it to us
+	else if (iNode->icount == 0)
+	{
+		idleOrphan = (iNode->dirEntry.flags & GOSFS_DIRENTRY_ORPHAN) != 0;
+		Add_To_Back_Of_GOSFS_Inode_List(&sb->icacheUnused, iNode);
+		sb->icacheNumUnused++;
+		Icache_Shrink(mountPoint);
+	}
+	Mutex_Unlock(&sb->icacheLock);
+
+	// the reclaimer may be waiting for it
+	if (idleOrphan)
+	{
+		Mutex_Lock(&sb->lock);
+		sb->orphanIdle++;
+		Cond_Broadcast(&sb->reclaimCond);
+		Mutex_Unlock(&sb->lock);
+	}
+}
+
+// Drop the caller's reference to an inode being deleted; it leaves the
+// cache without being written back, nor its unwritten data. The only other
+// reference can be Icache_Sync's, which then frees it with its Iput.
+static void Iforget(struct GOSFS_Inode *iNode)
+{
+	struct Mount_Point *mountPoint = iNode->mountPoint;
+	struct GOSFS_Inode **pp;
+
+	Delayed_Unreserve(mountPoint, Discard_FS_Delayed_Buffers(GOSFS_CACHE(mountPoint), iNode));
+	Mutex_Lock(&GOSFS_SB(mountPoint)->icacheLock);
+	KASSERT(iNode->icount > 0);
+	pp = Icache_Slot(mountPoint, iNode->inodeNumber);
+	KASSERT(*pp == iNode);
+	*pp = iNode->hashNext;
+	iNode->dirty = false;
+	iNode->deleted = true;
+	if (--iNode->icount > 0)
+		iNode = 0;
+	Mutex_Unlock(&GOSFS_SB(mountPoint)->icacheLock);
+	if (iNode != 0)
+		Free(iNode);
+}
+
+// Give every cached inode's delayed data its disk blocks,
+// and copy every dirty cached inode into its inode block.
+// Writers change an inode under its lock, so it is done under that lock,
+// one inode at a time; a reference to each keeps them all in core meanwhile.
+// An error doesn't stop the others; the first one is returned.
+static int Icache_Sync(struct Mount_Point *mountPoint)
+{
+	struct GOSFS_Superblock *sb = GOSFS_SB(mountPoint);
+	struct GOSFS_Inode *iNode, **list;
+	int i, n = 0, count = 0, rc, err, result = 0;
+
+	Mutex_Lock(&sb->icacheLock);
+	for (i = 0; i < GOSFS_ICACHE_HASH_SIZE; i++)
+		for (iNode = sb->icacheHash[i]; iNode != 0; iNode = iNode->hashNext)
+			count++;
+	list = (struct GOSFS_Inode **)Malloc((count + 1) * sizeof(struct GOSFS_Inode *));
+	if (list == NULL)
+	{
+		Mutex_Unlock(&sb->icacheLock);
+		return ENOMEM;
+	}
+	for (i = 0; i < GOSFS_ICACHE_HASH_SIZE; i++)
+	{
+		for (iNode = sb->icacheHash[i]; iNode != 0; iNode = iNode->hashNext)
+		{
+			if (iNode->icount++ == 0)
+			{
+				Remove_From_GOSFS_Inode_List(&sb->icacheUnused, iNode);
+				sb->icacheNumUnused--;
+			}
+			list[n++] = iNode;
+		}
+	}
+	Mutex_Unlock(&sb->icacheLock);
+
+	for (i = 0; i < n; i++)
+	{
+		iNode = list[i];
+		do
+		{
+			// lots of delayed data take more than one transaction
+			Journal_Start(mountPoint, GOSFS_JOURNAL_OP_CREDITS);
+			RW_Write_Lock(&iNode->lock);
+			rc = 0;
+			if (!iNode->deleted && GOSFS_CACHE(mountPoint)->numDelayed > 0)
+				rc = Flush_Delayed(mountPoint, iNode);
+			if (!iNode->deleted && iNode->dirty)
+			{
+				err = Write_Inode(iNode, false);
+				if (err < 0 && rc >= 0) rc = err;
+			}
+			RW_Write_Unlock(&iNode->lock);
+			Journal_Stop(mountPoint);
+		} while (rc > 0);
+		if (rc < 0 && result == 0)
+			result = rc;
+		Iput(iNode);
+	}
+	Free(list);
+
+	return result;
+}
+
+void Init_Directory_Block(struct GOSFS_Dir_Block * dirBlock)
+{
+	int i;
+	struct GOSFS_Dir_Entry * pEntry = dirBlock->entryTable;
+	for(i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; i++)
+	{
+		pEntry = NULL;
+		pEntry++;
+	}
+	// ERROR: old struct field dirBlock->numExistEntry = 0; // at the beginning the is no entry at all
+}
+
+void Init_VNode_List()
+{
+	Clear_VNode_List(&vnodeList);
+}
+
+
+// release direct block according to it's block number
+int Release_Block(struct Mount_Point *mountPoint, ulong_t blockNum)
+{
+	struct GOSFS_Superblock *gosfsSuperBlock;
+	struct FS_Buffer *blockBuf;
+	int rc = 0;
+
+	gosfsSuperBlock = (struct GOSFS_Superblock *)mountPoint->fsData;
+
+	// fetch the superblock
+	Mutex_Lock(&gosfsSuperBlock->lock);
+
+	// get the block to release
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), blockNum, &blockBuf);
+	if (rc < 0) { Mutex_Unlock(&gosfsSuperBlock->lock); return rc;}
+	blockBuf->flags |= FS_BUFFER_OLD;
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+
+	// modify the bitmap
+	rc = Bitmap_Free(mountPoint, gosfsSuperBlock->gfsInstance.blockBitmapStart, &gosfsSuperBlock->blockFree,
+		blockNum - gosfsSuperBlock->gfsInstance.firstDataBlock, 1);
+
+	Mutex_Unlock(&gosfsSuperBlock->lock);
+
+	return rc;
+}
+
+// release len blocks from start on; only the bitmap is touched
+int Release_Run(struct Mount_Point *mountPoint, ulong_t start, ulong_t len)
+{
+	struct GOSFS_Superblock *gosfsSuperBlock;
+	int rc;
+
+	gosfsSuperBlock = (struct GOSFS_Superblock *)mountPoint->fsData;
+
+	Mutex_Lock(&gosfsSuperBlock->lock);
+	rc = Bitmap_Free(mountPoint, gosfsSuperBlock->gfsInstance.blockBitmapStart, &gosfsSuperBlock->blockFree,
+		start - gosfsSuperBlock->gfsInstance.firstDataBlock, len);
+	Mutex_Unlock(&gosfsSuperBlock->lock);
+
+	return rc;
+}
+
+
+// release first indirect block's entries according to it's block numbers and the first indirect block
+int Release_First_Indirect_Block(struct Mount_Point *mountPoint, ulong_t blockNum)
+{
+	struct GOSFS_Indirect_Block *indBlock;
+	struct FS_Buffer *blockBuf;
+	int i, rc;
+
+	i = 0;
+	// Fetch the first indirect block
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), blockNum, &blockBuf);
+	if (rc < 0) return rc;
 	indBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
 
 	// release the entries
@@ -283,11 +1244,11 @@ int Release_First_Indirect_Block(struct Mount_Point *mountPoint, ulong_t blockNu
 		if(indBlock->blockNumber[i] > 0)
 		{
 			rc = Release_Block(mountPoint, indBlock->blockNumber[i]);
-			if (rc < 0) { Release_FS_Buffer(gosfsBufferCache, blockBuf); return rc; }
+			if (rc < 0) { Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf); return rc; }
 		}
 	}
 
-	Release_FS_Buffer(gosfsBufferCache, blockBuf);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
 	Release_Block(mountPoint, blockNum); // release the block
 
 	
@@ -305,7 +1266,7 @@ int Release_Second_Indirect_Block(struct Mount_Point *mountPoint, ulong_t blockN
 	i = rc = 0;
 
 	// Fetch the first indirect block
-	rc = Get_FS_Buffer(gosfsBufferCache, blockNum, &blockBuf);
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), blockNum, &blockBuf);
 	if (rc < 0) return rc;
 	indBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
 
@@ -316,11 +1277,11 @@ int Release_Second_Indirect_Block(struct Mount_Point *mountPoint, ulong_t blockN
 		if(indBlock->blockNumber[i] > 0)
 		{
 			rc = Release_First_Indirect_Block(mountPoint, indBlock->blockNumber[i]);
-			if (rc < 0) { Release_FS_Buffer(gosfsBufferCache, blockBuf); return rc; }
+			if (rc < 0) { Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf); return rc; }
 		}
 	}
 
-	Release_FS_Buffer(gosfsBufferCache, blockBuf);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
 	Release_Block(mountPoint, blockNum); // release the block
 
 	
@@ -341,20 +1302,19 @@ int Delete_GOSFS_Inode(struct Mount_Point *mountPoint, ulong_t inodeNum)
 	gosfsSuperBlock = (struct GOSFS_Superblock *)mountPoint->fsData;
 
 	// First release the inode in inode block
-	FIND_INODEBLOCK_AND_INODEOFFSET(inodeNum, inodeBlock, inodeOffset);
-	rc = Get_FS_Buffer(gosfsBufferCache, inodeBlock, &nodeBuf);
+	FIND_INODEBLOCK_AND_INODEOFFSET(mountPoint, inodeNum, inodeBlock, inodeOffset);
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), inodeBlock, &nodeBuf);
 	if (rc < 0) goto done;
 	nodeBlock = (struct GOSFS_Dir_Block *)nodeBuf->data;
-	nodeBlock->entryTable[inodeOffset].flags &= GOSFS_DIRENTRY_OLD;
-	Modify_FS_Buffer(gosfsBufferCache, nodeBuf);
-	Sync_FS_Buffer(gosfsBufferCache, nodeBuf);
-	Release_FS_Buffer(gosfsBufferCache, nodeBuf);
+	nodeBlock->entryTable[inodeOffset].flags |= GOSFS_DIRENTRY_OLD;
+	Journal_Dirty(mountPoint, nodeBuf);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), nodeBuf);
 	
 	Mutex_Lock(&gosfsSuperBlock->lock);
 
-	// Then set the bit in inode bitmap
-	Set_Bit(gosfsSuperBlock->gfsInstance.inodeBitmapVector, inodeNum);
-	gosfsSuperBlock->dirty = true;
+	// Then free the inode in inode bitmap
+	rc = Bitmap_Free(mountPoint, gosfsSuperBlock->gfsInstance.inodeBitmapStart, &gosfsSuperBlock->inodeFree,
+		inodeNum, 1);
 
 	Mutex_Unlock(&gosfsSuperBlock->lock);
 
@@ -369,20 +1329,20 @@ done:
 // this may cause some unexpected problems.
 // we use this in Allocate_Block only
 // for speed reason, we only clear the block in mem(i.e, the buffer).
-int Clear_Block(ulong_t blockNum)
+int Clear_Block(struct Mount_Point *mountPoint, ulong_t blockNum)
 {
 	int i = 0;
 	struct GOSFS_Indirect_Block *indBlock;
 	struct FS_Buffer *blockBuf;
 
-	int rc = Get_FS_Buffer(gosfsBufferCache, blockNum, &blockBuf);
+	int rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), blockNum, &blockBuf);
 	if(rc < 0) goto done;
 	indBlock = (struct GOSFS_Indirect_Block*)blockBuf->data;
 	for(i = 0; i < GOSFS_NUM_PTRS_PER_BLOCK; i++)
 		indBlock->blockNumber[i] = 0;
 
 done:
-	Release_FS_Buffer(gosfsBufferCache, blockBuf);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
 	return rc;
 }
 
@@ -398,32 +1358,241 @@ int Allocate_Block(struct Mount_Point *mountPoint, ulong_t *blockNumEntry)
 	gosfsSuperBlock = (struct GOSFS_Superblock *)mountPoint->fsData;
 	
 	Mutex_Lock(&gosfsSuperBlock->lock);
-	// First find block bit to allocate
-	blockBit = Find_First_Free_Bit(gosfsSuperBlock->gfsInstance.blockBitmapVector, GOSFS_NUM_BLOCK);
+	// find a free block and mark it used
+	blockBit = Bitmap_Alloc(mountPoint, gosfsSuperBlock->gfsInstance.blockBitmapStart, gosfsSuperBlock->gfsInstance.numDataBlocks,
+		&gosfsSuperBlock->blockFree, &gosfsSuperBlock->blockCursor, 1);
+	if(blockBit < 0) { Mutex_Unlock(&gosfsSuperBlock->lock); return blockBit; }
 
 	// allocate block in file
-	*blockNumEntry = blockBit + GOSFS_FIRST_DATA_BLOCK;
-
-	// update superblock
-	Set_Bit(gosfsSuperBlock->gfsInstance.blockBitmapVector, blockBit);
-	gosfsSuperBlock->dirty = true;
+	*blockNumEntry = blockBit + gosfsSuperBlock->gfsInstance.firstDataBlock;
 	
 	Mutex_Unlock(&gosfsSuperBlock->lock);
 
 	Debug("blockNum:%d, blockBit:%d\n", (int)(*blockNumEntry), (int)blockBit);
-	Clear_Block(*blockNumEntry);
+	Clear_Block(mountPoint, *blockNumEntry);
 	return *blockNumEntry;
 }
 
 
-// 
-int Allocate_First_Indirect_Block(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t blockNum)
+/* ----------------------------------------------------------------------
+ * Block allocation for file data
+ * ---------------------------------------------------------------------- */
+// A file open for writing reserves a window of contiguous blocks and takes
+// its data blocks from there, so files written at the same time don't
+// interleave on disk. A new window is placed right after the file's last
+// block if it can be, and a sequential writer that uses one up gets one
+// twice as big next time (GOSFS_PREALLOC_MIN up to GOSFS_PREALLOC_MAX).
+// Windows are kept in core only, in blockFree.windows, and other
+// allocations pass them over; a block is marked in the bitmap when it is
+// taken from the window, so nothing stays reserved on disk after a crash,
+// nor counts as used. Once the volume has no other free blocks left, the
+// windows' blocks go to whoever needs them. The window ends when the last
+// writer closes the file.
+
+// Give iNode the window of len blocks from start on, none if len is 0.
+// Called with the superblock lock held.
+static void Prealloc_Set(struct GOSFS_Superblock *gosfsSuperBlock, struct GOSFS_Inode *iNode,
+	ulong_t start, ulong_t len)
+{
+	struct GOSFS_Inode **pp;
+
+	if(iNode->preallocLen == 0 && len > 0)
+	{
+		iNode->preallocNext = gosfsSuperBlock->blockFree.windows;
+		gosfsSuperBlock->blockFree.windows = iNode;
+	}
+	else if(iNode->preallocLen > 0 && len == 0)
+	{
+		for(pp = &gosfsSuperBlock->blockFree.windows; *pp != iNode; pp = &(*pp)->preallocNext)
+			;
+		*pp = iNode->preallocNext;
+	}
+	iNode->preallocStart = start;
+	iNode->preallocLen = len;
+}
+
+// Give iNode a new preallocation window of up to preallocSize free blocks,
+// right after its last block if they are free
+static int Prealloc_Open(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode)
+{
+	struct GOSFS_Superblock *gosfsSuperBlock = GOSFS_SB(mountPoint);
+	struct GOSFS_Instance *geo = &gosfsSuperBlock->gfsInstance;
+	ulong_t goal = iNode->lastBlock + 1, len = iNode->preallocSize, cursor;
+	int bit = ENOSPACE;
+
+	Mutex_Lock(&gosfsSuperBlock->lock);
+	cursor = goal >= geo->firstDataBlock ? goal - geo->firstDataBlock : gosfsSuperBlock->blockCursor;
+	for(; len > 0; len /= 2)
+	{
+		bit = Bitmap_Find(mountPoint, geo->blockBitmapStart, geo->numDataBlocks, &gosfsSuperBlock->blockFree, &cursor, len);
+		if(bit != ENOSPACE) break;
+	}
+	if(bit >= 0)
+		Prealloc_Set(gosfsSuperBlock, iNode, bit + geo->firstDataBlock, len);
+	Mutex_Unlock(&gosfsSuperBlock->lock);
+	if(bit < 0) return bit;
+
+	if(iNode->preallocSize < GOSFS_PREALLOC_MAX)
+		iNode->preallocSize *= 2;
+	return 0;
+}
+
+// Take up to len blocks from the front of iNode's preallocation window,
+// if it goes on right after the file's last block, and mark them used.
+// With reserved set they were taken off the free count already, for
+// delayed data. Returns how many; none if the window is gone, or
+// another file took its blocks, which ends it.
+static int Prealloc_Take(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t len,
+	bool reserved, ulong_t *pStart)
+{
+	struct GOSFS_Superblock *gosfsSuperBlock = GOSFS_SB(mountPoint);
+	struct GOSFS_Instance *geo = &gosfsSuperBlock->gfsInstance;
+	int rc = 0;
+
+	Mutex_Lock(&gosfsSuperBlock->lock);
+	if(iNode->preallocLen > 0 && iNode->preallocStart == iNode->lastBlock + 1)
+	{
+		if(len > iNode->preallocLen)
+			len = iNode->preallocLen;
+		if(reserved)
+			gosfsSuperBlock->blockFree.free += len;
+		rc = Bitmap_Mark(mountPoint, geo->blockBitmapStart, &gosfsSuperBlock->blockFree,
+			iNode->preallocStart - geo->firstDataBlock, len);
+		if(rc < 0 && reserved)
+			gosfsSuperBlock->blockFree.free -= len;
+		if(rc == 0)
+		{
+			*pStart = iNode->preallocStart;
+			Prealloc_Set(gosfsSuperBlock, iNode, iNode->preallocStart + len, iNode->preallocLen - len);
+			rc = len;
+		}
+		else if(rc == ENOSPACE)
+		{
+			Prealloc_Set(gosfsSuperBlock, iNode, iNode->preallocStart, 0);
+			rc = 0;
+		}
+	}
+	Mutex_Unlock(&gosfsSuperBlock->lock);
+	return rc;
+}
+
+// Mark up to len free blocks, as close after goal (a disk block, 0 for none)
+// as possible, as used. Returns how many, the first one in *pStart.
+// The first reserved of them were taken off the free count already,
+// for delayed data (see Delayed_Reserve); len is at most reserved then.
+static int Reserve_Run(struct Mount_Point *mountPoint, ulong_t goal, ulong_t len, ulong_t reserved,
+	ulong_t *pStart)
+{
+	struct GOSFS_Superblock *gosfsSuperBlock = (struct GOSFS_Superblock *)mountPoint->fsData;
+	struct GOSFS_Instance *geo = &gosfsSuperBlock->gfsInstance;
+	ulong_t cursor;
+	int bit = ENOSPACE;
+
+	if(len > GOSFS_BITS_PER_BLOCK)
+		len = GOSFS_BITS_PER_BLOCK;
+
+	Mutex_Lock(&gosfsSuperBlock->lock);
+	gosfsSuperBlock->blockFree.free += reserved;
+	cursor = goal >= geo->firstDataBlock ? goal - geo->firstDataBlock : gosfsSuperBlock->blockCursor;
+	for(; len > 0; len /= 2)
+	{
+		bit = Bitmap_Alloc(mountPoint, geo->blockBitmapStart, geo->numDataBlocks, &gosfsSuperBlock->blockFree, &cursor, len);
+		if(bit != ENOSPACE) break;
+	}
+	// the reservation not used up stays taken
+	gosfsSuperBlock->blockFree.free -= bit < 0 ? reserved : reserved - len;
+	if(bit < 0) { Mutex_Unlock(&gosfsSuperBlock->lock); return bit; }
+
+	if(goal < geo->firstDataBlock)
+		gosfsSuperBlock->blockCursor = cursor;
+	Mutex_Unlock(&gosfsSuperBlock->lock);
+
+	*pStart = bit + geo->firstDataBlock;
+	return len;
+}
+
+// Allocate the data block for logical block lblock of iNode
+// and set blockNumEntry to it, unless it has one already.
+// With clear set the new block starts out zeroed in the cache.
+static int Allocate_File_Block(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t lblock,
+	ulong_t *blockNumEntry, bool clear)
+{
+	ulong_t start;
+	int rc;
+
+	if(*blockNumEntry > 0)
+		return *blockNumEntry;
+
+	if(iNode->writers > 0 && lblock == iNode->lastLblock + 1)
+	{
+		rc = Prealloc_Take(mountPoint, iNode, 1, false, &start);
+		if(rc == 0)
+		{
+			// used up, or taken by others: a new one
+			rc = Prealloc_Open(mountPoint, iNode);
+			if(rc < 0) return rc;
+			rc = Prealloc_Take(mountPoint, iNode, 1, false, &start);
+			if(rc == 0) rc = ENOSPACE;
+		}
+		if(rc < 0) return rc;
+	}
+	else
+	{
+		// not sequential, or nobody has it open for writing: one block near the last one
+		rc = Reserve_Run(mountPoint, iNode->lastBlock + 1, 1, 0, &start);
+		if(rc < 0) return rc;
+		iNode->preallocSize = GOSFS_PREALLOC_MIN;
+	}
+
+	iNode->lastBlock = start;
+	iNode->lastLblock = lblock;
+	*blockNumEntry = start;
+	if(clear)
+		Clear_Block(mountPoint, start);
+	return start;
+}
+
+// Undo Allocate_File_Block of block for lblock when it can't be mapped after
+// all; lastBlock and lastLblock are what the inode had before. A block that
+// came from the preallocation window goes back to its front.
+static void Unallocate_File_Block(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t lblock,
+	ulong_t block, ulong_t lastBlock, ulong_t lastLblock)
+{
+	struct GOSFS_Superblock *gosfsSuperBlock = GOSFS_SB(mountPoint);
+
+	Release_Block(mountPoint, block);
+	if(iNode->writers > 0 && lblock == lastLblock + 1 && iNode->preallocStart == block + 1)
+	{
+		Mutex_Lock(&gosfsSuperBlock->lock);
+		Prealloc_Set(gosfsSuperBlock, iNode, block, iNode->preallocLen + 1);
+		Mutex_Unlock(&gosfsSuperBlock->lock);
+	}
+	iNode->lastBlock = lastBlock;
+	iNode->lastLblock = lastLblock;
+}
+
+// Give back the unused part of iNode's preallocation window
+static void Prealloc_Discard(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode)
+{
+	struct GOSFS_Superblock *gosfsSuperBlock = GOSFS_SB(mountPoint);
+
+	Mutex_Lock(&gosfsSuperBlock->lock);
+	Prealloc_Set(gosfsSuperBlock, iNode, iNode->preallocStart, 0);
+	Mutex_Unlock(&gosfsSuperBlock->lock);
+}
+
+// Allocate (or find) data block blockNum of the first indirect block,
+// allocating the indirect block itself if needed.
+// If newBlock is not 0 it becomes the data block instead of a newly allocated one.
+int Allocate_First_Indirect_Block(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t blockNum,
+	ulong_t newBlock)
 {
 	struct GOSFS_Dir_Entry *dirEntry = &iNode->dirEntry;
 	int fIndBlock;
 	if(dirEntry->blockList[8] == 0)
 	{
 		fIndBlock = Allocate_Block(mountPoint, &dirEntry->blockList[8]);
+		if(fIndBlock < 0) return fIndBlock;
 		iNode->dirty = true;
 	}
 	else
@@ -433,19 +1602,24 @@ int Allocate_First_Indirect_Block(struct Mount_Point *mountPoint, struct GOSFS_I
 	struct FS_Buffer *blockBuf;
 	int rc;
 	
-	rc = Get_FS_Buffer(gosfsBufferCache, fIndBlock, &blockBuf);
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), fIndBlock, &blockBuf);
 	IndBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
 	if(IndBlock->blockNumber[blockNum] == 0)
-	{	rc = Allocate_Block(mountPoint, &IndBlock->blockNumber[blockNum]);
-		blockBuf->flags |= FS_BUFFER_DIRTY; // write back later sometime
+	{	if(newBlock > 0)
+			rc = IndBlock->blockNumber[blockNum] = newBlock;
+		else
+			rc = Allocate_File_Block(mountPoint, iNode, GOSFS_NUM_DIRECT_BLOCKS + blockNum, &IndBlock->blockNumber[blockNum], true);
+		Journal_Dirty(mountPoint, blockBuf); // write back later sometime
 	}else
 		rc = IndBlock->blockNumber[blockNum];
-	Release_FS_Buffer(gosfsBufferCache, blockBuf);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
 
 	return rc;		
 }
 
-int Allocate_Second_Indirect_Block(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t blockNum)
+// The same for the second indirect block
+int Allocate_Second_Indirect_Block(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t blockNum,
+	ulong_t newBlock)
 {
 	struct GOSFS_Dir_Entry *dirEntry = &iNode->dirEntry;
 	int sIndBlock;
@@ -455,6 +1629,7 @@ int Allocate_Second_Indirect_Block(struct Mount_Point *mountPoint, struct GOSFS_
 	{
 		Debug(" !Allocate second ind block.\n");
 		sIndBlock = Allocate_Block(mountPoint, &dirEntry->blockList[9]);
+		if(sIndBlock < 0) return sIndBlock;
 		iNode->dirty = true;
 	}
 		
@@ -467,39 +1642,45 @@ int Allocate_Second_Indirect_Block(struct Mount_Point *mountPoint, struct GOSFS_
 
 	Debug(" !Allocate first ind block.\n");
 	FIND_SEC_IND_BLOCK_NUM(blockNum, sIndNum, fIndNum);
-	rc = Get_FS_Buffer(gosfsBufferCache, sIndBlock, &blockBuf);
-	Print("sIndNum:%d, fIndNum:%d\n",sIndNum, fIndNum);
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), sIndBlock, &blockBuf);
+	Debug("sIndNum:%d, fIndNum:%d\n",sIndNum, fIndNum);
 	if(rc < 0) return rc;
 	IndBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
 
 	if(IndBlock->blockNumber[sIndNum] == 0)
 	{
 		sIndBlockNum = Allocate_Block(mountPoint, &IndBlock->blockNumber[sIndNum]);
-		blockBuf->flags |= FS_BUFFER_DIRTY;
+		if(sIndBlockNum < 0) { Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf); return sIndBlockNum; }
+		Journal_Dirty(mountPoint, blockBuf);
 	}else{
 	 Debug("already have first ind block:%d\n", (int)IndBlock->blockNumber[sIndNum]);
 	 sIndBlockNum = IndBlock->blockNumber[sIndNum];
 	}
-	Release_FS_Buffer(gosfsBufferCache, blockBuf);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
 
 	Debug(" !Allocate direct block.\n");
-	rc = Get_FS_Buffer(gosfsBufferCache, sIndBlockNum, &blockBuf);
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), sIndBlockNum, &blockBuf);
 	IndBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
-	if(IndBlock->blockNumber[fIndNum] == 0)
+	if(IndBlock->blockNumber[fIndNum] == 0 && newBlock > 0)
 	{
-		sIndBlockNum = Allocate_Block(mountPoint, &IndBlock->blockNumber[fIndNum]);
-		blockBuf->flags |= FS_BUFFER_DIRTY;
+		sIndBlockNum = IndBlock->blockNumber[fIndNum] = newBlock;
+		Journal_Dirty(mountPoint, blockBuf);
+	}else if(IndBlock->blockNumber[fIndNum] == 0)
+	{
+		sIndBlockNum = Allocate_File_Block(mountPoint, iNode,
+			GOSFS_NUM_DIRECT_BLOCKS + GOSFS_NUM_PTRS_PER_BLOCK + blockNum, &IndBlock->blockNumber[fIndNum], true);
+		Journal_Dirty(mountPoint, blockBuf);
 	}else{
 		sIndBlockNum = IndBlock->blockNumber[fIndNum];
 	}
-	Release_FS_Buffer(gosfsBufferCache, blockBuf);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
 
 	return sIndBlockNum;
 }
 
 
 // Get first indirect Block; this function is for supportment of GOSFS_Read
-int Get_First_Indirect_Block(struct GOSFS_Dir_Entry* dirEntry, ulong_t directBlock)
+int Get_First_Indirect_Block(struct Mount_Point *mountPoint, struct GOSFS_Dir_Entry* dirEntry, ulong_t directBlock)
 {
 	if(dirEntry->blockList[8] == 0)
 		return ENOBLOCK;
@@ -508,61 +1689,1327 @@ int Get_First_Indirect_Block(struct GOSFS_Dir_Entry* dirEntry, ulong_t directBlo
 	struct FS_Buffer *blockBuf;
 	ulong_t fIndNum;
 	//int fIndBlock = directBlock - GOSFS_NUM_DIRECT_BLOCKS;
-	int rc = Get_FS_Buffer(gosfsBufferCache, dirEntry->blockList[8], &blockBuf);
+	int rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), dirEntry->blockList[8], &blockBuf);
 	dirBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
 	fIndNum = dirBlock->blockNumber[directBlock];
 
 	if(fIndNum == 0)
 	{
-		rc = ENOBLOCK;
-		goto done;
+		rc = ENOBLOCK;
+		goto done;
+	}
+
+	rc = fIndNum;
+	
+done:
+
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+	return rc;
+}
+
+int Get_Second_Indirect_Block(struct Mount_Point *mountPoint, struct GOSFS_Dir_Entry* dirEntry, ulong_t directBlock)
+{
+	Debug("read sec ind block.\n");
+	if(dirEntry->blockList[9] == 0)
+		return ENOBLOCK;
+
+	struct GOSFS_Indirect_Block *dirBlock;
+	struct FS_Buffer *blockBuf;
+	int sIndNum, sIndOffset;
+	int sIndBlock, fIndBlock;
+	// First get second indirect block
+	//int sIndBlockNum = directBlock - GOSFS_NUM_DIRECT_BLOCKS - GOSFS_NUM_PTRS_PER_BLOCK;
+	FIND_SEC_IND_BLOCK_NUM(directBlock, sIndNum, sIndOffset);
+	int rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), dirEntry->blockList[9], &blockBuf);
+	if(rc < 0)  goto done;
+	dirBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
+	sIndBlock = dirBlock->blockNumber[sIndNum];
+	if(sIndBlock == 0)
+	{
+		rc = ENOBLOCK;
+		goto done;
+	}
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+
+	// Find first indirect block
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), sIndBlock, &blockBuf);
+	if(rc < 0) goto done;
+	dirBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
+	fIndBlock = dirBlock->blockNumber[sIndOffset];
+	if(fIndBlock == 0)  
+		rc = ENOBLOCK;
+	else
+		rc = fIndBlock;
+done:
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf); 
+	return rc;
+}
+
+/* ----------------------------------------------------------------------
+ * File block mapping
+ * ---------------------------------------------------------------------- */
+// A file is mapped either the old way, through blockList's direct and
+// indirect pointers, or, with GOSFS_DIRENTRY_EXTENTS, by extents: runs of
+// contiguous disk blocks. Up to GOSFS_EXTENTS_IN_INODE extents fit in the
+// inode itself; past that the inode holds index entries naming leaf blocks
+// of extents. Mapping a block of an extent file costs at most one leaf
+// buffer and returns the whole run, so the blocks after it need no lookup.
+
+static struct GOSFS_Extent_Root *Extent_Root(struct GOSFS_Inode *iNode)
+{
+	return (struct GOSFS_Extent_Root *)iNode->dirEntry.blockList;
+}
+
+// Index of the first of the n extents that ends after lblock;
+// it maps lblock if it also starts at or before it
+static int Extent_Search(struct GOSFS_Extent *ext, int n, ulong_t lblock)
+{
+	int lo = 0, hi = n, mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (ext[mid].lblock + ext[mid].len <= lblock)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Index entry of the leaf that covers lblock
+static int Extent_Pick_Leaf(struct GOSFS_Extent_Root *root, ulong_t lblock)
+{
+	int i = root->hdr.entries - 1;
+
+	while (i > 0 && root->u.index[i].lblock > lblock)
+		i--;
+	return i;
+}
+
+static int Extent_Lookup(struct GOSFS_Extent *ext, int n, ulong_t lblock, ulong_t *pRunLen)
+{
+	int i = Extent_Search(ext, n, lblock);
+
+	if (i == n || ext[i].lblock > lblock)
+		return ENOBLOCK;
+	if (pRunLen != 0)
+		*pRunLen = ext[i].lblock + ext[i].len - lblock;
+	return ext[i].pblock + (lblock - ext[i].lblock);
+}
+
+// Disk block of logical block lblock of an extent file, ENOBLOCK if unmapped;
+// *pRunLen is set to the number of blocks mapped contiguously from lblock on
+static int Extent_Map(struct GOSFS_Inode *iNode, ulong_t lblock, ulong_t *pRunLen)
+{
+	struct Mount_Point *mountPoint = iNode->mountPoint;
+	struct GOSFS_Extent_Root *root = Extent_Root(iNode);
+	struct GOSFS_Extent_Leaf *leaf;
+	struct FS_Buffer *leafBuf;
+	int rc;
+
+	if (root->hdr.depth == 0)
+		return Extent_Lookup(root->u.extent, root->hdr.entries, lblock, pRunLen);
+
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), root->u.index[Extent_Pick_Leaf(root, lblock)].leaf, &leafBuf);
+	if (rc < 0) return rc;
+	leaf = (struct GOSFS_Extent_Leaf *)leafBuf->data;
+	rc = Extent_Lookup(leaf->extent, leaf->hdr.entries, lblock, pRunLen);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), leafBuf);
+
+	return rc;
+}
+
+// Record that the unmapped lblock is now at pblock, in the sorted array of
+// *pNum extents; it is merged into a neighbour when both numbers continue it.
+// Returns ENOSPACE if a new extent is needed and the array has max already.
+static int Extent_Insert(struct GOSFS_Extent *ext, ushort_t *pNum, int max, ulong_t lblock, ulong_t pblock)
+{
+	int n = *pNum;
+	int i = Extent_Search(ext, n, lblock);
+
+	if (i > 0 && ext[i-1].lblock + ext[i-1].len == lblock && ext[i-1].pblock + ext[i-1].len == pblock)
+	{
+		ext[i-1].len++;
+		// the gap between two extents may just have been closed
+		if (i < n && ext[i].lblock == lblock + 1 && ext[i].pblock == pblock + 1)
+		{
+			ext[i-1].len += ext[i].len;
+			memmove(&ext[i], &ext[i+1], (n - i - 1) * sizeof(struct GOSFS_Extent));
+			(*pNum)--;
+		}
+		return 0;
+	}
+	if (i < n && ext[i].lblock == lblock + 1 && ext[i].pblock == pblock + 1)
+	{
+		ext[i].lblock--;
+		ext[i].pblock--;
+		ext[i].len++;
+		return 0;
+	}
+
+	if (n == max)
+		return ENOSPACE;
+	memmove(&ext[i+1], &ext[i], (n - i) * sizeof(struct GOSFS_Extent));
+	ext[i].lblock = lblock;
+	ext[i].pblock = pblock;
+	ext[i].len = 1;
+	(*pNum)++;
+	return 0;
+}
+
+// Map the unmapped lblock of an extent file to pblock.
+// A full inode moves its extents to a leaf block; a full leaf is split in two
+// while the inode has room for one more index entry.
+static int Extent_Add(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t lblock, ulong_t pblock)
+{
+	struct GOSFS_Extent_Root *root = Extent_Root(iNode);
+	struct GOSFS_Extent_Leaf *leaf, *newLeaf;
+	struct FS_Buffer *leafBuf, *newBuf;
+	ulong_t newBlock;
+	int i, half, rc;
+
+	iNode->dirty = true;
+	if (root->hdr.depth == 0)
+	{
+		rc = Extent_Insert(root->u.extent, &root->hdr.entries, GOSFS_EXTENTS_IN_INODE, lblock, pblock);
+		if (rc != ENOSPACE) return rc;
+
+		// the inode is full: its extents become the first leaf
+		newBlock = 0;
+		rc = Allocate_Block(mountPoint, &newBlock);
+		if (rc < 0) return rc;
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), newBlock, &leafBuf);
+		if (rc < 0)
+		{
+			// Release_Block would need the buffer too; give back just the bit
+			Release_Run(mountPoint, newBlock, 1);
+			return rc;
+		}
+		leaf = (struct GOSFS_Extent_Leaf *)leafBuf->data;
+		leaf->hdr.depth = 0;
+		leaf->hdr.entries = root->hdr.entries;
+		memcpy(leaf->extent, root->u.extent, root->hdr.entries * sizeof(struct GOSFS_Extent));
+		Journal_Dirty(mountPoint, leafBuf);
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), leafBuf);
+
+		root->hdr.depth = 1;
+		root->hdr.entries = 1;
+		root->u.index[0].lblock = 0;
+		root->u.index[0].leaf = newBlock;
+	}
+
+	for (;;)
+	{
+		i = Extent_Pick_Leaf(root, lblock);
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), root->u.index[i].leaf, &leafBuf);
+		if (rc < 0) return rc;
+		leaf = (struct GOSFS_Extent_Leaf *)leafBuf->data;
+		rc = Extent_Insert(leaf->extent, &leaf->hdr.entries, GOSFS_EXTENTS_PER_LEAF, lblock, pblock);
+		if (rc != ENOSPACE)
+		{
+			if (rc == 0)
+				Journal_Dirty(mountPoint, leafBuf);
+			Release_FS_Buffer(GOSFS_CACHE(mountPoint), leafBuf);
+			return rc;
+		}
+		if (root->hdr.entries == GOSFS_EXTENT_INDEX_IN_INODE)
+		{
+			// the tree is as big as it gets: the file is too fragmented
+			Release_FS_Buffer(GOSFS_CACHE(mountPoint), leafBuf);
+			return ENOSPACE;
+		}
+
+		// split the leaf: its upper half moves to a new one
+		newBlock = 0;
+		rc = Allocate_Block(mountPoint, &newBlock);
+		if (rc >= 0)
+		{
+			rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), newBlock, &newBuf);
+			if (rc < 0)
+				Release_Run(mountPoint, newBlock, 1);
+		}
+		if (rc < 0)
+		{
+			Release_FS_Buffer(GOSFS_CACHE(mountPoint), leafBuf);
+			return rc;
+		}
+		newLeaf = (struct GOSFS_Extent_Leaf *)newBuf->data;
+		half = leaf->hdr.entries / 2;
+		newLeaf->hdr.depth = 0;
+		newLeaf->hdr.entries = leaf->hdr.entries - half;
+		memcpy(newLeaf->extent, &leaf->extent[half], newLeaf->hdr.entries * sizeof(struct GOSFS_Extent));
+		leaf->hdr.entries = half;
+		memmove(&root->u.index[i+2], &root->u.index[i+1],
+			(root->hdr.entries - i - 1) * sizeof(struct GOSFS_Extent_Index));
+		root->u.index[i+1].lblock = newLeaf->extent[0].lblock;
+		root->u.index[i+1].leaf = newBlock;
+		root->hdr.entries++;
+		Journal_Dirty(mountPoint, newBuf);
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), newBuf);
+		Journal_Dirty(mountPoint, leafBuf);
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), leafBuf);
+	}
+}
+
+// Free every block of an extent file, leaves included
+static int Extent_Release_All(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode)
+{
+	struct GOSFS_Extent_Root *root = Extent_Root(iNode);
+	struct GOSFS_Extent_Leaf *leaf;
+	struct FS_Buffer *leafBuf;
+	int i, j, rc;
+
+	if (root->hdr.depth == 0)
+	{
+		for (i = 0; i < root->hdr.entries; i++)
+			Release_Run(mountPoint, root->u.extent[i].pblock, root->u.extent[i].len);
+		return 0;
+	}
+
+	for (i = 0; i < root->hdr.entries; i++)
+	{
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), root->u.index[i].leaf, &leafBuf);
+		if (rc < 0) return rc;
+		leaf = (struct GOSFS_Extent_Leaf *)leafBuf->data;
+		for (j = 0; j < leaf->hdr.entries; j++)
+			Release_Run(mountPoint, leaf->extent[j].pblock, leaf->extent[j].len);
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), leafBuf);
+		Release_Block(mountPoint, root->u.index[i].leaf);
+	}
+	return 0;
+}
+
+// Map logical block blockNum of a file to its disk block.
+// With create set, missing data and indirect blocks are allocated
+// (iNode->dirty is set when the inode itself changes);
+// without it a block that was never allocated gives ENOBLOCK.
+// If pRunLen is not null it is set to the number of blocks, starting with
+// this one, that lie one after the other on disk.
+static int Bmap_Run(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t blockNum, bool create,
+	ulong_t *pRunLen)
+{
+	struct GOSFS_Dir_Entry *dirEntry = &iNode->dirEntry;
+	ulong_t newBlock, lastBlock, lastLblock;
+	int rc;
+
+	if (pRunLen != 0)
+		*pRunLen = 1;
+
+	if (dirEntry->flags & GOSFS_DIRENTRY_EXTENTS)
+	{
+		rc = Extent_Map(iNode, blockNum, pRunLen);
+		if (rc != ENOBLOCK || !create)
+			return rc;
+
+		newBlock = 0;
+		lastBlock = iNode->lastBlock;
+		lastLblock = iNode->lastLblock;
+		rc = Allocate_File_Block(mountPoint, iNode, blockNum, &newBlock, true);
+		if (rc < 0) return rc;
+		rc = Extent_Add(mountPoint, iNode, blockNum, newBlock);
+		if (rc < 0)
+		{
+			Unallocate_File_Block(mountPoint, iNode, blockNum, newBlock, lastBlock, lastLblock);
+			return rc;
+		}
+		if (pRunLen != 0)
+			*pRunLen = 1;
+		return newBlock;
+	}
+
+	if (blockNum < GOSFS_NUM_DIRECT_BLOCKS)
+	{
+		if (dirEntry->blockList[blockNum] == 0)
+		{
+			if (!create) return ENOBLOCK;
+			rc = Allocate_File_Block(mountPoint, iNode, blockNum, &dirEntry->blockList[blockNum], true);
+			if (rc < 0) return rc;
+			iNode->dirty = true;
+		}
+		return dirEntry->blockList[blockNum];
+	}
+
+	blockNum -= GOSFS_NUM_DIRECT_BLOCKS;
+	if (blockNum < GOSFS_NUM_PTRS_PER_BLOCK)
+		return create ? Allocate_First_Indirect_Block(mountPoint, iNode, blockNum, 0)
+			: Get_First_Indirect_Block(mountPoint, dirEntry, blockNum);
+
+	blockNum -= GOSFS_NUM_PTRS_PER_BLOCK;
+	if (blockNum < GOSFS_NUM_PTRS_PER_BLOCK * GOSFS_NUM_PTRS_PER_BLOCK)
+		return create ? Allocate_Second_Indirect_Block(mountPoint, iNode, blockNum, 0)
+			: Get_Second_Indirect_Block(mountPoint, dirEntry, blockNum);
+
+	return ENOBLOCK;
+}
+
+static int Bmap(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t blockNum, bool create)
+{
+	return Bmap_Run(mountPoint, iNode, blockNum, create, 0);
+}
+
+// Map logical block blockNum, which has no disk block yet, to newBlock
+static int Bmap_Install(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t blockNum,
+	ulong_t newBlock)
+{
+	struct GOSFS_Dir_Entry *dirEntry = &iNode->dirEntry;
+
+	if (dirEntry->flags & GOSFS_DIRENTRY_EXTENTS)
+		return Extent_Add(mountPoint, iNode, blockNum, newBlock);
+
+	if (blockNum < GOSFS_NUM_DIRECT_BLOCKS)
+	{
+		dirEntry->blockList[blockNum] = newBlock;
+		iNode->dirty = true;
+		return newBlock;
+	}
+
+	blockNum -= GOSFS_NUM_DIRECT_BLOCKS;
+	if (blockNum < GOSFS_NUM_PTRS_PER_BLOCK)
+		return Allocate_First_Indirect_Block(mountPoint, iNode, blockNum, newBlock);
+
+	blockNum -= GOSFS_NUM_PTRS_PER_BLOCK;
+	if (blockNum < GOSFS_NUM_PTRS_PER_BLOCK * GOSFS_NUM_PTRS_PER_BLOCK)
+		return Allocate_Second_Indirect_Block(mountPoint, iNode, blockNum, newBlock);
+
+	return ENOBLOCK;
+}
+
+// Like Bmap with create set for logical block blockNum, which has no disk
+// block yet, but the new block is neither cleared nor brought into the
+// cache: the caller is about to overwrite all of it on disk
+static int Bmap_Overwrite(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t blockNum)
+{
+	ulong_t newBlock = 0, lastBlock = iNode->lastBlock, lastLblock = iNode->lastLblock;
+	int rc;
+
+	rc = Allocate_File_Block(mountPoint, iNode, blockNum, &newBlock, false);
+	if (rc < 0) return rc;
+	rc = Bmap_Install(mountPoint, iNode, blockNum, newBlock);
+	if (rc < 0)
+	{
+		Unallocate_File_Block(mountPoint, iNode, blockNum, newBlock, lastBlock, lastLblock);
+		return rc;
+	}
+	return newBlock;
+}
+
+/* ----------------------------------------------------------------------
+ * Delayed allocation
+ * ---------------------------------------------------------------------- */
+// GOSFS_Write doesn't allocate blocks for data written past what a file has
+// on disk. The data waits in delayed buffers of the buffer cache, named by
+// (inode, logical block), and gets its disk blocks here, when the inode is
+// synced or when too much data is waiting. By then the whole of
+// it is known, so each run of logical blocks gets one run of disk blocks,
+// with a single bitmap search, right after the blocks the file already has.
+// Each delayed buffer takes a block off the free count when it is made,
+// so a write the volume has no room for fails right away.
+
+#define GOSFS_FLUSH_BATCH	16	/* delayed buffers taken at a time */
+
+// Take count blocks off the free count for delayed data
+static int Delayed_Reserve(struct Mount_Point *mountPoint, ulong_t count)
+{
+	struct GOSFS_Superblock *gosfsSuperBlock = GOSFS_SB(mountPoint);
+	int rc = 0;
+
+	Mutex_Lock(&gosfsSuperBlock->lock);
+	if(gosfsSuperBlock->blockFree.free < count)
+		rc = ENOSPACE;
+	else
+		gosfsSuperBlock->blockFree.free -= count;
+	Mutex_Unlock(&gosfsSuperBlock->lock);
+	return rc;
+}
+
+// Give back what Delayed_Reserve took for count delayed buffers
+// whose data is gone, or that got their blocks some other way
+static void Delayed_Unreserve(struct Mount_Point *mountPoint, ulong_t count)
+{
+	struct GOSFS_Superblock *gosfsSuperBlock = GOSFS_SB(mountPoint);
+
+	Mutex_Lock(&gosfsSuperBlock->lock);
+	gosfsSuperBlock->blockFree.free += count;
+	Mutex_Unlock(&gosfsSuperBlock->lock);
+}
+
+// Allocate disk blocks for all delayed data of iNode. Returns 1 if the
+// caller's journal handle ran out of room first; the rest then needs another.
+static int Flush_Delayed(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode)
+{
+	struct FS_Buffer *bufs[GOSFS_FLUSH_BATCH];
+	ulong_t start;
+	int n, i, j, k, got, rc = 0;
+	bool more = false;
+
+	while (rc >= 0 && !more && (n = Get_FS_Delayed_Buffers(GOSFS_CACHE(mountPoint), iNode, bufs, GOSFS_FLUSH_BATCH)) > 0)
+	{
+		for (i = 0; i < n; i += got)
+		{
+			// leave room for a run of the caller's own and the inode
+			if (Journal_Room(mountPoint) < 2 * GOSFS_JOURNAL_RUN_CREDITS + 1)
+			{
+				more = true;
+				break;
+			}
+			// logical blocks bufs[i..j) follow one another
+			for (j = i + 1; j < n && bufs[j]->lblock == bufs[j - 1]->lblock + 1; j++)
+				;
+			// the file's preallocation window is right where the
+			// data should go, if it has one
+			got = Prealloc_Take(mountPoint, iNode, j - i, true, &start);
+			if (got == 0)
+				got = Reserve_Run(mountPoint, iNode->lastBlock + 1, j - i, j - i, &start);
+			if (got < 0) { rc = got; break; }
+
+			for (k = 0; k < got; k++)
+			{
+				rc = Bmap_Install(mountPoint, iNode, bufs[i + k]->lblock, start + k);
+				if (rc < 0)
+				{
+					// still delayed, so still reserved
+					Release_Run(mountPoint, start + k, got - k);
+					Delayed_Reserve(mountPoint, got - k);
+					break;
+				}
+				Assign_FS_Buffer_Block(GOSFS_CACHE(mountPoint), bufs[i + k], start + k);
+				Release_FS_Buffer(GOSFS_CACHE(mountPoint), bufs[i + k]);
+			}
+			if (rc < 0) { i += k; break; }
+
+			iNode->lastBlock = start + got - 1;
+			iNode->lastLblock = bufs[i + got - 1]->lblock;
+		}
+
+		// on failure, or out of room, the rest stays delayed
+		for (; i < n; i++)
+			Release_FS_Buffer(GOSFS_CACHE(mountPoint), bufs[i]);
+	}
+
+	return rc < 0 ? rc : more;
+}
+
+// Get the buffer for logical block blockNum of iNode, which has no
+// disk block yet, without allocating one
+static int Get_Delayed_Block(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, ulong_t blockNum,
+	struct FS_Buffer **pBuf)
+{
+	int rc;
+
+	if (Get_FS_Delayed_Buffer(GOSFS_CACHE(mountPoint), iNode, blockNum, false, pBuf) == 0)
+		return 0;
+
+	// too much data without disk blocks; give this file's data its blocks
+	if (GOSFS_CACHE(mountPoint)->numDelayed >= FS_BUFFER_CACHE_MAX_DELAYED)
+	{
+		rc = Flush_Delayed(mountPoint, iNode);
+		if (rc < 0) return rc;
+	}
+	// still too much (other files' data); allocate this block right now
+	if (GOSFS_CACHE(mountPoint)->numDelayed >= FS_BUFFER_CACHE_MAX_DELAYED)
+		return ENOMEM;
+
+	rc = Delayed_Reserve(mountPoint, 1);
+	if (rc < 0) return rc;
+	rc = Get_FS_Delayed_Buffer(GOSFS_CACHE(mountPoint), iNode, blockNum, true, pBuf);
+	if (rc < 0)
+		Delayed_Unreserve(mountPoint, 1);
+	return rc;
+}
+
+/* ----------------------------------------------------------------------
+ * Inline data
+ * ---------------------------------------------------------------------- */
+// On a volume formatted with GOSFS_FEATURE_INLINE_DATA a new file keeps its
+// first GOSFS_INLINE_DATA_MAX bytes in its directory entry, where blockList
+// and acl would be, and has GOSFS_DIRENTRY_INLINE set. Such a file costs no
+// data block, and reading it costs nothing beyond its inode. The first write
+// that reaches past the inline area moves the data to logical block 0 and
+// the file is mapped like any other from then on.
+
+static char *Inline_Data(struct GOSFS_Dir_Entry *dirEntry)
+{
+	return (char *)dirEntry->blockList;
+}
+
+// Move the inline data of iNode to a block of its own; with sync set
+// the block is allocated now instead of being delayed
+static int Inline_Migrate(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode, bool sync)
+{
+	struct GOSFS_Dir_Entry *dirEntry = &iNode->dirEntry;
+	char data[GOSFS_INLINE_DATA_MAX];
+	struct FS_Buffer *buf;
+	int rc = ENOMEM;
+
+	memcpy(data, Inline_Data(dirEntry), GOSFS_INLINE_DATA_MAX);
+	memset(Inline_Data(dirEntry), '\0', GOSFS_INLINE_DATA_MAX);
+	dirEntry->flags &= ~GOSFS_DIRENTRY_INLINE;
+	iNode->dirty = true;
+	if (dirEntry->size == 0)
+		return 0;
+
+	if (!sync)
+		rc = Get_Delayed_Block(mountPoint, iNode, 0, &buf);
+	if (rc < 0)
+	{
+		rc = Bmap(mountPoint, iNode, 0, true);
+		if (rc >= 0)
+			rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), rc, &buf);
+	}
+	if (rc < 0)
+	{
+		// the file stays inline
+		memcpy(Inline_Data(dirEntry), data, GOSFS_INLINE_DATA_MAX);
+		dirEntry->flags |= GOSFS_DIRENTRY_INLINE;
+		return rc;
+	}
+
+	memset(buf->data, '\0', GOSFS_FS_BLOCK_SIZE);
+	memcpy(buf->data, data, dirEntry->size);
+	Modify_FS_Owner_Buffer(GOSFS_CACHE(mountPoint), buf, iNode);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), buf);
+	return 0;
+}
+
+/* ----------------------------------------------------------------------
+ * Directories
+ * ---------------------------------------------------------------------- */
+
+// FNV-1a; only the name is hashed, so a record keeps its hash when leaves split
+static ulong_t Hdir_Hash(const char *name)
+{
+	ulong_t hash = 2166136261UL;
+
+	while (*name != '\0')
+	{
+		hash ^= (uchar_t)*name++;
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+static struct GOSFS_Hdir_Record *Hdir_Find_Record(struct GOSFS_Hdir_Leaf *leaf, ulong_t hash, const char *name)
+{
+	struct GOSFS_Hdir_Record *rec;
+	ulong_t off = 0;
+
+	while (off < leaf->used)
+	{
+		rec = (struct GOSFS_Hdir_Record *)(leaf->records + off);
+		if (rec->hash == hash && strcmp(rec->name, name) == 0)
+			return rec;
+		off += rec->recLen;
+	}
+
+	return 0;
+}
+
+// Logical block of the leaf that holds (or would hold) hash
+static int Hdir_Find_Leaf(struct Mount_Point *mountPoint, struct GOSFS_Inode *dir, ulong_t hash)
+{
+	struct FS_Buffer *hdrBuf;
+	struct GOSFS_Hdir_Header *hdr;
+	int rc;
+
+	rc = Bmap(mountPoint, dir, 0, false);
+	if (rc < 0) return rc;
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), rc, &hdrBuf);
+	if (rc < 0) return rc;
+	hdr = (struct GOSFS_Hdir_Header *)hdrBuf->data;
+	if (hdr->magic != GOSFS_HDIR_MAGIC)
+		rc = EINVALIDFS;
+	else
+		rc = hdr->table[hash & ((1 << hdr->globalDepth) - 1)];
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), hdrBuf);
+
+	return rc;
+}
+
+static int Hdir_Lookup(struct Mount_Point *mountPoint, struct GOSFS_Inode *dir, const char *name,
+	ulong_t *pInodeNum, ulong_t *pFlags)
+{
+	struct FS_Buffer *leafBuf;
+	struct GOSFS_Hdir_Record *rec;
+	ulong_t hash = Hdir_Hash(name);
+	int rc;
+
+	if (dir->dirEntry.size == 0)
+		return ENOTFOUND;
+
+	rc = Hdir_Find_Leaf(mountPoint, dir, hash);
+	if (rc < 0) return rc;
+	rc = Bmap(mountPoint, dir, rc, false);
+	if (rc < 0) return rc;
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), rc, &leafBuf);
+	if (rc < 0) return rc;
+
+	rec = Hdir_Find_Record((struct GOSFS_Hdir_Leaf *)leafBuf->data, hash, name);
+	if (rec == 0)
+		rc = ENOTFOUND;
+	else
+	{
+		*pInodeNum = rec->inodeNum;
+		*pFlags = rec->flags;
+		rc = 0;
+	}
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), leafBuf);
+
+	return rc;
+}
+
+// Give an empty hashed directory its header and first leaf
+static int Hdir_Init(struct Mount_Point *mountPoint, struct GOSFS_Inode *dir)
+{
+	struct FS_Buffer *buf;
+	struct GOSFS_Hdir_Header *hdr;
+	int hdrBlock, leafBlock, rc;
+
+	hdrBlock = Bmap(mountPoint, dir, 0, true);
+	if (hdrBlock < 0) return hdrBlock;
+	leafBlock = Bmap(mountPoint, dir, 1, true);
+	if (leafBlock < 0) return leafBlock;
+
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), hdrBlock, &buf);
+	if (rc < 0) return rc;
+	memset(buf->data, '\0', GOSFS_FS_BLOCK_SIZE);
+	hdr = (struct GOSFS_Hdir_Header *)buf->data;
+	hdr->magic = GOSFS_HDIR_MAGIC;
+	hdr->globalDepth = 0;
+	hdr->numBlocks = 2;
+	hdr->table[0] = 1;
+	Journal_Dirty(mountPoint, buf);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), buf);
+
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), leafBlock, &buf);
+	if (rc < 0) return rc;
+	memset(buf->data, '\0', GOSFS_FS_BLOCK_SIZE); // localDepth 0, no records
+	Journal_Dirty(mountPoint, buf);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), buf);
+
+	return 0;
+}
+
+// Add a record for name to a hashed directory.
+// A full leaf is split on its next hash bit; if the bucket table has no bit
+// left to split on it is doubled first.
+static int Hdir_Insert(struct Mount_Point *mountPoint, struct GOSFS_Inode *dir, const char *name,
+	ulong_t inodeNum, ulong_t flags)
+{
+	struct FS_Buffer *hdrBuf, *leafBuf = 0, *newBuf = 0;
+	struct GOSFS_Hdir_Header *hdr;
+	struct GOSFS_Hdir_Leaf *leaf = 0, *newLeaf;
+	struct GOSFS_Hdir_Record *rec;
+	ulong_t hash = Hdir_Hash(name);
+	ulong_t nameLen = strlen(name);
+	ulong_t recLen = GOSFS_HDIR_REC_LEN(nameLen);
+	ulong_t leafLblk, newLblk, bit, off, keep, len, i;
+	bool hdrDirty = false;
+	int rc;
+
+	if (dir->dirEntry.blockList[0] == 0)
+	{
+		rc = Hdir_Init(mountPoint, dir);
+		if (rc < 0) return rc;
+	}
+
+	rc = Bmap(mountPoint, dir, 0, false);
+	if (rc < 0) return rc;
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), rc, &hdrBuf);
+	if (rc < 0) return rc;
+	hdr = (struct GOSFS_Hdir_Header *)hdrBuf->data;
+
+	for (;;)
+	{
+		leafLblk = hdr->table[hash & ((1 << hdr->globalDepth) - 1)];
+		rc = Bmap(mountPoint, dir, leafLblk, false);
+		if (rc < 0) goto done;
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), rc, &leafBuf);
+		if (rc < 0) { leafBuf = 0; goto done; }
+		leaf = (struct GOSFS_Hdir_Leaf *)leafBuf->data;
+
+		if (leaf->used + recLen <= sizeof(leaf->records))
+			break;
+
+		Debug("split leaf %d, depth %d\n", (int)leafLblk, (int)leaf->localDepth);
+		if (leaf->localDepth == hdr->globalDepth)
+		{
+			if (hdr->globalDepth == GOSFS_HDIR_MAX_DEPTH)
+			{
+				rc = ENOSPACE;
+				goto done;
+			}
+			for (i = 0; i < (1 << hdr->globalDepth); i++)
+				hdr->table[i + (1 << hdr->globalDepth)] = hdr->table[i];
+			hdr->globalDepth++;
+			hdrDirty = true;
+		}
+
+		newLblk = hdr->numBlocks;
+		rc = Bmap(mountPoint, dir, newLblk, true);
+		if (rc < 0) goto done;
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), rc, &newBuf);
+		if (rc < 0) { newBuf = 0; goto done; }
+		newLeaf = (struct GOSFS_Hdir_Leaf *)newBuf->data;
+		hdr->numBlocks++;
+		hdrDirty = true;
+
+		// records with the new bit set move to the new leaf
+		bit = 1 << leaf->localDepth;
+		leaf->localDepth++;
+		newLeaf->localDepth = leaf->localDepth;
+		newLeaf->used = 0;
+		off = keep = 0;
+		while (off < leaf->used)
+		{
+			rec = (struct GOSFS_Hdir_Record *)(leaf->records + off);
+			len = rec->recLen;
+			if (rec->hash & bit)
+			{
+				memcpy(newLeaf->records + newLeaf->used, rec, len);
+				newLeaf->used += len;
+			}
+			else
+			{
+				if (keep != off)
+					memmove(leaf->records + keep, rec, len);
+				keep += len;
+			}
+			off += len;
+		}
+		leaf->used = keep;
+		for (i = 0; i < (1 << hdr->globalDepth); i++)
+		{
+			if (hdr->table[i] == leafLblk && (i & bit))
+				hdr->table[i] = newLblk;
+		}
+
+		Journal_Dirty(mountPoint, newBuf);
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), newBuf);
+		newBuf = 0;
+		Journal_Dirty(mountPoint, leafBuf);
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), leafBuf);
+		leafBuf = 0;
+	}
+
+	rec = (struct GOSFS_Hdir_Record *)(leaf->records + leaf->used);
+	rec->hash = hash;
+	rec->inodeNum = inodeNum;
+	rec->flags = flags;
+	rec->recLen = recLen;
+	rec->nameLen = nameLen;
+	strcpy(rec->name, name);
+	leaf->used += recLen;
+	Journal_Dirty(mountPoint, leafBuf);
+	rc = 0;
+
+done:
+	if (newBuf != 0)
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), newBuf);
+	if (leafBuf != 0)
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), leafBuf);
+	if (hdrDirty)
+		Journal_Dirty(mountPoint, hdrBuf);
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), hdrBuf);
+
+	return rc;
+}
+
+// Remove the record for name; leaves are not merged back
+static int Hdir_Remove(struct Mount_Point *mountPoint, struct GOSFS_Inode *dir, const char *name)
+{
+	struct FS_Buffer *leafBuf;
+	struct GOSFS_Hdir_Leaf *leaf;
+	struct GOSFS_Hdir_Record *rec;
+	ulong_t hash = Hdir_Hash(name);
+	ulong_t off, len;
+	int rc;
+
+	rc = Hdir_Find_Leaf(mountPoint, dir, hash);
+	if (rc < 0) return rc;
+	rc = Bmap(mountPoint, dir, rc, false);
+	if (rc < 0) return rc;
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), rc, &leafBuf);
+	if (rc < 0) return rc;
+	leaf = (struct GOSFS_Hdir_Leaf *)leafBuf->data;
+
+	rec = Hdir_Find_Record(leaf, hash, name);
+	if (rec == 0)
+		rc = ENOTFOUND;
+	else
+	{
+		off = (uchar_t *)rec - leaf->records;
+		len = rec->recLen;
+		memmove(rec, (uchar_t *)rec + len, leaf->used - off - len);
+		leaf->used -= len;
+		Journal_Dirty(mountPoint, leafBuf);
+	}
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), leafBuf);
+
+	return rc;
+}
+
+// Find name in directory dir, which the caller has locked, shared or not.
+// On a dcache miss an old style directory is scanned once and every child
+// seen is cached, so lookups of its siblings hit as well; a hashed
+// directory reads its header and a single leaf.
+// Returns 0 and sets *pInodeNum (and *pFlags if not null) if found,
+// ENOTFOUND if not.
+static int Dir_Lookup(struct Mount_Point *mountPoint, struct GOSFS_Inode *dir, const char *name,
+	ulong_t *pInodeNum, ulong_t *pFlags)
+{
+	struct FS_Buffer *nodeBuf;
+	struct GOSFS_Dir_Entry *entry;
+	ulong_t dirNum = dir->inodeNumber;
+	ulong_t inodeNum = 0, flags = 0;
+	ulong_t childNum;
+	int inodeBlock, inodeOffset;
+	int i, rc;
+
+	if (Dcache_Lookup(mountPoint, dirNum, name, &inodeNum, &flags))
+		goto done;
+
+	if (dir->dirEntry.flags & GOSFS_DIRENTRY_HASHED)
+	{
+		rc = Hdir_Lookup(mountPoint, dir, name, &inodeNum, &flags);
+		if (rc < 0 && rc != ENOTFOUND) return rc;
+		if (rc == 0)
+			Dcache_Insert(mountPoint, dirNum, name, inodeNum, flags);
+	}
+	else
+	{
+		// deletion leaves holes in blockList, so look at every slot;
+		// name and flags of a child never change, so its inode block will do
+		for (i = 0; i < GOSFS_NUM_DIR_ENTRY; i++)
+		{
+			childNum = dir->dirEntry.blockList[i];
+			if (childNum == 0) continue;
+			FIND_INODEBLOCK_AND_INODEOFFSET(mountPoint, childNum, inodeBlock, inodeOffset);
+			rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), inodeBlock, &nodeBuf);
+			if (rc < 0) return rc;
+			entry = &((struct GOSFS_Dir_Block *)nodeBuf->data)->entryTable[inodeOffset];
+			if (!(entry->flags & GOSFS_DIRENTRY_OLD))
+			{
+				Dcache_Insert(mountPoint, dirNum, entry->filename, childNum, entry->flags);
+				if (inodeNum == 0 && strcmp(name, entry->filename) == 0)
+				{
+					inodeNum = childNum;
+					flags = entry->flags;
+				}
+			}
+			Release_FS_Buffer(GOSFS_CACHE(mountPoint), nodeBuf);
+		}
+	}
+
+	if (inodeNum == 0)
+		Dcache_Insert(mountPoint, dirNum, name, 0, 0);
+
+done:
+	if (inodeNum == 0)
+		return ENOTFOUND;
+	*pInodeNum = inodeNum;
+	if (pFlags != 0)
+		*pFlags = flags;
+	return 0;
+}
+
+// Find name in directory dirNum, as Dir_Lookup does.
+// Returns ENOTDIR if dirNum is not a directory.
+static int Lookup_In_Directory(struct Mount_Point *mountPoint, ulong_t dirNum, const char *name,
+	ulong_t *pInodeNum, ulong_t *pFlags)
+{
+	struct GOSFS_Inode *dir;
+	ulong_t inodeNum, flags;
+	int rc;
+
+	// a hit needs neither the directory nor its lock
+	if (Dcache_Lookup(mountPoint, dirNum, name, &inodeNum, &flags))
+	{
+		if (inodeNum == 0)
+			return ENOTFOUND;
+		*pInodeNum = inodeNum;
+		if (pFlags != 0)
+			*pFlags = flags;
+		return 0;
+	}
+
+	rc = Iget(mountPoint, dirNum, &dir);
+	if (rc < 0) return rc;
+	if (!(dir->dirEntry.flags & GOSFS_DIRENTRY_ISDIRECTORY))
+	{
+		Iput(dir);
+		return ENOTDIR;
+	}
+
+	// any number of lookups may scan it at once
+	RW_Read_Lock(&dir->lock);
+	rc = Dir_Lookup(mountPoint, dir, name, pInodeNum, pFlags);
+	RW_Read_Unlock(&dir->lock);
+	Iput(dir);
+	return rc;
+}
+
+// Walk path (relative to the mount point) from the root directory.
+// If lastName is not null, the last component is not looked up: it is copied
+// to lastName and *pInodeNum is the directory that should contain it.
+// Otherwise *pInodeNum (and *pFlags if not null) describe the whole path.
+static int Resolve_Path(struct Mount_Point *mountPoint, const char *path, char *lastName,
+	ulong_t *pInodeNum, ulong_t *pFlags)
+{
+	char name[GOSFS_FILENAME_MAX + 1];
+	const char *slash;
+	ulong_t inodeNum = GOSFS_ROOT_INODE_NUM;
+	ulong_t flags = GOSFS_DIRENTRY_USED | GOSFS_DIRENTRY_ISDIRECTORY;
+	int len, rc;
+
+	while (*path == '/') path++;
+	if (*path == '\0' && lastName != 0)
+		return ENOTFOUND; // the root has no name in any directory
+
+	while (*path != '\0')
+	{
+		slash = strchr(path, '/');
+		len = (slash != 0) ? slash - path : strlen(path);
+		if (len > GOSFS_FILENAME_MAX)
+			return ENAMETOOLONG;
+		memcpy(name, path, len);
+		name[len] = '\0';
+		path += len;
+		while (*path == '/') path++;
+
+		if (!(flags & GOSFS_DIRENTRY_ISDIRECTORY))
+			return ENOTDIR;
+		if (*path == '\0' && lastName != 0)
+		{
+			strcpy(lastName, name);
+			break;
+		}
+		rc = Lookup_In_Directory(mountPoint, inodeNum, name, &inodeNum, &flags);
+		if (rc < 0)
+			return rc;
+	}
+
+	*pInodeNum = inodeNum;
+	if (pFlags != 0)
+		*pFlags = flags;
+	return 0;
+}
+
+// Enter child inodeNum as name into directory dir, which the caller
+// has locked exclusively
+static int Add_Dir_Child(struct Mount_Point *mountPoint, struct GOSFS_Inode *dir, const char *name,
+	ulong_t inodeNum, ulong_t flags)
+{
+	int i, rc;
+
+	if (dir->dirEntry.flags & GOSFS_DIRENTRY_HASHED)
+	{
+		rc = Hdir_Insert(mountPoint, dir, name, inodeNum, flags);
+		if (rc < 0) return rc;
+	}
+	else
+	{
+		for (i = 0; i < GOSFS_NUM_DIR_ENTRY; i++)
+		{	if (dir->dirEntry.blockList[i] == 0) break; }
+		if (i == GOSFS_NUM_DIR_ENTRY)
+			return EMFILE;
+		dir->dirEntry.blockList[i] = inodeNum;
+	}
+	dir->dirEntry.size++;
+	dir->dirty = true;
+	Debug("	size:%d\n", (int)dir->dirEntry.size);
+
+	return 0;
+}
+
+// Take child inodeNum, entered as name, out of directory dir, which the
+// caller has locked exclusively
+static int Remove_Dir_Child(struct Mount_Point *mountPoint, struct GOSFS_Inode *dir, const char *name,
+	ulong_t inodeNum)
+{
+	int i, rc;
+
+	if (dir->dirEntry.flags & GOSFS_DIRENTRY_HASHED)
+	{
+		rc = Hdir_Remove(mountPoint, dir, name);
+		if (rc < 0) return rc;
+	}
+	else
+	{
+		for (i = 0; i < GOSFS_NUM_DIR_ENTRY; i++)
+		{ if (dir->dirEntry.blockList[i] == inodeNum) break; }
+		if (i == GOSFS_NUM_DIR_ENTRY)
+			return ENOTFOUND;
+		dir->dirEntry.blockList[i] = 0;
+	}
+	dir->dirEntry.size--;
+	dir->dirty = true;
+	Debug("	size:%d\n", (int)dir->dirEntry.size);
+
+	return 0;
+}
+
+// Can directory dirEntry take one more child?
+static bool Dir_Has_Room(struct GOSFS_Dir_Entry *dirEntry)
+{
+	// a hashed directory only fills up when the bucket table can't grow any more
+	if (dirEntry->flags & GOSFS_DIRENTRY_HASHED)
+		return true;
+	return dirEntry->size < GOSFS_NUM_DIR_ENTRY;
+}
+
+// Install file in the current process's file table
+// returns the file descriptor, or 0 for a kernel thread
+static int Add_To_User_File_List(struct File *file)
+{
+	int i;
+
+	if (g_currentThread->userContext == 0)
+		return 0;
+
+	for (i = 0; i < USER_MAX_FILES; i++)
+	{ if (g_currentThread->userContext->fileList[i] == 0) break; }
+	if (i == USER_MAX_FILES)
+		return EMFILE;
+	g_currentThread->userContext->fileList[i] = file;
+	g_currentThread->userContext->fileCount++;
+
+	return i;
+}
+
+/* ----------------------------------------------------------------------
+ * Orphan reclaim
+ * ---------------------------------------------------------------------- */
+// Deleting a large file only unlinks it: the inode is flagged
+// GOSFS_DIRENTRY_ORPHAN and listed in the superblock, and the reclaim thread
+// gives its blocks back later, an indirect block at a time. Each step clears
+// the pointers to the blocks it frees in the same transaction, so after a
+// crash the orphans are still listed at mount and the thread picks up where
+// it stopped.
+
+#define GOSFS_RECLAIM_MIN_SIZE	(GOSFS_NUM_DIRECT_BLOCKS * GOSFS_FS_BLOCK_SIZE)	/* smaller files go at once */
+
+// Put inodeNum on the orphan list; false if the list is full
+static bool Orphan_Add(struct Mount_Point *mountPoint, ulong_t inodeNum)
+{
+	struct GOSFS_Superblock *gosfsSuperBlock = (struct GOSFS_Superblock *)mountPoint->fsData;
+	struct GOSFS_Instance *geo = &gosfsSuperBlock->gfsInstance;
+	bool added = false;
+
+	Mutex_Lock(&gosfsSuperBlock->lock);
+	if (geo->numOrphans < GOSFS_MAX_ORPHANS)
+	{
+		geo->orphans[geo->numOrphans++] = inodeNum;
+		gosfsSuperBlock->dirty = true;
+		Cond_Broadcast(&gosfsSuperBlock->reclaimCond);
+		added = true;
+	}
+	Mutex_Unlock(&gosfsSuperBlock->lock);
+
+	return added;
+}
+
+static void Orphan_Remove(struct Mount_Point *mountPoint, ulong_t inodeNum)
+{
+	struct GOSFS_Superblock *gosfsSuperBlock = (struct GOSFS_Superblock *)mountPoint->fsData;
+	struct GOSFS_Instance *geo = &gosfsSuperBlock->gfsInstance;
+	ulong_t i;
+
+	Mutex_Lock(&gosfsSuperBlock->lock);
+	for (i = 0; i < geo->numOrphans && geo->orphans[i] != inodeNum; i++)
+		;
+	if (i < geo->numOrphans)
+	{
+		for (geo->numOrphans--; i < geo->numOrphans; i++)
+			geo->orphans[i] = geo->orphans[i + 1];
+		gosfsSuperBlock->dirty = true;
+	}
+	Mutex_Unlock(&gosfsSuperBlock->lock);
+}
+
+// Free the n blocks in blocks, a run of neighbours at a time
+static void Reclaim_Free(struct Mount_Point *mountPoint, ulong_t *blocks, int n)
+{
+	ulong_t block;
+	int i, j;
+
+	// mostly sorted already: the blocks were allocated in file order
+	for (i = 1; i < n; i++)
+	{
+		block = blocks[i];
+		for (j = i; j > 0 && blocks[j - 1] > block; j--)
+			blocks[j] = blocks[j - 1];
+		blocks[j] = block;
+	}
+
+	for (i = 0; i < n; i = j)
+	{
+		for (j = i + 1; j < n && blocks[j] == blocks[j - 1] + 1; j++)
+			;
+		Release_Run(mountPoint, blocks[i], j - i);
+	}
+}
+
+// Free every block the indirect block blockNum points to, not the block itself;
+// batch has room for GOSFS_NUM_PTRS_PER_BLOCK numbers
+static int Reclaim_Indirect(struct Mount_Point *mountPoint, ulong_t blockNum, ulong_t *batch)
+{
+	struct GOSFS_Indirect_Block *indBlock;
+	struct FS_Buffer *blockBuf;
+	int i, n = 0, rc;
+
+	Journal_Start(mountPoint, Journal_Free_Credits(mountPoint));
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), blockNum, &blockBuf);
+	if (rc >= 0)
+	{
+		indBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
+		for (i = 0; i < GOSFS_NUM_PTRS_PER_BLOCK; i++)
+		{
+			if (indBlock->blockNumber[i] > 0)
+			{
+				batch[n++] = indBlock->blockNumber[i];
+				indBlock->blockNumber[i] = 0;
+			}
+		}
+		Journal_Dirty(mountPoint, blockBuf);
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+		Reclaim_Free(mountPoint, batch, n);
+	}
+	Journal_Stop(mountPoint);
+
+	return rc;
+}
+
+// Free the blocks of a file mapped by blockList
+static int Reclaim_Mapped(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode)
+{
+	ulong_t *blockList = iNode->dirEntry.blockList;
+	struct GOSFS_Indirect_Block *indBlock;
+	struct FS_Buffer *blockBuf;
+	ulong_t *batch, *inner;
+	int i, n, rc = 0;
+
+	batch = (ulong_t *)Malloc(2 * GOSFS_NUM_PTRS_PER_BLOCK * sizeof(ulong_t));
+	if (batch == NULL) return ENOMEM;
+	inner = batch + GOSFS_NUM_PTRS_PER_BLOCK;
+
+	// the second indirect block: empty each first indirect block it names,
+	// then free those blocks
+	if (blockList[9] > 0)
+	{
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), blockList[9], &blockBuf);
+		if (rc < 0) goto done;
+		indBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
+		memcpy(inner, indBlock->blockNumber, GOSFS_NUM_PTRS_PER_BLOCK * sizeof(ulong_t));
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+
+		for (i = 0; i < GOSFS_NUM_PTRS_PER_BLOCK && rc >= 0; i++)
+		{
+			if (inner[i] > 0)
+				rc = Reclaim_Indirect(mountPoint, inner[i], batch);
+		}
+		if (rc >= 0)
+			rc = Reclaim_Indirect(mountPoint, blockList[9], batch);
+		if (rc < 0) goto done;
+	}
+	if (blockList[8] > 0)
+	{
+		rc = Reclaim_Indirect(mountPoint, blockList[8], batch);
+		if (rc < 0) goto done;
+	}
+
+	// last the direct and the (now empty) indirect blocks
+	Journal_Start(mountPoint, Journal_Free_Credits(mountPoint));
+	for (i = 0, n = 0; i < GOSFS_NUM_BLOCK_PTRS; i++)
+	{
+		if (blockList[i] > 0)
+		{
+			batch[n++] = blockList[i];
+			blockList[i] = 0;
+		}
 	}
+	Reclaim_Free(mountPoint, batch, n);
+	rc = Write_Inode(iNode, false);
+	Journal_Stop(mountPoint);
 
-	rc = fIndNum;
-	
 done:
-
-	Release_FS_Buffer(gosfsBufferCache, blockBuf);
+	Free(batch);
 	return rc;
 }
 
-int Get_Second_Indirect_Block(struct GOSFS_Dir_Entry* dirEntry, ulong_t directBlock)
+// Free an orphan and its blocks, and take it off the list.
+// EBUSY if it is still in use (by the delete that made it an orphan).
+static int Reclaim_Inode(struct Mount_Point *mountPoint, ulong_t inodeNum)
 {
-	Debug("read sec ind block.\n");
-	if(dirEntry->blockList[9] == 0)
-		return ENOBLOCK;
+	struct GOSFS_Inode *iNode = NULL;
+	int rc;
 
-	struct GOSFS_Indirect_Block *dirBlock;
-	struct FS_Buffer *blockBuf;
-	int sIndNum, sIndOffset;
-	int sIndBlock, fIndBlock;
-	// First get second indirect block
-	//int sIndBlockNum = directBlock - GOSFS_NUM_DIRECT_BLOCKS - GOSFS_NUM_PTRS_PER_BLOCK;
-	FIND_SEC_IND_BLOCK_NUM(directBlock, sIndNum, sIndOffset);
-	int rc = Get_FS_Buffer(gosfsBufferCache, dirEntry->blockList[9], &blockBuf);
-	if(rc < 0)  goto done;
-	dirBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
-	sIndBlock = dirBlock->blockNumber[sIndNum];
-	if(sIndBlock == 0)
+	rc = Iget(mountPoint, inodeNum, &iNode);
+	if (rc == 0 && iNode->icount > 1)
 	{
-		rc = ENOBLOCK;
-		goto done;
+		Iput(iNode);
+		return EBUSY;
 	}
-	Release_FS_Buffer(gosfsBufferCache, blockBuf);
 
-	// Find first indirect block
-	rc = Get_FS_Buffer(gosfsBufferCache, sIndBlock, &blockBuf);
-	if(rc < 0) goto done;
-	dirBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
-	fIndBlock = dirBlock->blockNumber[sIndOffset];
-	if(fIndBlock == 0)  
-		rc = ENOBLOCK;
-	rc = fIndBlock;
-done:
-	Release_FS_Buffer(gosfsBufferCache, blockBuf); 
+	if (rc == 0 && (iNode->dirEntry.flags & GOSFS_DIRENTRY_ORPHAN))
+	{
+		Debug("gosfs reclaim: inode %d\n", (int)inodeNum);
+		if (iNode->dirEntry.flags & GOSFS_DIRENTRY_EXTENTS)
+		{
+			Journal_Start(mountPoint, Journal_Free_Credits(mountPoint));
+			Extent_Release_All(mountPoint, iNode);
+			memset(iNode->dirEntry.blockList, '\0', sizeof(iNode->dirEntry.blockList));
+			rc = Write_Inode(iNode, false);
+			Journal_Stop(mountPoint);
+		}
+		else
+			rc = Reclaim_Mapped(mountPoint, iNode);
+		if (rc < 0)
+			Print("gosfs: can't reclaim inode %d, error %d\n", (int)inodeNum, rc);
+	}
+
+	// the inode goes in the transaction that takes it off the list;
+	// on failure it is dropped from the list all the same, so it can't
+	// keep the thread busy, and whatever it still has is lost
+	Journal_Start(mountPoint, GOSFS_JOURNAL_OP_CREDITS);
+	if (rc == 0 && (iNode->dirEntry.flags & GOSFS_DIRENTRY_ORPHAN))
+		Delete_GOSFS_Inode(mountPoint, inodeNum);
+	Orphan_Remove(mountPoint, inodeNum);
+	Journal_Stop(mountPoint);
+	if (iNode != NULL)
+		Iforget(iNode);
+
 	return rc;
 }
 
+// Every mounted volume has a reclaim thread of its own; arg is its Mount_Point
+static void GOSFS_Reclaimer(ulong_t arg)
+{
+	struct Mount_Point *mountPoint = (struct Mount_Point *)arg;
+	struct GOSFS_Superblock *gosfsSuperBlock = GOSFS_SB(mountPoint);
+	ulong_t inodeNum, idle;
+
+	for (;;)
+	{
+		Mutex_Lock(&gosfsSuperBlock->lock);
+		while (gosfsSuperBlock->gfsInstance.numOrphans == 0)
+			Cond_Wait(&gosfsSuperBlock->reclaimCond, &gosfsSuperBlock->lock);
+		inodeNum = gosfsSuperBlock->gfsInstance.orphans[0];
+		idle = gosfsSuperBlock->orphanIdle;
+		Mutex_Unlock(&gosfsSuperBlock->lock);
+
+		// still in use: try again once its last user has let go of it
+		if (Reclaim_Inode(mountPoint, inodeNum) == EBUSY)
+		{
+			Mutex_Lock(&gosfsSuperBlock->lock);
+			while (gosfsSuperBlock->orphanIdle == idle)
+				Cond_Wait(&gosfsSuperBlock->reclaimCond, &gosfsSuperBlock->lock);
+			Mutex_Unlock(&gosfsSuperBlock->lock);
+		}
+	}
+}
+
 /* ----------------------------------------------------------------------
  * Implementation of VFS operations
  * ---------------------------------------------------------------------- */
@@ -582,102 +3029,175 @@ static int GOSFS_FStat(struct File *file, struct VFS_File_Stat *stat)
 	return 0;
 }
 
+// O_DIRECT: move count whole blocks, from disk block block on, between
+// the disk and buf at offset without caching them. They go straight to
+// or from the caller's memory if the kernel can reach it in one piece,
+// through a block of our own otherwise.
+static int Direct_Transfer(struct Mount_Point *mountPoint, ulong_t block, ulong_t count,
+	struct VFS_Buffer *buf, ulong_t offset, bool write)
+{
+	void *data = VFS_Buffer_Address(buf, offset, count * GOSFS_FS_BLOCK_SIZE);
+	char *bounce;
+	ulong_t i;
+	int rc = 0;
+
+	if(data != 0)
+		return Direct_FS_IO(GOSFS_CACHE(mountPoint), block, count, data, write);
+
+	bounce = (char *)Malloc(GOSFS_FS_BLOCK_SIZE);
+	if(bounce == NULL)
+		return ENOMEM;
+	for(i = 0; i < count && rc == 0; i++, offset += GOSFS_FS_BLOCK_SIZE)
+	{
+		if(write && !VFS_Copy_In(bounce, buf, offset, GOSFS_FS_BLOCK_SIZE))
+			rc = EINVALID;
+		if(rc == 0)
+			rc = Direct_FS_IO(GOSFS_CACHE(mountPoint), block + i, 1, bounce, write);
+		if(rc == 0 && !write && !VFS_Copy_Out(buf, offset, bounce, GOSFS_FS_BLOCK_SIZE))
+			rc = EINVALID;
+	}
+	Free(bounce);
+	return rc;
+}
+
 /*
  * Read data from current position in file.
  */
 // Notice: Because seek may let the filePos point to random position,
-// we have to check the data before start to read, to make sure there exist the data;
-// if there is no data, or not enough data compared with numBytes, return ENODATA
+// a file may have holes: blocks below its size that were never written
+// and have no disk block. They read as zeros, from s_zeroBlock, without I/O.
 
-static int GOSFS_Read(struct File *file, void *buf, ulong_t numBytes)
+static int Do_Read(struct File *file, struct VFS_Buffer *buf, ulong_t numBytes)
 {
 	Debug("gosfs read:\n");
 	if(!(file->mode & O_READ)) return EUNSUPPORTED;
-	if(sizeof(buf) < 0 || buf == NULL || numBytes<= 0)
+	if(numBytes<= 0)
 	{ Debug("invalid pra.\n");	return EINVALID;}
 //ERROR:if((file->filePos + numBytes) > file->endPos || file->filePos > file->endPos)
 //	{ Print("no data.\n");	return ENODATA;}
-	if(file->endPos == 0 || file->filePos >= file->endPos) // Empty file
-		return ENOBLOCK;
 
 	struct FS_Buffer *blockBuf;
 	struct GOSFS_Dir_Block *dirBlock;
 	struct GOSFS_Inode *iNode;
 	struct GOSFS_Dir_Entry *dirEntry;
 	struct Mount_Point *mountPoint;
-	struct GOSFS_Superblock *gosfsSuperBlock;
 	int blockNum, blockOffset;
 	int inodeBlock, inodeOffset;
 	int readSize, readBytes;
 	int readBlock;
+	ulong_t runStart = 0, runLen = 0, count;
+	int runBlock = 0;
 	int rc;
-	char *pbuf = (char *)buf;
 	char *pblock;
 	
 	// Init
 	iNode = (struct GOSFS_Inode *)file->fsData;
 	dirEntry = &iNode->dirEntry;
 	mountPoint = file->mountPoint;
-	gosfsSuperBlock = (struct GOSFS_Superblock*)mountPoint->fsData;
 	blockBuf = NULL;
 	dirBlock = NULL;
 	blockNum = blockOffset = inodeBlock = inodeOffset = readSize = readBytes = readBlock = 0;
 	rc = 0;
 
+	// the size is shared by all opens of the file, endPos is not
+	if(file->filePos >= dirEntry->size) // Empty file, or at its end
+		return ENOBLOCK;
+	if(numBytes > dirEntry->size - file->filePos)
+		numBytes = dirEntry->size - file->filePos;
+
+	// the data of a small file is in the inode itself
+	if(dirEntry->flags & GOSFS_DIRENTRY_INLINE)
+	{
+		if(!VFS_Copy_Out(buf, 0, Inline_Data(dirEntry) + file->filePos, numBytes))
+			return EINVALID;
+		file->filePos += numBytes;
+		return numBytes;
+	}
+
 	Debug("start reading:\n");
 	while(numBytes > 0)
 	{
 		FIND_BLOCK_NUM(file->filePos, blockNum, blockOffset);
-		if(blockNum >= GOSFS_NUM_DIRECT_BLOCKS)
+		// map a whole run at once; the blocks after the first need no lookup
+		if(blockNum < runStart || blockNum >= runStart + runLen)
 		{
-			if(blockNum >= GOSFS_NUM_DIRECT_BLOCKS + GOSFS_NUM_PTRS_PER_BLOCK &&
-				blockNum < GOSFS_NUM_TOTAL_BLOCKS)
-				readBlock = Get_Second_Indirect_Block(dirEntry, blockNum-(GOSFS_NUM_DIRECT_BLOCKS + GOSFS_NUM_PTRS_PER_BLOCK));
-			else if(blockNum < (GOSFS_NUM_DIRECT_BLOCKS +GOSFS_NUM_PTRS_PER_BLOCK))
-				readBlock = Get_First_Indirect_Block(dirEntry, blockNum-GOSFS_NUM_DIRECT_BLOCKS);
-			else{
-				rc = ENOBLOCK;
-				break;
+			rc = Bmap_Run(mountPoint, iNode, blockNum, false, &runLen);
+			if(rc == ENOBLOCK)
+			{
+				// written, but not given a disk block yet; or never
+				// written at all, a hole, which reads as zeros
+				runLen = 0;
+				rc = Get_FS_Delayed_Buffer(GOSFS_CACHE(mountPoint), iNode, blockNum, false, &blockBuf);
+				if(rc < 0) blockBuf = NULL;
+				rc = 0;
+				goto copy;
 			}
+			if(rc < 0)
+				break;
+			runStart = blockNum;
+			runBlock = rc;
 		}
-		else if(blockNum >= 0 && dirEntry->blockList[blockNum] == 0)
+		readBlock = runBlock + (blockNum - runStart);
+
+		// O_DIRECT: the whole blocks of the run go straight from the disk
+		// to the caller, and the cache is left to everybody else
+		if((file->mode & O_DIRECT) && blockOffset == 0 && numBytes >= GOSFS_FS_BLOCK_SIZE)
 		{
-			rc = ENOBLOCK;
-			break;
+			count = numBytes / GOSFS_FS_BLOCK_SIZE;
+			if(count > runStart + runLen - blockNum)
+				count = runStart + runLen - blockNum;
+			rc = Direct_Transfer(mountPoint, readBlock, count, buf, readBytes, false);
+			if(rc < 0)
+				break;
+			numBytes -= count * GOSFS_FS_BLOCK_SIZE;
+			file->filePos += count * GOSFS_FS_BLOCK_SIZE;
+			readBytes += count * GOSFS_FS_BLOCK_SIZE;
+			continue;
 		}
-		else
-			readBlock = dirEntry->blockList[blockNum];
 
+		// No bitmap check, and so no superblock lock, is needed here:
+		// the open file holds a reference on the inode, and its blocks
+		// are only freed once the last reference is gone
+		// (Do_Delete refuses open files, the reclaimer waits for them).
 		Debug("readblock:%d\n", readBlock);
-		// check if the block is allocated
-		Mutex_Lock(&gosfsSuperBlock->lock);
-		rc = Is_Bit_Set(gosfsSuperBlock->gfsInstance.blockBitmapVector, readBlock - GOSFS_FIRST_DATA_BLOCK);
-		if(rc == 0)
-			return EOLDBLOCK;
-		Mutex_Unlock(&gosfsSuperBlock->lock);
-
-		// Read the block
-		rc = Get_FS_Buffer(gosfsBufferCache, readBlock, &blockBuf);
-		if(rc < 0) return rc;
-		pblock = (char *)blockBuf->data;
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), readBlock, &blockBuf);
+		if(rc < 0) break;
+copy:
+		pblock = blockBuf != NULL ? (char *)blockBuf->data : s_zeroBlock;
 		pblock += blockOffset;
 		readSize = numBytes >= (GOSFS_FS_BLOCK_SIZE-blockOffset) ? (GOSFS_FS_BLOCK_SIZE-blockOffset) : numBytes;
-		memcpy(pbuf, pblock, readSize);
+		// straight from the cached block to the caller, user space or not
+		if(!VFS_Copy_Out(buf, readBytes, pblock, readSize))
+			rc = EINVALID;
+		if(blockBuf != NULL)
+			Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+		if(rc < 0)
+			break;
 		Debug("readsize:%d\n", readSize);
 		// update relevent information
 		numBytes -= readSize;
 		//pblock += readSize;
-		pbuf += readSize;
 		file->filePos += readSize;
 		readBytes +=readSize;
-		Release_FS_Buffer(gosfsBufferCache, blockBuf);
 	}
 
 
-	if(rc == ENOBLOCK && readBytes == 0)
+	if(rc < 0 && readBytes == 0)
 		readBytes = rc;
 
-	Debug("gosfs read buf:%s\n", (char*)buf);
+	return readBytes;
+}
+
+// Readers of a file share its lock; only writers wait for each other
+static int GOSFS_Read(struct File *file, struct VFS_Buffer *buf, ulong_t numBytes)
+{
+	struct GOSFS_Inode *iNode = (struct GOSFS_Inode *)file->fsData;
+	int readBytes;
+
+	RW_Read_Lock(&iNode->lock);
+	readBytes = Do_Read(file, buf, numBytes);
+	RW_Read_Unlock(&iNode->lock);
+
 	return readBytes;
 }
 
@@ -689,12 +3209,14 @@ static int GOSFS_Read(struct File *file, void *buf, ulong_t numBytes)
 // so we won't allocate more than one block each time we need a block
 // we decrease the total bytes after write one block of bytes 
 // if the value left still above zero, we need to allocate a new block
+// The bytes come from buf, offset bytes into it. Fewer than numBytes are
+// written when the journal handle runs out of room (see GOSFS_Write).
 //static int wc = 0;
-static int GOSFS_Write(struct File *file, void *buf, ulong_t numBytes)
+static int Do_Write(struct File *file, struct VFS_Buffer *buf, ulong_t offset, ulong_t numBytes)
 {
 	// First do a little check
-	Debug("start of GOSFS_Write:%s\n", (char*)buf);
-	if(sizeof(buf) < 0 || buf == NULL || numBytes<= 0)
+	Debug("start of GOSFS_Write\n");
+	if(numBytes<= 0)
 		return EINVALID;
 	if(!(file->mode & O_WRITE))
 	{
@@ -714,15 +3236,14 @@ static int GOSFS_Write(struct File *file, void *buf, ulong_t numBytes)
 	*/
 
 	struct FS_Buffer *blockBuf;
-	struct GOSFS_Dir_Block *dirBlock;
 	struct GOSFS_Inode *iNode;
 	struct GOSFS_Dir_Entry *dirEntry;
 	struct Mount_Point *mountPoint;
 	int blockNum, blockOffset, writeBlock;
-	int inodeBlock, inodeOffset;
 	int writeSize, writeBytes;
+	ulong_t runStart = 0, runLen = 0, count;
+	int runBlock = 0;
 	int rc;
-	char *pbuf = (char *)buf;
 	char *pblock;
 
 	// Init
@@ -730,89 +3251,378 @@ static int GOSFS_Write(struct File *file, void *buf, ulong_t numBytes)
 	dirEntry = &iNode->dirEntry;
 	mountPoint = file->mountPoint;
 	blockBuf = NULL;
-	dirBlock = NULL;
-	blockNum = blockOffset = writeBlock = inodeBlock = inodeOffset = writeSize = writeBytes = 0;
+	blockNum = blockOffset = writeBlock = writeSize = writeBytes = 0;
 	rc = 0;
+
+	// a small file keeps its data in the inode until it outgrows it
+	if(dirEntry->flags & GOSFS_DIRENTRY_INLINE)
+	{
+		if(file->filePos + numBytes <= GOSFS_INLINE_DATA_MAX)
+		{
+			if(!VFS_Copy_In(Inline_Data(dirEntry) + file->filePos, buf, offset, numBytes))
+				return EINVALID;
+			file->filePos += numBytes;
+			if(file->filePos > dirEntry->size)
+				dirEntry->size = file->filePos;
+			file->endPos = dirEntry->size;
+			iNode->dirty = true;
+			return numBytes;
+		}
+		rc = Inline_Migrate(mountPoint, iNode, (file->mode & O_SYNC) != 0);
+		if(rc < 0) return rc;
+	}
 	
 	Debug("start writing:\n");
 	while(numBytes > 0)
 	{
 		FIND_BLOCK_NUM(file->filePos, blockNum, blockOffset);
 		Debug("blockNum:%d, blockOff:%d\n", blockNum, blockOffset);
-		// allocate the block
-		if(blockNum >= GOSFS_NUM_DIRECT_BLOCKS)
+		// map the whole run the block belongs to; a block the file
+		// doesn't have yet is only given one later (see Flush_Delayed),
+		// except for O_SYNC and O_DIRECT data, unless it is waiting already;
+		// mapping may take new blocks, and past the journal handle's room
+		// the rest waits for another
+		if(blockNum < runStart || blockNum >= runStart + runLen)
 		{
-			if(blockNum >= GOSFS_NUM_DIRECT_BLOCKS + GOSFS_NUM_PTRS_PER_BLOCK &&
-				blockNum < GOSFS_NUM_TOTAL_BLOCKS)
-				writeBlock = Allocate_Second_Indirect_Block(mountPoint, iNode, blockNum-(GOSFS_NUM_DIRECT_BLOCKS + GOSFS_NUM_PTRS_PER_BLOCK));
-			else if(blockNum < (GOSFS_NUM_DIRECT_BLOCKS +GOSFS_NUM_PTRS_PER_BLOCK))
-				writeBlock = Allocate_First_Indirect_Block(mountPoint, iNode, blockNum-GOSFS_NUM_DIRECT_BLOCKS);
-			else
-				return ENOBLOCK;
+			if(writeBytes > 0 && Journal_Room(mountPoint) < GOSFS_JOURNAL_RUN_CREDITS + 1)
+				break;
+			rc = Bmap_Run(mountPoint, iNode, blockNum, false, &runLen);
+			if(rc == ENOBLOCK
+				&& ((dirEntry->flags & GOSFS_DIRENTRY_EXTENTS) || blockNum < GOSFS_NUM_TOTAL_BLOCKS))
+			{
+				runLen = 0;
+				if(file->mode & (O_SYNC | O_DIRECT))
+					rc = Get_FS_Delayed_Buffer(GOSFS_CACHE(mountPoint), iNode, blockNum, false, &blockBuf);
+				else
+					rc = Get_Delayed_Block(mountPoint, iNode, blockNum, &blockBuf);
+				if(rc >= 0)
+					goto copy;
+				// nothing waiting for it, or too much: allocate it now;
+				// O_DIRECT writes a whole block over what it had
+				if(rc == ENOTFOUND || rc == ENOMEM)
+				{
+					if((file->mode & O_DIRECT) && blockOffset == 0 && numBytes >= GOSFS_FS_BLOCK_SIZE)
+					{
+						rc = Bmap_Overwrite(mountPoint, iNode, blockNum);
+						runLen = 1;
+					}
+					else
+						rc = Bmap_Run(mountPoint, iNode, blockNum, true, &runLen);
+				}
+			}
+			if(rc < 0)
+			{
+				if(writeBytes == 0) return rc;
+				break;
+			}
+			runStart = blockNum;
+			runBlock = rc;
 		}
-		else if(blockNum >= 0 && dirEntry->blockList[blockNum] == 0)
+		writeBlock = runBlock + (blockNum - runStart);
+
+		// O_DIRECT: the whole blocks of the run go straight from the caller
+		// to the disk; a cached copy of any of them is dropped
+		if((file->mode & O_DIRECT) && blockOffset == 0 && numBytes >= GOSFS_FS_BLOCK_SIZE)
 		{
-			writeBlock = Allocate_Block(mountPoint, &dirEntry->blockList[blockNum]);
-			iNode->dirty = true;
-			Debug("direct block.\n");
+			count = numBytes / GOSFS_FS_BLOCK_SIZE;
+			if(count > runStart + runLen - blockNum)
+				count = runStart + runLen - blockNum;
+			rc = Direct_Transfer(mountPoint, writeBlock, count, buf, offset + writeBytes, true);
+			if(rc < 0) { if(writeBytes == 0) return rc; break; }
+			writeSize = count * GOSFS_FS_BLOCK_SIZE;
+			goto advance;
 		}
-		else
-			writeBlock = dirEntry->blockList[blockNum];
-		
 
 		Debug("writeBlock:%d\n", writeBlock);
 		//if(writeBlock == 109) wc++;
-		// update relevent structures: GOSFS_Inode, GOSFS_Dir_Entry on disk
-		if(iNode->dirty == true)
-		{
-			FIND_INODEBLOCK_AND_INODEOFFSET(iNode->inodeNumber, inodeBlock, inodeOffset);
-			rc = Get_FS_Buffer(gosfsBufferCache, inodeBlock, &blockBuf);
-			if (rc < 0) return rc;
-			dirBlock = (struct GOSFS_Dir_Block *)blockBuf->data;
-			memcpy(&dirBlock->entryTable[inodeOffset], dirEntry, sizeof(struct GOSFS_Dir_Entry));
-			Modify_FS_Buffer(gosfsBufferCache, blockBuf);
-			Sync_FS_Buffer(gosfsBufferCache, blockBuf);
-			Release_FS_Buffer(gosfsBufferCache, blockBuf);
+		// a changed GOSFS_Dir_Entry is only marked dirty here; it reaches the
+		// inode block on sync or when it leaves the inode cache
 
-			iNode->dirty = false;
-		}
-		
+		// get the target block and write
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), writeBlock, &blockBuf);
+		if (rc < 0) { if(writeBytes == 0) return rc; break; }
+copy:
 		// Write buf to block
 		writeSize = numBytes >= (GOSFS_FS_BLOCK_SIZE-blockOffset) ? (GOSFS_FS_BLOCK_SIZE-blockOffset) : numBytes;
-		// get the target block and write
-		rc = Get_FS_Buffer(gosfsBufferCache, writeBlock, &blockBuf);
-		if (rc < 0) return rc;
 		pblock = (char*)blockBuf->data;
 		pblock += blockOffset;
 		Debug("copy to block:%d\n", writeBlock);
-		memcpy(pblock, pbuf, writeSize);
+		// straight from the caller to the cached block, user space or not
+		if(!VFS_Copy_In(pblock, buf, offset + writeBytes, writeSize))
+		{
+			Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+			if(writeBytes == 0) return EINVALID;
+			break;
+		}
 
+		Modify_FS_Owner_Buffer(GOSFS_CACHE(mountPoint), blockBuf, iNode); // just modify ,but don't have to write back immediately
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+advance:
 		// update relevent data
 		numBytes -= writeSize;
 		writeBytes += writeSize;
 		file->filePos += writeSize;
-		if(file->filePos > file->endPos) file->endPos = file->filePos;
-		pbuf += writeSize;
-		Modify_FS_Buffer(gosfsBufferCache, blockBuf); // just modify ,but don't have to write back immediately
-		Release_FS_Buffer(gosfsBufferCache, blockBuf);
+		if(file->filePos > dirEntry->size)
+		{
+			dirEntry->size = file->filePos;
+			iNode->dirty = true;
+		}
+		file->endPos = dirEntry->size;
 	}
 
-	// update the size of the file
-	dirEntry->size += writeBytes;
-	FIND_INODEBLOCK_AND_INODEOFFSET(iNode->inodeNumber, inodeBlock, inodeOffset);
-	rc = Get_FS_Buffer(gosfsBufferCache, inodeBlock, &blockBuf);
-	if (rc < 0) return rc;
-	dirBlock = (struct GOSFS_Dir_Block *)blockBuf->data;
-	memcpy(&dirBlock->entryTable[inodeOffset], dirEntry, sizeof(struct GOSFS_Dir_Entry));
-	Modify_FS_Buffer(gosfsBufferCache, blockBuf);
-	Sync_FS_Buffer(gosfsBufferCache, blockBuf);
-	Release_FS_Buffer(gosfsBufferCache, blockBuf);
+	return writeBytes;
+}
+
+// Write out the cached data blocks of iNode: GOSFS_Write marks each
+// buffer it changes as the file's, so one walk over the cache finds them
+static int Sync_File_Data(struct Mount_Point *mountPoint, struct GOSFS_Inode *iNode)
+{
+	// the data of an inline file is in its inode
+	if(iNode->dirEntry.flags & GOSFS_DIRENTRY_INLINE)
+		return 0;
+	return Sync_FS_Owner_Buffers(GOSFS_CACHE(mountPoint), iNode);
+}
+
+// Without a journal: write out the blocks that map the data of iNode
+// and its inode block, all in one walk over the cache
+static int Sync_File_Map(struct GOSFS_Inode *iNode)
+{
+	struct Mount_Point *mountPoint = iNode->mountPoint;
+	struct GOSFS_Dir_Entry *dirEntry = &iNode->dirEntry;
+	struct GOSFS_Extent_Root *root;
+	struct GOSFS_Indirect_Block *indBlock;
+	struct FS_Buffer *blockBuf;
+	ulong_t *blocks, count = 0;
+	int i, rc = 0;
+
+	// the double indirect block and all it points to, the first
+	// indirect block and the inode block at most
+	blocks = (ulong_t *)Malloc((GOSFS_NUM_PTRS_PER_BLOCK + 3) * sizeof(ulong_t));
+	if(blocks == NULL) return ENOMEM;
+
+	if(dirEntry->flags & GOSFS_DIRENTRY_EXTENTS)
+	{
+		root = Extent_Root(iNode);
+		for(i = 0; root->hdr.depth > 0 && i < root->hdr.entries; i++)
+			blocks[count++] = root->u.index[i].leaf;
+	}
+	else if(!(dirEntry->flags & GOSFS_DIRENTRY_INLINE))
+	{
+		if(dirEntry->blockList[8] > 0)
+			blocks[count++] = dirEntry->blockList[8];
+		if(dirEntry->blockList[9] > 0)
+		{
+			rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), dirEntry->blockList[9], &blockBuf);
+			if(rc < 0) goto done;
+			indBlock = (struct GOSFS_Indirect_Block *)blockBuf->data;
+			for(i = 0; i < GOSFS_NUM_PTRS_PER_BLOCK; i++)
+				if(indBlock->blockNumber[i] > 0)
+					blocks[count++] = indBlock->blockNumber[i];
+			Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+			blocks[count++] = dirEntry->blockList[9];
+		}
+	}
+
+	// the block the inode is in, as in FIND_INODEBLOCK_AND_INODEOFFSET
+	blocks[count++] = iNode->inodeNumber / GOSFS_DIR_ENTRIES_PER_BLOCK + GOSFS_GEOMETRY(mountPoint).inodeTableStart;
+	rc = Sync_FS_Block_List(GOSFS_CACHE(mountPoint), blocks, count);
+
+done:
+	Free(blocks);
+	return rc;
+}
+
+/*
+ * Put the data and the inode of a file on disk.
+ */
+// Only this file's blocks are written, not the whole cache. The metadata
+// they depend on, its inode and mapping blocks and the bitmaps, goes out
+// with a journal commit, which holds nothing but metadata, or without
+// the journal is written in place, the bitmap blocks that changed. GOSFS keeps no
+// times, so every field of an inode is needed to read the data back:
+// dataOnly makes no difference here.
+static int GOSFS_Sync_File(struct File *file, bool dataOnly)
+{
+	struct Mount_Point *mountPoint = file->mountPoint;
+	struct GOSFS_Inode *iNode = (struct GOSFS_Inode *)file->fsData;
+	struct GOSFS_Superblock *gosfsSuperBlock = GOSFS_SB(mountPoint);
+	struct GOSFS_Instance *geo = &gosfsSuperBlock->gfsInstance;
+	int rc;
+
+	// give the delayed data its disk blocks, and the inode block the inode
+	do
+	{
+		Journal_Start(mountPoint, GOSFS_JOURNAL_OP_CREDITS);
+		RW_Write_Lock(&iNode->lock);
+		rc = Flush_Delayed(mountPoint, iNode);
+		if(rc == 0 && iNode->dirty)
+			rc = Write_Inode(iNode, false);
+		RW_Write_Unlock(&iNode->lock);
+		Journal_Stop(mountPoint);
+	} while(rc > 0);
+	if(rc < 0) return rc;
+
+	// the data goes first, so no committed mapping names unwritten blocks
+	RW_Read_Lock(&iNode->lock);
+	rc = Sync_File_Data(mountPoint, iNode);
+	if(rc == 0 && !gosfsSuperBlock->journal.enabled)
+		rc = Sync_File_Map(iNode);
+	RW_Read_Unlock(&iNode->lock);
+	if(rc < 0) return rc;
+
+	if(gosfsSuperBlock->journal.enabled)
+		return Journal_Commit(mountPoint);
+
+	// only dirty bitmap blocks are written; allocation may go on meanwhile,
+	// the bits this file needs are set already
+	rc = Sync_FS_Buffers(GOSFS_CACHE(mountPoint), geo->inodeBitmapStart, geo->inodeBitmapBlocks);
+	if(rc == 0)
+		rc = Sync_FS_Buffers(GOSFS_CACHE(mountPoint), geo->blockBitmapStart, geo->blockBitmapBlocks);
+	return rc;
+}
+
+static int GOSFS_Write(struct File *file, struct VFS_Buffer *buf, ulong_t numBytes)
+{
+	struct Mount_Point *mountPoint = file->mountPoint;
+	struct GOSFS_Inode *iNode = (struct GOSFS_Inode *)file->fsData;
+	int writeBytes = 0, rc;
+
+	// the journal handle comes before the inode lock; a long write
+	// takes as many handles, one after the other, as it needs room
+	do
+	{
+		Journal_Start(mountPoint, GOSFS_JOURNAL_OP_CREDITS);
+		RW_Write_Lock(&iNode->lock);
+		rc = Do_Write(file, buf, writeBytes, numBytes - writeBytes);
+		RW_Write_Unlock(&iNode->lock);
+		Journal_Stop(mountPoint);
+		if(rc > 0)
+			writeBytes += rc;
+	} while(rc > 0 && (ulong_t)writeBytes < numBytes);
+	if(writeBytes == 0)
+		return rc;
+
+	// O_SYNC: the data and the inode are on disk before we return
+	if((file->mode & O_SYNC) && writeBytes > 0)
+	{
+		rc = GOSFS_Sync_File(file, false);
+		if(rc < 0) return rc;
+	}
 
-	// Check the write content
-	
 	return writeBytes;
 }
 
+// Copy up to len bytes from src to dst, but not past the end of the
+// source block src is in; both inodes are locked. The data goes from the
+// source's cached block straight into the target's. Returns the number
+// of bytes copied, 0 at the end of src.
+static int Copy_Block(struct File *src, struct File *dst, ulong_t len)
+{
+	struct Mount_Point *mountPoint = src->mountPoint;
+	struct GOSFS_Inode *srcNode = (struct GOSFS_Inode *)src->fsData;
+	struct GOSFS_Inode *dstNode = (struct GOSFS_Inode *)dst->fsData;
+	struct GOSFS_Dir_Entry *dirEntry = &srcNode->dirEntry;
+	struct FS_Buffer *blockBuf = NULL;
+	struct VFS_Buffer vbuf = { false, 0, 0, 0, 0 };
+	int blockNum, blockOffset, rc;
+
+	if(src->filePos >= dirEntry->size)
+		return 0;
+	if(len > dirEntry->size - src->filePos)
+		len = dirEntry->size - src->filePos;
+
+	if(dirEntry->flags & GOSFS_DIRENTRY_INLINE)
+		vbuf.kernel = Inline_Data(dirEntry) + src->filePos;
+	else
+	{
+		FIND_BLOCK_NUM(src->filePos, blockNum, blockOffset);
+		if(len > GOSFS_FS_BLOCK_SIZE - blockOffset)
+			len = GOSFS_FS_BLOCK_SIZE - blockOffset;
+
+		rc = Bmap_Run(mountPoint, srcNode, blockNum, false, 0);
+		if(rc == ENOBLOCK)
+		{
+			// not given a disk block yet, or a hole
+			if(Get_FS_Delayed_Buffer(GOSFS_CACHE(mountPoint), srcNode, blockNum, false, &blockBuf) < 0)
+				blockBuf = NULL;
+		}
+		else if(rc < 0)
+			return rc;
+		else
+		{
+			rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), rc, &blockBuf);
+			if(rc < 0) return rc;
+		}
+
+		// a whole block of hole that lands past the end of dst
+		// stays a hole there: nothing is written, only the size moves
+		if(blockBuf == NULL && len == GOSFS_FS_BLOCK_SIZE && dst->filePos % GOSFS_FS_BLOCK_SIZE == 0
+			&& dst->filePos >= dstNode->dirEntry.size && !(dstNode->dirEntry.flags & GOSFS_DIRENTRY_INLINE))
+		{
+			src->filePos += len;
+			dst->filePos += len;
+			dstNode->dirEntry.size = dst->filePos;
+			dstNode->dirty = true;
+			dst->endPos = dstNode->dirEntry.size;
+			return len;
+		}
+		vbuf.kernel = blockBuf != NULL ? (char *)blockBuf->data + blockOffset : s_zeroBlock;
+	}
+
+	rc = Do_Write(dst, &vbuf, 0, len);
+	if(blockBuf != NULL)
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+	if(rc > 0)
+		src->filePos += rc;
+	return rc;
+}
+
+/*
+ * Copy data from the current position of one file to that of another.
+ */
+// Both inodes are locked for one source block at a time, so readers
+// and writers of either file aren't shut out for the whole copy.
+static int GOSFS_Copy_Range(struct File *src, struct File *dst, ulong_t len)
+{
+	struct Mount_Point *mountPoint = src->mountPoint;
+	struct GOSFS_Inode *srcNode = (struct GOSFS_Inode *)src->fsData;
+	struct GOSFS_Inode *dstNode = (struct GOSFS_Inode *)dst->fsData;
+	bool srcFirst = srcNode->inodeNumber < dstNode->inodeNumber;
+	int copied = 0, rc = 0;
+
+	// one inode can't be locked both ways; the VFS copies through a buffer
+	if(srcNode == dstNode)
+		return EUNSUPPORTED;
+	if(!(src->mode & O_READ) || !(dst->mode & O_WRITE))
+		return EUNSUPPORTED;
+
+	while(len > 0)
+	{
+		Journal_Start(mountPoint, GOSFS_JOURNAL_OP_CREDITS);
+		if(srcFirst)
+			RW_Read_Lock(&srcNode->lock);
+		RW_Write_Lock(&dstNode->lock);
+		if(!srcFirst)
+			RW_Read_Lock(&srcNode->lock);
+		rc = Copy_Block(src, dst, len);
+		RW_Read_Unlock(&srcNode->lock);
+		RW_Write_Unlock(&dstNode->lock);
+		Journal_Stop(mountPoint);
+		if(rc <= 0)
+			break;
+		copied += rc;
+		len -= rc;
+	}
+
+	if((dst->mode & O_SYNC) && copied > 0)
+	{
+		rc = GOSFS_Sync_File(dst, false);
+		if(rc < 0) return rc;
+	}
+
+	return (copied == 0 && rc < 0) ? rc : copied;
+}
+
 /*
  * Seek to a position in file.
  */
@@ -830,19 +3640,13 @@ static int GOSFS_Seek(struct File *file, ulong_t pos)
 /*
  * Close a file.
  */
+// Every open has a File of its own; closing it drops that File's
+// reference to the shared in-core inode
 static int GOSFS_Close(struct File *file)
 {
-	// i don't know if there is any difference at present
-	struct GOSFS_Inode *iNode = NULL;
-	struct File *vNode = NULL;
-	int i = 0;
-	iNode = (struct GOSFS_Inode *)file->fsData;
-	if(iNode->inodeNumber == GOSFS_ROOT_INODE_NUM)
-	{	
-		Debug("root dir.\n");
-		file->filePos = 0;	
-		return EUNSUPPORTED;
-	}
+	struct Mount_Point *mountPoint = file->mountPoint;
+	struct GOSFS_Inode *iNode = (struct GOSFS_Inode *)file->fsData;
+	int i;
 
 	if(g_currentThread->userContext != 0)
 	{
@@ -850,12 +3654,6 @@ static int GOSFS_Close(struct File *file)
 		{
 			if(g_currentThread->userContext->fileList[i] == file)
 			{
-				if(file == 0) { i = ENOTFOUND; break;}
-					
-				Print("	Close opened file.\n");
-				file->filePos = 0;// clear file pos
-				iNode = (struct GOSFS_Inode *)file->fsData;
-				iNode->icount--;
 				g_currentThread->userContext->fileList[i] = 0;
 				Debug("close file rc:%d\n", g_currentThread->userContext->fileCount);
 				g_currentThread->userContext->fileCount--;
@@ -863,26 +3661,25 @@ static int GOSFS_Close(struct File *file)
 			}
 		}
 
-		if(i == USER_MAX_FILES) { i = ENOTFOUND; }
+		if(i == USER_MAX_FILES)
+			return ENOTFOUND;
 	}
-	else if(g_currentThread->userContext == 0){ // kernel thread
-		vNode = Get_Front_Of_VNode_List(&vnodeList);
-		while(vNode != 0)
-		{
-			if(vNode == file)
-			{
-				iNode = (struct GOSFS_Inode *)file->fsData;
-				if(iNode->icount > 0) iNode->icount--;
-				vNode->filePos = 0;
-				Debug("	Close opened file.\n");
-				break;
-			}
-			vNode = Get_Next_In_VNode_List(vNode);
-		}
+
+	Debug("	Close opened file.\n");
+	Journal_Start(mountPoint, GOSFS_JOURNAL_OP_CREDITS);
+	RW_Write_Lock(&iNode->lock);
+	if((file->mode & O_WRITE) && --iNode->writers == 0)
+	{
+		Prealloc_Discard(mountPoint, iNode);
+		if(iNode->dirty)
+			Write_Inode(iNode, false);
 	}
-	
-	Debug("	In close file pos:%d\n", (int)file->filePos);
-	return i;
+	RW_Write_Unlock(&iNode->lock);
+	Iput(iNode);
+	Journal_Stop(mountPoint);
+	Free(file);
+
+	return 0;
 }
 
 
@@ -893,6 +3690,9 @@ static int GOSFS_Close(struct File *file)
     &GOSFS_Seek,
     &GOSFS_Close,
     0, /* Read_Entry */
+    0, /* Read_Entries */
+    &GOSFS_Copy_Range,
+    &GOSFS_Sync_File,
 };
 
 /*
@@ -906,19 +3706,86 @@ static int GOSFS_FStat_Directory(struct File *dir, struct VFS_File_Stat *stat)
 	if(!(iNode->dirEntry.flags & GOSFS_DIRENTRY_ISDIRECTORY))
 		return ENOTDIR;
 
-	stat->isDirectory = 1;
-	stat->size = iNode->dirEntry.size;
+	stat->isDirectory = 1;
+	stat->size = iNode->dirEntry.size;
+
+	return 0;
+}
+
+/*
+ * Directory Close operation.
+ */
+static int GOSFS_Close_Directory(struct File *dir)
+{
+	// struct GOSFS_Inode *iNode, *dirNode;
+	return GOSFS_Close(dir);
+}
+
+// Read_Entry for a hashed directory.
+// filePos is (leaf logical block << 16) | byte offset of the next record;
+// leaves are visited in block order, not hash order, so each is read once.
+static int Hdir_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
+{
+	struct Mount_Point *mountPoint = dir->mountPoint;
+	struct GOSFS_Inode *iNode = (struct GOSFS_Inode *)dir->fsData;
+	struct GOSFS_Inode *child;
+	struct FS_Buffer *buf;
+	struct GOSFS_Hdir_Leaf *leaf;
+	struct GOSFS_Hdir_Record *rec;
+	ulong_t lblk = dir->filePos >> 16;
+	ulong_t off = dir->filePos & 0xffff;
+	ulong_t numBlocks, inodeNum = 0;
+	int rc;
+
+	if (iNode->dirEntry.blockList[0] == 0)
+		return VFS_NO_MORE_DIR_ENTRIES; // never had an entry
+	if (lblk == 0)
+	{
+		lblk = 1;
+		off = 0;
+	}
+
+	rc = Bmap(mountPoint, iNode, 0, false);
+	if (rc < 0) return rc;
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), rc, &buf);
+	if (rc < 0) return rc;
+	numBlocks = ((struct GOSFS_Hdir_Header *)buf->data)->numBlocks;
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), buf);
+
+	while (lblk < numBlocks && inodeNum == 0)
+	{
+		rc = Bmap(mountPoint, iNode, lblk, false);
+		if (rc < 0) return rc;
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), rc, &buf);
+		if (rc < 0) return rc;
+		leaf = (struct GOSFS_Hdir_Leaf *)buf->data;
+		if (off < leaf->used)
+		{
+			rec = (struct GOSFS_Hdir_Record *)(leaf->records + off);
+			strcpy(entry->name, rec->name);
+			inodeNum = rec->inodeNum;
+			off += rec->recLen;
+		}
+		else
+		{
+			lblk++;
+			off = 0;
+		}
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), buf);
+	}
+	dir->filePos = (lblk << 16) | off;
+
+	if (inodeNum == 0)
+		return VFS_NO_MORE_DIR_ENTRIES;
 
-	return 0;
-}
+	rc = Iget(mountPoint, inodeNum, &child);
+	if (rc < 0) return rc;
+	entry->stats.isDirectory = (child->dirEntry.flags & GOSFS_DIRENTRY_ISDIRECTORY) ? true : false;
+	entry->stats.isSetuid = (child->dirEntry.flags & GOSFS_DIRENTRY_SETUID) ? true : false;
+	entry->stats.size = child->dirEntry.size;
+	Iput(child);
 
-/*
- * Directory Close operation.
- */
-static int GOSFS_Close_Directory(struct File *dir)
-{
-	// struct GOSFS_Inode *iNode, *dirNode;
-	return GOSFS_Close(dir);
+	return 0;
 }
 
 /*
@@ -926,12 +3793,17 @@ static int GOSFS_Close_Directory(struct File *dir)
  */
 // The entry to be read is defined by dir->filePos
 // so after we read one entry, we have to increase the filePos by one
-static int GOSFS_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
+static int Do_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
 {
-	struct GOSFS_Inode *iNode = NULL;
+	struct Mount_Point *mountPoint = dir->mountPoint;
+	struct GOSFS_Inode *iNode = NULL, *child = NULL;
 	struct GOSFS_Dir_Entry *dirEntry = NULL;
 	int rc = 0;
 	int i = 0;
+
+	iNode = (struct GOSFS_Inode *)dir->fsData;
+	if(iNode->dirEntry.flags & GOSFS_DIRENTRY_HASHED)
+		return Hdir_Read_Entry(dir, entry);
 	if(dir->filePos == GOSFS_NUM_DIR_ENTRY) // Read beyond max number of entries
 	{
 		rc = 1; //no more entry to read
@@ -948,11 +3820,12 @@ static int GOSFS_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
 			if(iNode->dirEntry.blockList[i] != 0)
 			{ dir->filePos = i; break; }
 		}
-	if(i == GOSFS_NUM_DIR_ENTRY)
-	{ rc = ENOTFOUND; goto failed; }
+	if(i == GOSFS_NUM_DIR_ENTRY) // an empty directory
+	{ rc = VFS_NO_MORE_DIR_ENTRIES; goto failed; }
 	
-	rc = Get_Exist_Inode(iNode->dirEntry.blockList[dir->filePos], &dirEntry);
+	rc = Iget(mountPoint, iNode->dirEntry.blockList[dir->filePos], &child);
 	if(rc < 0) { Print("failed reading entry.\n"); goto failed;}
+	dirEntry = &child->dirEntry;
 	strcpy(entry->name, dirEntry->filename);
 	Debug("entry name:%s, entry:%x\n", entry->name, (int)dirEntry);
 	Debug("direntry:no.%d, %s\n", (int)iNode->dirEntry.blockList[dir->filePos], dirEntry->filename);
@@ -977,12 +3850,53 @@ static int GOSFS_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
 
 
 failed:
-	if(dirEntry != NULL)
-		Free(dirEntry);
+	if(child != NULL)
+		Iput(child);
+
+	return rc;
+}
+
+// Any number of readers of a directory may list it at once
+static int GOSFS_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
+{
+	struct GOSFS_Inode *iNode = (struct GOSFS_Inode *)dir->fsData;
+	int rc;
+
+	RW_Read_Lock(&iNode->lock);
+	rc = Do_Read_Entry(dir, entry);
+	RW_Read_Unlock(&iNode->lock);
 
 	return rc;
 }
 
+// Read up to maxEntries entries into buf, taking the lock only once
+static int GOSFS_Read_Entries(struct File *dir, struct VFS_Buffer *buf, int maxEntries)
+{
+	struct GOSFS_Inode *iNode = (struct GOSFS_Inode *)dir->fsData;
+	struct VFS_Dir_Entry *entry;
+	int n, rc = 0;
+
+	entry = (struct VFS_Dir_Entry *)Malloc(sizeof(struct VFS_Dir_Entry));
+	if(entry == NULL) return ENOMEM;
+
+	RW_Read_Lock(&iNode->lock);
+	for(n = 0; n < maxEntries; n++)
+	{
+		memset(entry, '\0', sizeof(struct VFS_Dir_Entry));
+		rc = Do_Read_Entry(dir, entry);
+		if(rc != 0) break;
+		if(!VFS_Copy_Out(buf, n * sizeof(struct VFS_Dir_Entry), entry, sizeof(struct VFS_Dir_Entry)))
+		{
+			rc = EINVALID;
+			break;
+		}
+	}
+	RW_Read_Unlock(&iNode->lock);
+	Free(entry);
+
+	return (n == 0 && rc < 0) ? rc : n;
+}
+
 /*static*/ struct File_Ops s_gosfsDirOps = {
     &GOSFS_FStat_Directory,
     0, /* Read */
@@ -990,6 +3904,9 @@ failed:
     &GOSFS_Seek, //ERROR;fixed
     &GOSFS_Close_Directory,
     &GOSFS_Read_Entry,
+    &GOSFS_Read_Entries,
+    0, /* Copy_Range */
+    0, /* Sync */
 };
 
 // Create a normal file
@@ -1004,219 +3921,116 @@ static int GOSFS_Create_File(struct Mount_Point *mountPoint, const char *path, i
 	}
 
 	Print("gosfs create file:\n");
-	struct GOSFS_Dir_Entry * tempEntry, *newEntry, *wasteEntry;
-	struct GOSFS_Inode * iNode = NULL;
-	struct FS_Buffer *nodeBuf;
-	struct GOSFS_Dir_Block *dirBlock;
-	struct File *vNode, *fileNode = NULL;
-	const char *suffix;
-	char * pPath;
+	struct GOSFS_Superblock *gosfsSuperBlock = (struct GOSFS_Superblock *)mountPoint->fsData;
+	struct GOSFS_Inode * fatherNode = NULL, * iNode = NULL;
+	struct File *vNode = NULL;
 	char prefix[GOSFS_FILENAME_MAX + 1];
-	void* tempPath;
-	bool found = false;
-	bool packPath = false;
-	int inodeBlock, inodeOffset, inodeNum, fDirNum;
-	int i, rc;
-
-	tempEntry = newEntry = wasteEntry = NULL;
-	inodeBlock = inodeOffset = inodeNum = fDirNum = i = rc = 0; //all init as zero, or there will be warnings
-	tempPath = Malloc(strlen(path));
-	if (tempPath == NULL)
-		return ENOMEM;
-	pPath = tempPath;
-	strcpy(pPath, path);
-
-	rc = Get_Exist_Inode(GOSFS_ROOT_INODE_NUM, &tempEntry);
-	fDirNum = GOSFS_ROOT_INODE_NUM; // ERROR: default is root dir
+	ulong_t fDirNum, childNum, flags;
+	int inodeNum, rc;
 
 	//--------------------------------------------
 	// First find father dir
-	while((packPath = Unpack_Path(pPath, prefix, &suffix)) == true)
-	{
-		if(strcmp(suffix, "/") == 0)
-		{
-			Debug(" suffix err.\n");
-			break;
-		}
-		if (tempEntry->size == 0 || !(tempEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY)) // empty dir
-		{
-			Debug("	size:%d\n", (int)tempEntry->size);
-			Debug("	flags:%d\n", (int)tempEntry);
-			Print("	Empty Dir or No Dir.\n");
-			rc = ENOTFOUND;
-			goto failed;
-		}
-		// start searching
-		for (i = 0; i < tempEntry->size; i++)
-		{
-			Get_Exist_Inode(tempEntry->blockList[i], &newEntry);
-			if(strcmp(prefix, newEntry->filename) == 0)
-			{
-				fDirNum = tempEntry->blockList[i];
-				Free(tempEntry);
-				tempEntry = newEntry;
-				found = true;
-				break;
-			}
-			// not found in this round
-			Free(newEntry);
-		}
-		
-		// check if we found target dir
-		if(found)
-			found = false;
-		else
-		{
-			Print("	not in this directory:%s", tempEntry->filename);
-			rc = ENOTFOUND;
-			goto failed;
-		}
-		strcpy(pPath, suffix); 
-	}
-	// now we've got the father dir;
-	//if(packPath == false)
-		
-
-	Debug("	father dir:%s\n", tempEntry->filename);
+	rc = Resolve_Path(mountPoint, path, prefix, &fDirNum, 0);
+	if (rc < 0) goto failed;
+	rc = Iget(mountPoint, fDirNum, &fatherNode);
+	if (rc < 0) goto failed;
+	// hold the father dir from the lookup to the new entry
+	RW_Write_Lock(&fatherNode->lock);
+
+	Debug("	father dir:%s\n", fatherNode->dirEntry.filename);
 	Debug("	target file:%s\n", prefix);
-	// check if we can afford a new file
-	// check if the user can afford another opened file
-	if(tempEntry->size >= USER_MAX_FILES)
-	{
-		rc = EMFILE;
-		goto failed;
-	}
-
-
 
 	//----------------------------------
 	// make sure it has a unique name
-	if(tempEntry->size > 0)
-	for (i = 0; i < tempEntry->size; i++)
+	rc = Dir_Lookup(mountPoint, fatherNode, prefix, &childNum, 0);
+	if (rc == 0)
 	{
-		Get_Exist_Inode(tempEntry->blockList[i], &newEntry);
-		if(strcmp(prefix, newEntry->filename) == 0)
-		{
-			//fDirNum = tempEntry->blockList[i];
-			//Free(tempEntry);
-			//tempEntry = newEntry;
-			found = true;
-			break;
-		}
-		// not found in this round
-		Free(newEntry);
+		rc = EEXIST;
+		goto failed;
 	}
+	else if (rc != ENOTFOUND)
+		goto failed;
 
-	if(found == true)
+	// check if the father dir can afford a new entry
+	if (!Dir_Has_Room(&fatherNode->dirEntry))
 	{
-		rc = EEXIST;
-		Free(newEntry);
+		rc = EMFILE;
 		goto failed;
 	}
 
 	//--------------------------------------
 	// start creating file-GOSFS_Dir_Entry
-	inodeNum = Allocate_Inode(mountPoint, &wasteEntry, prefix, 0);
+	flags = 0;
+	if(gosfsSuperBlock->gfsInstance.features & GOSFS_FEATURE_EXTENTS)
+		flags |= GOSFS_DIRENTRY_EXTENTS;
+	if(gosfsSuperBlock->gfsInstance.features & GOSFS_FEATURE_INLINE_DATA)
+		flags |= GOSFS_DIRENTRY_INLINE;
+	inodeNum = Allocate_Inode(mountPoint, prefix, flags);
 	if(inodeNum < 0) //not successfully allocated
 	{
 		rc = inodeNum;
-		Free(wasteEntry);
 		goto failed;
 	}
 	Print("	inodeNum:%d\n", inodeNum);
 
-	// create the in-mem structures-GOSFS_Inode
-	iNode = Init_GOSFS_Inode(wasteEntry, inodeNum);
-	if (iNode == NULL)
+	// bring it into the inode cache-GOSFS_Inode
+	rc = Iget(mountPoint, inodeNum, &iNode);
+	if (rc < 0)
 	{
 		Debug("	Failed init iNode.\n");
+		Delete_GOSFS_Inode(mountPoint, inodeNum);
 		goto failed;
 	}
-	iNode->icount++;
 
 	// now we've got the GOSFS_Inode; create File(VNode);
 	// filepos = endpos = 0
 	Debug("	Allocate File.\n");
-		vNode = Allocate_File(&s_gosfsFileOps, 0, 0, iNode, mode, mountPoint);
+	vNode = Allocate_File(&s_gosfsFileOps, 0, 0, iNode, mode, mountPoint);
 	if (vNode == NULL)
 	{
 		Debug("	Failed allocating vNode.\n");
-		Free(iNode);
+		Iforget(iNode);
+		Delete_GOSFS_Inode(mountPoint, inodeNum);
+		rc = ENOMEM;
 		goto failed;
 	}
-	else{
-		Debug("vNode:%x\n", (int)vNode);
-		Debug("vNode->pos:%d\n", (int)vNode->filePos);
-		Debug("vNode->ops->write:%x\n", (int)vNode->ops->Write);
-		fileNode = vNode;
-	}
-
-	Add_To_Back_Of_VNode_List(&vnodeList, vNode);
 
 	//--------------------------------------
-	// at last update the father Dir;
-	// first check if the father Dir remains in the list
+	// at last update the father Dir and the dcache
 	Debug(" UpDate father Dir.\n");
-	vNode = Get_Front_Of_VNode_List(&vnodeList);
-	while(vNode != NULL)
+	rc = Add_Dir_Child(mountPoint, fatherNode, prefix, inodeNum, iNode->dirEntry.flags);
+	if (rc < 0)
 	{
-		Print("	test.\n");
-		iNode = (struct GOSFS_Inode *)vNode->fsData;
-		if(fDirNum == iNode->inodeNumber)
-		{
-			Debug("	Father Dir already in list.\n");
-			for(i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; i++)
-			{	if(iNode->dirEntry.blockList[i] == 0) break; }
-			iNode->dirEntry.blockList[i] = inodeNum;
-			iNode->dirEntry.size++;
-			iNode->dirty = true; // although we set the dirty bit, we still have to write back right now
-			break;
-		}
-
-		vNode = Get_Next_In_VNode_List(vNode);
+		Free(vNode);
+		Iforget(iNode);
+		Delete_GOSFS_Inode(mountPoint, inodeNum);
+		goto failed;
 	}
-
-	// Write back the changed father inode
-	FIND_INODEBLOCK_AND_INODEOFFSET(fDirNum, inodeBlock, inodeOffset);
-	rc = Get_FS_Buffer(gosfsBufferCache, inodeBlock, &nodeBuf);
-	if (rc < 0) return rc;
-	dirBlock = (struct GOSFS_Dir_Block *)nodeBuf->data;
-	for(i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; i++)
-	{	if(dirBlock->entryTable[inodeOffset].blockList[i] == 0) break; }
-	dirBlock->entryTable[inodeOffset].blockList[i] = inodeNum;
-	dirBlock->entryTable[inodeOffset].size++;
-	Debug("	size:%d\n", (int)dirBlock->entryTable[inodeOffset].size);
-	Modify_FS_Buffer(gosfsBufferCache, nodeBuf);
-	Sync_FS_Buffer(gosfsBufferCache, nodeBuf);
-	Release_FS_Buffer(gosfsBufferCache, nodeBuf);
-
+	Dcache_Insert(mountPoint, fDirNum, prefix, inodeNum, iNode->dirEntry.flags);
 
 	//--------------------------
 	// add to the user list if the caller is a user thread
-	if (g_currentThread->userContext != 0)
+	rc = Add_To_User_File_List(vNode);
+	Debug("gosfs create rc:%d\n", rc);
+	if (rc < 0)
 	{
-		for(i = 0; i < GOSFS_NUM_DIR_ENTRY; i++)
-		{ if(g_currentThread->userContext->fileList[i] == 0) break; }
-		g_currentThread->userContext->fileList[i] = fileNode;
-		rc = i;
-		Debug("gosfs create rc:%d\n", rc);
-		g_currentThread->userContext->fileCount++;
+		Iput(iNode);
+		Free(vNode);
+		goto failed;
 	}
 
-	*pFile = fileNode;
-	Free(tempEntry); // father dir
-	Free(tempPath); 
-
-
+	if (mode & O_WRITE)
+		iNode->writers++;
+	*pFile = vNode;
 	Print(" finished.\n");
-	return rc;
-
 
 failed:
-	Print("failed.\n");	
-			Free(tempPath);
-			Free(tempEntry);
-			return rc;
+	if (fatherNode != NULL)
+	{
+		RW_Write_Unlock(&fatherNode->lock);
+		Iput(fatherNode);
+	}
+	return rc;
 }
 
 
@@ -1224,159 +4038,82 @@ failed:
  * Create a directory named by given path.
  */
 // ERROR: fixed
-static int GOSFS_Create_Directory(struct Mount_Point *mountPoint, const char *path)
+static int Do_Create_Directory(struct Mount_Point *mountPoint, const char *path)
 {
-	struct GOSFS_Inode *iNode = NULL;
-	struct GOSFS_Dir_Entry * newEntry, *tempEntry = 0, *wasteEntry = 0;
-	struct FS_Buffer * nodeBuf;
-	struct GOSFS_Dir_Block * dirBlock = NULL;
-	struct File* vNode = NULL;
-	int inodeBlock, inodeOffset, inodeNum, fDirNum;
-	const char *suffix;
-	char * pPath;
+	struct GOSFS_Superblock *gosfsSuperBlock = (struct GOSFS_Superblock *)mountPoint->fsData;
+	struct GOSFS_Inode *fatherNode;
 	char prefix[GOSFS_FILENAME_MAX + 1];
-	void* tempPath;
-	
-	int i=0, rc;
-	bool found = false;
-	inodeBlock = inodeOffset = inodeNum = 0;
-	fDirNum = GOSFS_ROOT_INODE_NUM;
+	ulong_t fDirNum, childNum, flags;
+	int inodeNum, rc;
 
-	// first get rootDir from mountPoint
-	//VNode = Get_Front_Of_VNode_List(&vnodeList);
-	
 	// path can be from root Dir, or current Dir, even only one name;
-	// we start searching from the current given VNode's dir block
-	Get_Exist_Inode(fDirNum, &newEntry);
+	// find the father dir first
+	rc = Resolve_Path(mountPoint, path, prefix, &fDirNum, 0);
+	if (rc < 0) return rc;
+	rc = Iget(mountPoint, fDirNum, &fatherNode);
+	if (rc < 0) return rc;
+	// hold the father dir from the lookup to the new entry
+	RW_Write_Lock(&fatherNode->lock);
 
-	//Print("	bufBlock:%d\n", (int)nodeBuf->fsBlockNum);
-	Debug("newEntry->name:%s\n", newEntry->filename);
-	//Print("%s\n", dirBlock->entryTable[inodeOffset].filename);
-	
-	// This is slow :-(
-	tempPath = Malloc(strlen(path));
-	if (tempPath == NULL)
-		return ENOMEM;
-	pPath = tempPath;
-	strcpy(pPath, path);
-	// enter the loop; if there is one prefix, there must be one sub Dir
-	Debug("	pPath:%s\n", pPath);
-	if(strcmp(pPath, "/") == 0)
-	{ Free(tempPath); Free(newEntry); return ENOTFOUND; }
-	while(Unpack_Path(pPath, prefix, &suffix))
-	{	
-		if(strcmp(suffix, "/") == 0) 
-		{
-			Debug(" suffix err.\n");
-			break;
-		}
-		// this is an empty dir  or this is not a dir
-		//Print("	prefix:%s\n", prefix);
-		//Print("	suffix:%s\n", suffix);
-		if (newEntry->size == 0 || !(newEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY))
-		{
-			Debug("	newEntry->size:%d,name:%s\n", (int)(newEntry->size),newEntry->filename);
-			Debug("	newEntry->flags:%d\n", (int)(newEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY));
-			Print("	not found.\n");
-			Free(pPath);
-			Free(newEntry);
-			return ENOTFOUND;
-		}
-		// compare every entry with prefix to see if there is one sub-dir matched;
-		for(i= 0; i < newEntry->size; i++)
-		{
-			Get_Exist_Inode(newEntry->blockList[i], &tempEntry);
-			Debug("	prefix:%s, filename:%s\n", prefix, tempEntry->filename);
-			if(strcmp(prefix, tempEntry->filename) == 0)
-			{	
-				found = true;
-				fDirNum = newEntry->blockList[i];
-				Free(newEntry);
-				newEntry = tempEntry;
-				Print("	found!\n");
-				break;
-			}
-			Free(tempEntry);
-			
-		}
-		
-		if (found)
-		{
-			Debug("	found one; go on to the next.\n");
-			found = false;
-		}
-		else // we can't find even one matching name in this dir
-		{
-			Free(tempPath);
-			Free(newEntry);
-			return ENOTFOUND;
-		}
-		strcpy(pPath, suffix); // go on with the next sub-path
+	// the name must not be in use
+	rc = Dir_Lookup(mountPoint, fatherNode, prefix, &childNum, 0);
+	if (rc == 0)
+	{
+		rc = EEXIST;
+		goto done;
 	}
-	
-	// Now we've got destEntry
+	else if (rc != ENOTFOUND)
+		goto done;
+
 	// check if we can afford a new Inode
-	if (newEntry->size == GOSFS_NUM_BLOCK_PTRS)
+	if (!Dir_Has_Room(&fatherNode->dirEntry))
 	{
 		// no more space in blockList
-		Free(tempPath);
-		Free(newEntry);
-		return EMFILE;
+		rc = EMFILE;
+		goto done;
 	}
 
+	// new directories take the format the volume was created with
+	flags = GOSFS_DIRENTRY_ISDIRECTORY;
+	if (gosfsSuperBlock->gfsInstance.features & GOSFS_FEATURE_HASHED_DIRS)
+	{
+		flags |= GOSFS_DIRENTRY_HASHED;
+		// only a hashed directory has data blocks to map
+		if (gosfsSuperBlock->gfsInstance.features & GOSFS_FEATURE_EXTENTS)
+			flags |= GOSFS_DIRENTRY_EXTENTS;
+	}
 
 	// first Allocate a new Inode from SuperBlock
-	inodeNum = Allocate_Inode(mountPoint, &wasteEntry, prefix, GOSFS_DIRENTRY_ISDIRECTORY);
+	inodeNum = Allocate_Inode(mountPoint, prefix, flags);
 	if(inodeNum < 0) //not successfully allocated
 	{
-		Free(tempPath);
-		Free(newEntry);
-		return inodeNum;
+		rc = inodeNum;
+		goto done;
 	}
 	Debug("	inodeNum:%d\n", inodeNum);
 
-	// then update the father Dir
-	// Check to see if we've opened it and it still remained in the vnodeList
-	vNode = Get_Front_Of_VNode_List(&vnodeList);
-	while(vNode != NULL)
-	{
-		iNode = (struct GOSFS_Inode *)vNode->fsData;
-		if(iNode->inodeNumber == fDirNum)
-		{
-			Debug("	Father Dir already in list.\n");
-			for(i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; i++)
-			{	if(iNode->dirEntry.blockList[i] == 0) break; }
-			iNode->dirEntry.blockList[i] = inodeNum;
-			iNode->dirEntry.size++;
-			iNode->dirty = true; // although we set the dirty bit, we still have to write back right now
-			break;
-		}
-
-		vNode = Get_Next_In_VNode_List(vNode);
-	}
+	// then update the father Dir and the dcache
+	rc = Add_Dir_Child(mountPoint, fatherNode, prefix, inodeNum, flags);
+	if (rc == 0)
+		Dcache_Insert(mountPoint, fDirNum, prefix, inodeNum, flags);
+	else
+		Delete_GOSFS_Inode(mountPoint, inodeNum);
 
-	// update father dir
-	FIND_INODEBLOCK_AND_INODEOFFSET(fDirNum, inodeBlock, inodeOffset);
-	rc = Get_FS_Buffer(gosfsBufferCache, inodeBlock, &nodeBuf);
-	if (rc < 0) return rc;
-	dirBlock = (struct GOSFS_Dir_Block *)nodeBuf->data;
-	memcpy(newEntry, &(dirBlock->entryTable[inodeOffset]), sizeof(struct GOSFS_Dir_Entry));
-	for(i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; i++)
-	{	if(dirBlock->entryTable[inodeOffset].blockList[i] == 0) break; }
-	dirBlock->entryTable[inodeOffset].blockList[i] = inodeNum;	
-	dirBlock->entryTable[inodeOffset].size++;
-	Debug("	size:%d\n", (int)dirBlock->entryTable[inodeOffset].size);
-	Modify_FS_Buffer(gosfsBufferCache, nodeBuf);
-	Sync_FS_Buffer(gosfsBufferCache, nodeBuf);
-	Release_FS_Buffer(gosfsBufferCache, nodeBuf);
-	// Init destEntry's sub entry in datablock
-	//////////newEntry->blockList?????
-	Free(newEntry); // this entry is not used, so release it
-	Free(tempPath);
-	Free(wasteEntry);
-	// ERROR: dirBlock->numExistEntry++;
 	Print(" finished.\n");
-	return 0;
+done:
+	RW_Write_Unlock(&fatherNode->lock);
+	Iput(fatherNode);
+	return rc;
+}
+
+static int GOSFS_Create_Directory(struct Mount_Point *mountPoint, const char *path)
+{
+	int rc;
+
+	Journal_Start(mountPoint, GOSFS_JOURNAL_OP_CREDITS);
+	rc = Do_Create_Directory(mountPoint, path);
+	Journal_Stop(mountPoint);
+	return rc;
 }
 
 
@@ -1393,295 +4130,102 @@ static int GOSFS_Open_Directory(struct Mount_Point *mountPoint, const char *path
 			return EMFILE;
 	}
 
-	struct GOSFS_Dir_Entry * tempEntry, *newEntry;
 	struct GOSFS_Inode * iNode = NULL;
 	struct File *vNode;
-	const char *suffix;
-	char * pPath;
-	char prefix[GOSFS_FILENAME_MAX + 1];
-	void* tempPath;
-	bool found = false;
-	int i, rc, inodeNum = GOSFS_ROOT_INODE_NUM;
-
-	i = rc = 0;
-	tempPath = Malloc(strlen(path));
-	if (tempPath == NULL)
-		return ENOMEM;
-	pPath = tempPath;
-	strcpy(pPath, path);
-
-	rc = Get_Exist_Inode(GOSFS_ROOT_INODE_NUM, &tempEntry);
-
-	while(Unpack_Path(pPath, prefix, &suffix))
-	{
-		if(strcmp(pPath, "/") == 0)
-		{
-			Debug(" suffix err.\n");
-			break;
-		}
-		if (tempEntry->size == 0 || !(tempEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY)) // empty dir
-		{
-			Debug("	size:%d\n", (int)tempEntry->size);
-			Debug("	flags:%d\n", (int)tempEntry);
-			Print("	Empty Dir or No Dir.\n");
-			rc = ENOTFOUND;
-			goto failed;
-		}
-		// start searching
-		for (i = 0; i < tempEntry->size; i++)
-		{
-			Get_Exist_Inode(tempEntry->blockList[i], &newEntry);
-			if(strcmp(prefix, newEntry->filename) == 0)
-			{
-				inodeNum = tempEntry->blockList[i];
-				Free(tempEntry);
-				tempEntry = newEntry;
-				found = true;
-				break;
-			}
-			// not found in this round
-			Free(newEntry);
-		}
-		
-		// check if we found target dir
-		if(found)
-			found = false;
-		else
-		{
-			Print("	not in this directory:%s", tempEntry->filename);
-			rc = ENOTFOUND;
-			goto failed;
-		}
-		strcpy(pPath, suffix); 
-	}
-
-
-	// now we've got the Dir_Entry; create the GOSFS_Inode, then the VNode;
-	Debug("	target dir:%s\n", tempEntry->filename);
-
-	
-	// Check to see if we've opened it and it still remained in the vnodeList
-	vNode = Get_Front_Of_VNode_List(&vnodeList);
-	while(vNode != NULL)
-	{
-		iNode = (struct GOSFS_Inode *)vNode->fsData;
-		if(inodeNum == iNode->inodeNumber)
-		{
-			Debug("	VNode already in list:%d, %x\n", (int)inodeNum, (int)vNode);
-			iNode->icount++;
-			goto done;
-		}
-
-		vNode = Get_Next_In_VNode_List(vNode);
-	}
+	ulong_t inodeNum, flags;
+	int rc;
 
+	rc = Resolve_Path(mountPoint, path, 0, &inodeNum, &flags);
+	if (rc < 0) return rc;
+	if (!(flags & GOSFS_DIRENTRY_ISDIRECTORY))
+		return ENOTDIR;
 
-	// Not in vnodeList, create a new one and insert it into the list
-	iNode = Init_GOSFS_Inode(tempEntry, inodeNum);
-	if (iNode == NULL)
-	{
-		Debug("	Failed init iNode.\n");
-		goto failed;
-	}
-	iNode->icount++;
+	// every open gets its own File, all of them on the one cached inode
+	rc = Iget(mountPoint, inodeNum, &iNode);
+	if (rc < 0) return rc;
+	Debug("	target dir:%s\n", iNode->dirEntry.filename);
 
 	// now we've got the GOSFS_Inode; create File(VNode);
 	// filepos : next dir to be read
 	// endpos: total dir numbers in this dir
 	// we don't have mode for dir right now, so all dirs can be opened
-	vNode = Allocate_File(&s_gosfsDirOps, 0, tempEntry->size, iNode, 0, mountPoint);
+	vNode = Allocate_File(&s_gosfsDirOps, 0, iNode->dirEntry.size, iNode, 0, mountPoint);
 	if (vNode == NULL)
 	{
 		Debug("	Failed allocating vNode.\n");
-		Free(iNode);
-		goto failed;
+		Iput(iNode);
+		return ENOMEM;
 	}
 
-	Add_To_Back_Of_VNode_List(&vnodeList, vNode);
-
-
-done:
 	// we're sure that we can afford another opened dir; see the top of the function
-	if (g_currentThread->userContext != 0)
-	{
-			for(i = 0; i < GOSFS_NUM_DIR_ENTRY; i++)
-			{ if(g_currentThread->userContext->fileList[i] == 0) break; }
-			g_currentThread->userContext->fileList[i] = vNode;
-			rc = i;
-			Debug("gosfs open dir rc:%d\n", rc);
-			g_currentThread->userContext->fileCount++;
-	}
-
-	*pDir = vNode;
-	Free(tempPath);
-	Free(tempEntry);
-	
-	return rc;
-
-
-	
-failed:
-			Free(tempPath);
-			Free(tempEntry);
-			return rc;
-}
-
-
-// Almost the same as GOSFS_Open_Directory
-static int GOSFS_Open_File(struct Mount_Point *mountPoint, const char *path, int mode, struct File **pFile)
-{
-	// First of all check if the user can afford another opened file
-	if (g_currentThread->userContext != 0)
-	{
-		if(g_currentThread->userContext->fileCount == USER_MAX_FILES)
-			return EMFILE;
-	}
-
-	struct GOSFS_Dir_Entry * tempEntry, *newEntry;
-	struct GOSFS_Inode * iNode = NULL;
-	struct File *vNode;
-	const char *suffix;
-	char * pPath;
-	char prefix[GOSFS_FILENAME_MAX + 1];
-	void* tempPath;
-	bool found = false;
-	int i, rc, inodeNum = 0;
-
-	i = rc = 0;
-	tempPath = Malloc(strlen(path));
-	if (tempPath == NULL)
-		return ENOMEM;
-	pPath = tempPath;
-	strcpy(pPath, path);
-
-	rc = Get_Exist_Inode(GOSFS_ROOT_INODE_NUM, &tempEntry);
-	Debug("gosfs open path:%s\n", path);
-	if(strcmp(path, "/") == 0)
-	{
-		rc = ENOTFOUND;
-		Print("can't open /d by using open file.\n");
-		goto failed;
-	}
-	//while(1);
-	// First locate the father directory
-	while(Unpack_Path(pPath, prefix, &suffix))
+	rc = Add_To_User_File_List(vNode);
+	Debug("gosfs open dir rc:%d\n", rc);
+	if (rc < 0)
 	{
-		if(strcmp(pPath, "/") == 0)
-		{
-			Debug(" suffix err.\n");
-			break;
-		}
-		if (tempEntry->size == 0 || !(tempEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY)) // empty dir
-		{
-			Debug("	size:%d\n", (int)tempEntry->size);
-			Debug("	flags:%d\n", (int)tempEntry->flags);
-			Print("	Empty Dir or No Dir:%s\n", tempEntry->filename);
-			rc = ENOTFOUND;
-			goto failed;
-		}
-		// start searching
-		for (i = 0; i < tempEntry->size; i++)
-		{
-			Get_Exist_Inode(tempEntry->blockList[i], &newEntry);
-			Debug("prefix:%s, newEntry:%s\n", prefix, newEntry->filename);
-			if(strcmp(prefix, newEntry->filename) == 0 && !(newEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY))
-			{
-				inodeNum = tempEntry->blockList[i];
-				Free(tempEntry);
-				tempEntry = newEntry;
-				found = true;
-				break;
-			}
-			// not found in this round
-			Free(newEntry);
-		}
-		
-		// check if we found target dir
-		if(found)
-			found = false;
-		else
-		{
-			Print("	not in this directory:%s\n", newEntry->filename);
-			rc = ENOTFOUND;
-			goto failed;
-		}
-		strcpy(pPath, suffix); 
+		Iput(iNode);
+		Free(vNode);
+		return rc;
 	}
 
+	*pDir = vNode;
+	return rc;
+}
 
-	// now we've got the Dir_Entry; create the GOSFS_Inode, then the VNode;
-	Debug("	target file:%s\n", tempEntry->filename);
-	
-	// Check to see if we've opened it and it still remained in the vnodeList
-	vNode = Get_Front_Of_VNode_List(&vnodeList);
-	while(vNode != NULL)
-	{
-		iNode = (struct GOSFS_Inode *)vNode->fsData;
-		if(inodeNum == iNode->inodeNumber)
-		{
-			Debug("	VNode already in list:no.%d,%x\n", (int)inodeNum, (int)vNode);
-			Debug("	VNode name:%s\n", iNode->dirEntry.filename);
-			Print("vNode->Write:%x\n", (int)vNode->ops->Write);
-			vNode->mode = mode;
-			iNode->icount++;
-			
-			goto done;
-		}
 
-		vNode = Get_Next_In_VNode_List(vNode);
+// Almost the same as GOSFS_Open_Directory
+static int GOSFS_Open_File(struct Mount_Point *mountPoint, const char *path, int mode, struct File **pFile)
+{
+	// First of all check if the user can afford another opened file
+	if (g_currentThread->userContext != 0)
+	{
+		if(g_currentThread->userContext->fileCount == USER_MAX_FILES)
+			return EMFILE;
 	}
 
+	struct GOSFS_Inode * iNode = NULL;
+	struct File *vNode;
+	ulong_t inodeNum, flags;
+	int rc;
 
-	// Not in vnodeList, create a new one and insert it into the list
-	iNode = Init_GOSFS_Inode(tempEntry, inodeNum);
-	if (iNode == NULL)
+	Debug("gosfs open path:%s\n", path);
+	rc = Resolve_Path(mountPoint, path, 0, &inodeNum, &flags);
+	if (rc < 0) return rc;
+	if (flags & GOSFS_DIRENTRY_ISDIRECTORY)
 	{
-		Print("	Failed init iNode.\n");
-		goto failed;
+		Print("can't open a directory by using open file.\n");
+		return ENOTFOUND;
 	}
-	iNode->icount++;
+
+	// every open gets its own File, all of them on the one cached inode
+	rc = Iget(mountPoint, inodeNum, &iNode);
+	if (rc < 0) return rc;
+	Debug("	target file:%s\n", iNode->dirEntry.filename);
 
 	// now we've got the GOSFS_Inode; create File(VNode);
-	// filepos : next dir to be read
-	// endpos: total dir numbers in this dir
-	// we don't have mode for dir right now, so all dirs can be opened
-	vNode = Allocate_File(&s_gosfsFileOps, 0, tempEntry->size, iNode, mode, mountPoint);
+	// filepos : current position in file
+	// endpos: size of file
+	vNode = Allocate_File(&s_gosfsFileOps, 0, iNode->dirEntry.size, iNode, mode, mountPoint);
 	if (vNode == NULL)
 	{
 		Debug("	Failed allocating vNode.\n");
-		Free(iNode);
-		goto failed;
+		Iput(iNode);
+		return ENOMEM;
 	}
 
-	Add_To_Back_Of_VNode_List(&vnodeList, vNode);
-
-
-done:
-	// we're sure that we can afford another opened dir; see the top of the function
-	if (g_currentThread->userContext != 0)
+	// we're sure that we can afford another opened file; see the top of the function
+	rc = Add_To_User_File_List(vNode);
+	Debug("gosfs open rc:%d\n", rc);
+	if (rc < 0)
 	{
-			for(i = 0; i < GOSFS_NUM_DIR_ENTRY; i++)
-			{ if(g_currentThread->userContext->fileList[i] == 0) break; }
-			g_currentThread->userContext->fileList[i] = vNode;
-			rc = i;
-			Debug("gosfs open rc:%d\n", rc);
-			g_currentThread->userContext->fileCount++;
+		Iput(iNode);
+		Free(vNode);
+		return rc;
 	}
 
-	Debug("done in vNode:%x\n", (int)vNode);
+	if (mode & O_WRITE)
+		iNode->writers++;
 	*pFile = vNode;
-	Print("in pfile:%x\n", (int)(*pFile));
-	Free(tempPath);
-	Free(tempEntry);
-	
 	return rc;
-
-
-	
-failed:
-			Free(tempPath);
-			Free(tempEntry);
-			return rc;
 }
 
 /*
@@ -1702,6 +4246,7 @@ static int GOSFS_Open(struct Mount_Point *mountPoint, const char *path, int mode
 
 
 	int rc = 0;
+	Journal_Start(mountPoint, GOSFS_JOURNAL_OP_CREDITS);
 	// We have to choose: create or open
 	if(mode & O_CREATE) // means we have to create a file
 	{
@@ -1712,7 +4257,7 @@ static int GOSFS_Open(struct Mount_Point *mountPoint, const char *path, int mode
 		Debug("Open file:\n");
 		rc = GOSFS_Open_File(mountPoint, path, mode, pFile);
 	}
-
+	Journal_Stop(mountPoint);
 
 	return rc;
 }
@@ -1721,167 +4266,74 @@ static int GOSFS_Open(struct Mount_Point *mountPoint, const char *path, int mode
 /*
  * Delete a directory named by given path.
  */
-static int GOSFS_Delete(struct Mount_Point *mountPoint, const char *path)
+static int Do_Delete(struct Mount_Point *mountPoint, const char *path)
 {
-       
-    	struct GOSFS_Dir_Entry * tempEntry, *newEntry;
-	struct GOSFS_Inode *tempNode;
-	struct FS_Buffer *nodeBuf = NULL;
-	struct GOSFS_Dir_Block *dirBlock = NULL;
-	struct GOSFS_Inode *iNode = NULL;
-	struct File *vNode;
-	const char *suffix;
-	char * pPath;
+	struct GOSFS_Inode *fatherNode, *iNode;
+	struct GOSFS_Dir_Entry *newEntry;
 	char prefix[GOSFS_FILENAME_MAX + 1];
-	void* tempPath;
-	bool found = false;
-	int i, rc, inodeNum, inodeBlock, inodeOffset;
-	int fDirNum = 0;
-	
-	i = rc = inodeNum = inodeBlock = inodeOffset = 0;
-	tempPath = Malloc(strlen(path));
-	if (tempPath == NULL)
-		return ENOMEM;
-	pPath = tempPath;
-	strcpy(pPath, path);
-
-	// First check if  the path is exist
-	rc = Get_Exist_Inode(GOSFS_ROOT_INODE_NUM, &tempEntry);
-	fDirNum = GOSFS_ROOT_INODE_NUM;
-	
-	Debug("path:%s\n", pPath);
-	if (strcmp(path, "/") == 0)
-	{
-		rc = EUNSUPPORTED;
-		goto failed;
-	}
-
-	// Find Father dir first
-	while(Unpack_Path(pPath, prefix, &suffix))
-	{
-		if(strcmp(suffix, "/") == 0)
-		{
-			Debug(" suffix err.\n");
-			break;
-		}
-		if (tempEntry->size == 0 || !(tempEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY)) // empty dir
-		{
-			Debug("	size:%d\n", (int)tempEntry->size);
-			Debug("	flags:%d\n", (int)tempEntry);
-			Print("	Empty Dir or No Dir.\n");
-			rc = ENOTFOUND;
-			goto failed;
-		}
-		// start searching
-		for (i = 0; i < tempEntry->size; i++)
-		{
-			Get_Exist_Inode(tempEntry->blockList[i], &newEntry);
-			if(strcmp(prefix, newEntry->filename) == 0)
-			{
-				fDirNum = tempEntry->blockList[i];
-				Free(tempEntry);
-				tempEntry = newEntry;
-				found = true;
-				break;
-			}
-			// not found in this round
-			Free(newEntry);
-		}
-		
-		// check if we found target dir
-		if(found)
-			found = false;
-		else
-		{
-			Print("	not in this directory:%s", tempEntry->filename);
-			rc = ENOTFOUND;
-			goto failed;
-		}
-		strcpy(pPath, suffix); 
-	}
+	ulong_t fDirNum, inodeNum;
+	int i, rc;
 
-	// First check if unpack path is failed
-	// we only fail the unpack path when the path is invalid
-	// !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+	Debug("path:%s\n", path);
+	while (*path == '/') path++;
+	if (*path == '\0')
+		return EUNSUPPORTED; // can't delete the root
 
-	// now we've got the Dir_Entry; delete the GOSFS_Inode, then the VNode;
-	Debug("	father dir:%s\n", tempEntry->filename);
-	Debug("	delete file:%s\n", prefix);
+	// Find Father dir first, then the target in it
+	rc = Resolve_Path(mountPoint, path, prefix, &fDirNum, 0);
+	if (rc < 0) return rc;
+	rc = Iget(mountPoint, fDirNum, &fatherNode);
+	if (rc < 0) return rc;
+	// lock the father dir, then the target: a parent always comes first
+	RW_Write_Lock(&fatherNode->lock);
+	rc = Dir_Lookup(mountPoint, fatherNode, prefix, &inodeNum, 0);
+	if (rc == ENOTFOUND) rc = EDELETION;
+	if (rc < 0) goto done;
+	rc = Iget(mountPoint, inodeNum, &iNode);
+	if (rc < 0) goto done;
+	RW_Write_Lock(&iNode->lock);
+	newEntry = &iNode->dirEntry;
 
-	//----------------------------------
-	// make sure it has a unique name
-	if(tempEntry->size > 0)
-	for (i = 0; i < GOSFS_NUM_DIR_ENTRY; i++)
-	{
-		if(tempEntry->blockList[i] == 0)continue;
-		Get_Exist_Inode(tempEntry->blockList[i], &newEntry);
-		if(strcmp(prefix, newEntry->filename) == 0)
-		{
-			//fDirNum = tempEntry->blockList[i];
-			//Free(tempEntry);
-			//tempEntry = newEntry;
-			found = true;
-			inodeNum = tempEntry->blockList[i];
-			break;
-		}
-		// not found in this round
-		Free(newEntry);
-	}
-	else
-	{
-		rc = ENOTFOUND;
-		goto failed;
-	}
+	Debug(" target found:%s, inodeNo:%d\n", newEntry->filename, (int)inodeNum);
 
-	if(found == false)
+	// check if this is a directory and it's not empty,
+	// or if any other reference to the inode is an open file
+	if((newEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY && newEntry->size >0) || iNode->icount > 1)
 	{
+		if (iNode->icount > 1) //still opened
+			Print("	Can't delete Opened file.Ref:%d\n", (int)iNode->icount - 1);
+		RW_Write_Unlock(&iNode->lock);
+		Iput(iNode);
 		rc = EDELETION;
-		//Free(newEntry);
-		goto failed;
+		goto done;
 	}
 
-	Debug(" target found:%s, inodeNo:%d\n", newEntry->filename, inodeNum);
 
-	// check if this is a directory and it's not empty
-	if(newEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY && newEntry->size >0)
-	{	rc = EDELETION; 
-		Free(newEntry);
-		goto failed;
+	// Not opened, we can delete it.
+	// A large file is only unlinked; the reclaim thread frees it
+	if(!(newEntry->flags & (GOSFS_DIRENTRY_ISDIRECTORY | GOSFS_DIRENTRY_INLINE))
+		&& newEntry->size >= GOSFS_RECLAIM_MIN_SIZE && Orphan_Add(mountPoint, inodeNum))
+	{
+		Debug("	Left to the reclaim thread.\n");
+		Prealloc_Discard(mountPoint, iNode);
+		Delayed_Unreserve(mountPoint, Discard_FS_Delayed_Buffers(GOSFS_CACHE(mountPoint), iNode));
+		newEntry->flags |= GOSFS_DIRENTRY_ORPHAN;
+		Write_Inode(iNode, false);
+		RW_Write_Unlock(&iNode->lock);
+		Iput(iNode);
+		goto unlink;
 	}
 
-	// If it is an exist entry, see if we've opened it
-	vNode = Get_Front_Of_VNode_List(&vnodeList);
-	while(vNode != NULL)
+	// First delete the blocks of the file if this file is a normal one;
+	// a hashed directory has blocks too, an old style one only child numbers;
+	// an inline file has none
+	if(newEntry->flags & GOSFS_DIRENTRY_INLINE)
 	{
-		tempNode= (struct GOSFS_Inode *)vNode->fsData;
-		Debug("	in list:%s\n", tempNode->dirEntry.filename);
-		if(tempNode->inodeNumber == inodeNum)
-		{
-			// Found one in vnodeList, free it after check
-			if (tempNode->icount > 0) //still opened
-			{
-				Print("	Can't delete Opened file.Ref:%d\n", (int)tempNode->icount);
-				rc = EDELETION;
-				Free(newEntry);
-				goto failed;
-			}
-			else if(tempNode->icount == 0) // no refference
-			{
-				Debug("	VNode has no refference.\n");
-				Remove_From_VNode_List(&vnodeList, vNode);
-				Free(tempNode);
-				Free(vNode);
-				break; // Free in mem vNode;
-			}
-		}
-
-		vNode = Get_Next_In_VNode_List(vNode);
+		Debug("	Inline data goes with the inode.\n");
 	}
-
-
-	// Not opened, we can delete it
-	// First delete the blocks of the file if this file is a normal one
-	if(!(newEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY))
+	else if(newEntry->flags & GOSFS_DIRENTRY_EXTENTS)
+		Extent_Release_All(mountPoint, iNode);
+	else if(!(newEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY) || (newEntry->flags & GOSFS_DIRENTRY_HASHED))
 	{
 		Debug("	This is a normal file.\n");
 		// release the direct blocks
@@ -1899,7 +4351,6 @@ static int GOSFS_Delete(struct Mount_Point *mountPoint, const char *path)
 		{
 			Debug("release first ind block.\n");
 			Release_First_Indirect_Block(mountPoint, newEntry->blockList[8]);
-			// Release_Block(mountPoint, tempEntry->blockList[8]);
 		}
 
 		// release the second indirect block
@@ -1907,63 +4358,41 @@ static int GOSFS_Delete(struct Mount_Point *mountPoint, const char *path)
 		{
 			Debug("release sec ind block.\n");
 			Release_Second_Indirect_Block(mountPoint, newEntry->blockList[9]);
-			// Release_Block(mountPoint, tempEntry->blockList[9]);
 		}
 	}
+	if(newEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY)
+		Dcache_Purge(mountPoint, inodeNum); // its (negative) entries must not outlive it
 
 
-	// Now we can release the iNode
+	// Now we can release the iNode, on disk and in core
 	rc = Delete_GOSFS_Inode(mountPoint, inodeNum);
-	if(rc < 0) goto failed;
-	Free(newEntry); // release the target dir
+	if(rc == 0) iNode->deleted = true; // Icache_Sync must not write it back
+	RW_Write_Unlock(&iNode->lock);
+	if(rc < 0) { Iput(iNode); goto done; }
+	Iforget(iNode);
 
+unlink:
 	//--------------------------------------
-	// at last update the father Dir;
-	// first check if the father Dir remains in the list
+	// at last update the father Dir; the name is now known to be gone
 	Debug(" UpDate father Dir.\n");
-	vNode = Get_Front_Of_VNode_List(&vnodeList);
-	while(vNode != NULL)
-	{
-		Debug("	test.\n");
-		iNode = (struct GOSFS_Inode *)vNode->fsData;
-		if(iNode->inodeNumber == fDirNum)
-		{
-			Debug("	Father Dir already in list.\n");
-			for(i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; i++)
-			{ if(iNode->dirEntry.blockList[i] == inodeNum) break; }
-			iNode->dirEntry.blockList[i] = 0;
-			iNode->dirEntry.size--;
-			iNode->dirty = true; // although we set the dirty bit, we still have to write back right now
-			break;
-		}
-
-		vNode = Get_Next_In_VNode_List(vNode);
-	}
-
-	// Write back the changed father inode
-	FIND_INODEBLOCK_AND_INODEOFFSET(fDirNum, inodeBlock, inodeOffset);
-	rc = Get_FS_Buffer(gosfsBufferCache, inodeBlock, &nodeBuf);
-	if (rc < 0) return rc;
-	dirBlock = (struct GOSFS_Dir_Block *)nodeBuf->data;
-	for(i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; i++)
-	{ if(dirBlock->entryTable[inodeOffset].blockList[i] == inodeNum) break; }
-	dirBlock->entryTable[inodeOffset].blockList[i] = 0;
-	dirBlock->entryTable[inodeOffset].size--;
-	Debug("	size:%d\n", (int)dirBlock->entryTable[inodeOffset].size);
-	Modify_FS_Buffer(gosfsBufferCache, nodeBuf);
-	Sync_FS_Buffer(gosfsBufferCache, nodeBuf);
-	Release_FS_Buffer(gosfsBufferCache, nodeBuf);
-
-
-
+	rc = Remove_Dir_Child(mountPoint, fatherNode, prefix, inodeNum);
+	Dcache_Insert(mountPoint, fDirNum, prefix, 0, 0);
 
 	Print("	Dir_Entry deleted.\n");
 
-failed:
+done:
+	RW_Write_Unlock(&fatherNode->lock);
+	Iput(fatherNode);
+	return rc;
+}
 
-	Free(tempPath);
-	Free(tempEntry);
+static int GOSFS_Delete(struct Mount_Point *mountPoint, const char *path)
+{
+	int rc;
 
+	Journal_Start(mountPoint, Journal_Free_Credits(mountPoint));
+	rc = Do_Delete(mountPoint, path);
+	Journal_Stop(mountPoint);
 	return rc;
 }
 
@@ -1972,83 +4401,44 @@ failed:
  */
 static int GOSFS_Stat(struct Mount_Point *mountPoint, const char *path, struct VFS_File_Stat *stat)
 {
-	struct GOSFS_Dir_Entry * tempEntry, *newEntry;
-	//struct GOSFS_Inode * iNode = NULL;
-	//struct File *vNode;
-	const char *suffix;
-	char * pPath;
-	char prefix[GOSFS_FILENAME_MAX + 1];
-	void* tempPath;
-	bool found = false;
-	int i, rc, inodeNum = 0;
+	struct GOSFS_Inode *iNode;
+	ulong_t inodeNum;
+	int rc;
 
-	i = rc = 0;
-	tempPath = Malloc(strlen(path));
-	if (tempPath == NULL)
-		return ENOMEM;
-	pPath = tempPath;
-	strcpy(pPath, path);
+	rc = Resolve_Path(mountPoint, path, 0, &inodeNum, 0);
+	if (rc < 0) return rc;
+	rc = Iget(mountPoint, inodeNum, &iNode);
+	if (rc < 0) return rc;
 
-	rc = Get_Exist_Inode(GOSFS_ROOT_INODE_NUM, &tempEntry);
+	Debug("	target file:%s\n", iNode->dirEntry.filename);
 
-	// First locate the father directory
-	while(Unpack_Path(pPath, prefix, &suffix))
-	{
-		if(strcmp(pPath, "/") == 0)
-		{
-			Debug(" suffix err.\n");
-			break;
-		}
-		if (tempEntry->size == 0 || !(tempEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY)) // empty dir
-		{
-			Debug("	size:%d\n", (int)tempEntry->size);
-			Debug("	flags:%d\n", (int)tempEntry);
-			Print("	Empty Dir or No Dir.\n");
-			rc = ENOTFOUND;
-			goto failed;
-		}
-		// start searching
-		for (i = 0; i < tempEntry->size; i++)
-		{
-			Get_Exist_Inode(tempEntry->blockList[i], &newEntry);
-			if(strcmp(prefix, newEntry->filename) == 0)
-			{
-				inodeNum = tempEntry->blockList[i];
-				Free(tempEntry);
-				tempEntry = newEntry;
-				found = true;
-				break;
-			}
-			// not found in this round
-			Free(newEntry);
-		}
-		
-		// check if we found target dir
-		if(found)
-			found = false;
-		else
-		{
-			Print("	not in this directory:%s", tempEntry->filename);
-			rc = ENOTFOUND;
-			goto failed;
-		}
-		strcpy(pPath, suffix); 
-	}
+	// Make the assignment of the VFS_File_Stat structure
+	stat->isDirectory = iNode->dirEntry.flags & GOSFS_DIRENTRY_ISDIRECTORY ? true : false;
+	stat->size = iNode->dirEntry.size;
+	stat->isSetuid = iNode->dirEntry.flags & GOSFS_DIRENTRY_SETUID ? true : false;
+	Iput(iNode);
 
+	return 0;
+}
 
-	// now we've got the Dir_Entry; create the GOSFS_Inode, then the VNode;
-	Debug("	target file:%s\n", tempEntry->filename);
+/*
+ * Get the size and the free space of the filesystem.
+ */
+static int GOSFS_StatFS(struct Mount_Point *mountPoint, struct VFS_FS_Stat *stat)
+{
+	struct GOSFS_Superblock *gosfsSuperBlock = (struct GOSFS_Superblock *)mountPoint->fsData;
 
-	// Make the assignment of the VFS_File_Stat structure
-	stat->isDirectory = tempEntry->flags & GOSFS_DIRENTRY_ISDIRECTORY ? true : false;
-	stat->size = tempEntry->size;
-	stat->isSetuid = tempEntry->flags & GOSFS_DIRENTRY_SETUID ? true : false;
+	stat->blockSize = GOSFS_FS_BLOCK_SIZE;
+	stat->totalBlocks = gosfsSuperBlock->gfsInstance.numDataBlocks;
+	stat->totalInodes = gosfsSuperBlock->gfsInstance.numInodes;
 
-failed: 
+	// both counts from the same moment
+	Mutex_Lock(&gosfsSuperBlock->lock);
+	stat->freeBlocks = gosfsSuperBlock->blockFree.free;
+	stat->freeInodes = gosfsSuperBlock->inodeFree.free;
+	Mutex_Unlock(&gosfsSuperBlock->lock);
 
-	Free(tempEntry);
-	Free(tempPath);
-	return rc;
+	return 0;
 }
 
 /*
@@ -2057,8 +4447,16 @@ failed:
  */
 static int GOSFS_Sync(struct Mount_Point *mountPoint)
 {
-	// First sync inode blocks and data blocks
-	int rc = Sync_FS_Buffer_Cache(gosfsBufferCache);
+	// First put dirty in-core inodes into their blocks,
+	// then sync inode blocks and data blocks
+	int rc = Icache_Sync(mountPoint);
+	if(rc < 0) return rc;
+
+	// the superblock is part of every commit
+	if(GOSFS_SB(mountPoint)->journal.enabled)
+		return Journal_Sync(mountPoint);
+
+	rc = Sync_FS_Buffer_Cache(GOSFS_CACHE(mountPoint));
 	if(rc < 0) return rc;
 
 	// Then sync superblock
@@ -2067,18 +4465,66 @@ static int GOSFS_Sync(struct Mount_Point *mountPoint)
 	gosfsSuperBlock = (struct GOSFS_Superblock *)mountPoint->fsData;
 	if (gosfsSuperBlock->dirty == true)
 	{
-		rc = Get_FS_Buffer(gosfsBufferCache, GOSFS_SUPER_BLOCK_NUM, &blockBuf);
-		if(rc < 0) goto done;
+		rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), GOSFS_SUPER_BLOCK_NUM, &blockBuf);
+		if(rc < 0) return rc;
 		memcpy(blockBuf->data, &gosfsSuperBlock->gfsInstance, sizeof(struct GOSFS_Instance));
-		Modify_FS_Buffer(gosfsBufferCache, blockBuf);
-		Sync_FS_Buffer(gosfsBufferCache, blockBuf);
+		Modify_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+		rc = Sync_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), blockBuf);
+		if(rc == 0)
+			gosfsSuperBlock->dirty = false;
 	}
 
+	return rc;
+}
 
-done:
-	Release_FS_Buffer(gosfsBufferCache, blockBuf);
+/*
+ * Flusher thread.
+ * Inodes, data and the superblock are only written lazily; this thread
+ * syncs every mounted GOSFS volume every GOSFS_FLUSH_TICKS timer ticks so
+ * nothing stays dirty in memory for long.
+ */
+static struct Thread_Queue s_flushWaitQueue;
+static struct GOSFS_Superblock_List s_volumeList;	/* mounted volumes, appended to only */
+static struct Mutex s_volumeLock;
+
+// Timer callback, called with interrupts disabled. A timer keeps firing
+// until it is cancelled, but not from here: the timer interrupt would
+// skip the event Cancel_Timer moves into this one's slot. The flusher
+// cancels it once awake.
+static void Flush_Timer_Expired(int id)
+{
+	Wake_Up(&s_flushWaitQueue);
+}
 
-	return rc;
+static void GOSFS_Flusher(ulong_t arg)
+{
+	struct GOSFS_Superblock *sb;
+	int id;
+
+	for (;;)
+	{
+		Disable_Interrupts();
+		id = Start_Timer(GOSFS_FLUSH_TICKS, Flush_Timer_Expired);
+		Wait(&s_flushWaitQueue);
+		if (id >= 0)
+			Cancel_Timer(id);
+		Enable_Interrupts();
+
+		// volumes are never taken off the list, so it is only locked
+		// to step through it, and a mount doesn't wait for the syncs
+		Debug("gosfs flusher: syncing\n");
+		Mutex_Lock(&s_volumeLock);
+		sb = Get_Front_Of_GOSFS_Superblock_List(&s_volumeList);
+		Mutex_Unlock(&s_volumeLock);
+		while (sb != 0)
+		{
+			GOSFS_Sync(sb->mountPoint);
+			Mutex_Lock(&s_volumeLock);
+			sb = Get_Next_In_GOSFS_Superblock_List(sb);
+			Mutex_Unlock(&s_volumeLock);
+		}
+	}
 }
 
 /*static*/ struct Mount_Point_Ops s_gosfsMountPointOps = {
@@ -2088,23 +4534,14 @@ done:
     &GOSFS_Stat,
     &GOSFS_Sync,
     &GOSFS_Delete,
+    &GOSFS_StatFS,
 };
 
-
-// Write the first block as all '0's--this is the bootSector
-// Initialize the FS_Buffer_Cache structure
-// get a FS_Buffer, and write the superBlock in to this Buffer
-// write SuperBlock back to disk
-// Initialize the first inode--root Dir
-// return 0 if successfull
-static int GOSFS_Format(struct Block_Device * blockDev)
+// Lay GOSFS out on the device of cache
+static int Do_Format(struct FS_Buffer_Cache *cache, ulong_t features)
 {
-	// first we create a Buffer Cache for GOSFS;
-	struct Block_Device* dev = blockDev;
-	uint_t fsBlockSize = GOSFS_FS_BLOCK_SIZE;
+	struct Block_Device *dev = cache->dev;
 	int rc = 0;
-	
-	gosfsBufferCache = Create_FS_Buffer_Cache(dev, fsBlockSize); // now we get a FS_Buffer_Cache struct
 
 	// then we create the all zero bootSector if nessessary;
 	struct FS_Buffer * gosBootSector, *gosSuperBlock, *gosRootDir;
@@ -2113,7 +4550,7 @@ static int GOSFS_Format(struct Block_Device * blockDev)
 	struct GOSFS_Dir_Entry *rootEntry;
 	
 	// first check if it is a formatted gosfs
-	if ((rc = Get_FS_Buffer(gosfsBufferCache, GOSFS_SUPER_BLOCK_NUM, &gosSuperBlock) )< 0)
+	if ((rc = Get_FS_Buffer(cache, GOSFS_SUPER_BLOCK_NUM, &gosSuperBlock) )< 0)
 		return rc;
 
 	gosSB = (struct GOSFS_Superblock *)(gosSuperBlock->data);
@@ -2122,23 +4559,50 @@ static int GOSFS_Format(struct Block_Device * blockDev)
 	if(gosInstance->magic != GOSFS_MAGIC || 1) // if the fs is unformatted
 	{
 		// Initialize bootSector
-		if ((rc = Get_FS_Buffer(gosfsBufferCache, 0, &gosBootSector)) < 0)
+		if ((rc = Get_FS_Buffer(cache, 0, &gosBootSector)) < 0)
 			return rc; // now we've read the num 0 block into mem
 
 		Init_GOSFS_BootSector(gosBootSector);
-		Modify_FS_Buffer(gosfsBufferCache, gosBootSector);
-		Sync_FS_Buffer(gosfsBufferCache, gosBootSector);
-		Release_FS_Buffer(gosfsBufferCache, gosBootSector);
+		Modify_FS_Buffer(cache, gosBootSector);
+		Sync_FS_Buffer(cache, gosBootSector);
+		Release_FS_Buffer(cache, gosBootSector);
 
 
-		// Initialize SuperBlock
-		Init_GOSFS_Instance(gosInstance, gosSuperBlock, dev);
-		Modify_FS_Buffer(gosfsBufferCache, gosSuperBlock);
-		Sync_FS_Buffer(gosfsBufferCache, gosSuperBlock);
-		Release_FS_Buffer(gosfsBufferCache, gosSuperBlock);
+		// Initialize SuperBlock: the layout follows from the size of the disk
+		rc = Init_GOSFS_Instance(gosInstance, dev);
+		if(rc == 0 && (features & GOSFS_FEATURE_JOURNAL)
+			&& gosInstance->numDataBlocks < GOSFS_JOURNAL_BLOCKS + GOSFS_MIN_DATA_BLOCKS)
+			rc = ENOSPACE;
+		if(rc < 0)
+		{
+			Release_FS_Buffer(cache, gosSuperBlock);
+			return rc;
+		}
+		gosInstance->features = features;
+		Print("	%lu blocks, %u inodes, data from block %lu\n", gosInstance->numLogicBlocks,
+			gosInstance->numInodes, gosInstance->firstDataBlock);
+
+		// Inodes 0 and 1 (the root) are used; the journal takes the first data blocks
+		rc = Bitmap_Format(cache, gosInstance->inodeBitmapStart, gosInstance->inodeBitmapBlocks, GOSFS_ROOT_INODE_NUM + 1);
+		if(rc == 0 && (features & GOSFS_FEATURE_JOURNAL))
+		{
+			gosInstance->journalStart = gosInstance->firstDataBlock;
+			gosInstance->journalBlocks = GOSFS_JOURNAL_BLOCKS;
+			rc = Journal_Create(dev, gosInstance->journalStart, gosInstance->journalBlocks);
+		}
+		if(rc == 0)
+			rc = Bitmap_Format(cache, gosInstance->blockBitmapStart, gosInstance->blockBitmapBlocks, gosInstance->journalBlocks);
+		if(rc < 0)
+		{
+			Release_FS_Buffer(cache, gosSuperBlock);
+			return rc;
+		}
+		Modify_FS_Buffer(cache, gosSuperBlock);
+		Sync_FS_Buffer(cache, gosSuperBlock);
+		Release_FS_Buffer(cache, gosSuperBlock);
 
 		// Initialize the first and second inode(in fact only the second inode is used, so...)
-		if ((rc = Get_FS_Buffer(gosfsBufferCache, 2, &gosRootDir)) < 0)
+		if ((rc = Get_FS_Buffer(cache, gosInstance->inodeTableStart, &gosRootDir)) < 0)
 			return rc;
 		rootDir = (struct GOSFS_Dir_Block *)(gosRootDir->data);
 		rootEntry = &(rootDir->entryTable[1]);
@@ -2146,77 +4610,205 @@ static int GOSFS_Format(struct Block_Device * blockDev)
 		Print("	%x, %x\n", (int)&rootDir->entryTable, (int)&rootDir->entryTable[0]);
 		Print("	%x\n", (int)&rootDir->entryTable[1]);
 		Init_GOSFS_Rootdir(&rootDir->entryTable[1]); //this is the root Dir
+		if(features & GOSFS_FEATURE_HASHED_DIRS)
+			rootDir->entryTable[1].flags |= GOSFS_DIRENTRY_HASHED;
+		if((features & GOSFS_FEATURE_HASHED_DIRS) && (features & GOSFS_FEATURE_EXTENTS))
+			rootDir->entryTable[1].flags |= GOSFS_DIRENTRY_EXTENTS;
 		Print("	root:%s\n", rootDir->entryTable[1].filename);
 		Print("	root size:%d\n", (int)rootDir->entryTable[1].size);
-		Modify_FS_Buffer(gosfsBufferCache, gosRootDir);
-		Sync_FS_Buffer(gosfsBufferCache, gosRootDir);
-		Release_FS_Buffer(gosfsBufferCache, gosRootDir);
+		Modify_FS_Buffer(cache, gosRootDir);
+		Sync_FS_Buffer(cache, gosRootDir);
+		Release_FS_Buffer(cache, gosRootDir);
 
 		//ERROR: nitialize the first block
-		//if((rc = Get_FS_Buffer(gosfsBufferCache, GOSFS_FIRST_DATA_BLOCK, &gosRootBlock)) < 0)
+		//if((rc = Get_FS_Buffer(cache, GOSFS_FIRST_DATA_BLOCK, &gosRootBlock)) < 0)
 		//	return rc;
 		//rootBlock = (struct GOSFS_Dir_Block *)(gosRootBlock->data);
 		//Init_Directory_Block(rootBlock);
-		//Modify_FS_Buffer(gosfsBufferCache, gosRootBlock);
-		//Sync_FS_Buffer(gosfsBufferCache, gosRootBlock);
-		//Release_FS_Buffer(gosfsBufferCache, gosRootBlock);
+		//Modify_FS_Buffer(cache, gosRootBlock);
+		//Sync_FS_Buffer(cache, gosRootBlock);
+		//Release_FS_Buffer(cache, gosRootBlock);
 	}
 	else
-		Release_FS_Buffer(gosfsBufferCache, gosSuperBlock);
+		Release_FS_Buffer(cache, gosSuperBlock);
 
 	// it's been formatted
 	return rc;	
 }
 
+// Write the first block as all '0's--this is the bootSector
+// Initialize the FS_Buffer_Cache structure
+// get a FS_Buffer, and write the superBlock in to this Buffer
+// write SuperBlock back to disk
+// Initialize the first inode--root Dir
+// return 0 if successfull
+// options is a comma separated list:
+//	hdir	directories use the hashed format
+//	extents	files are mapped by extents
+//	journal	metadata updates go through a journal
+//	inline	small files keep their data in the inode
+static int GOSFS_Format(struct Block_Device * blockDev, const char *options)
+{
+	// first we create a Buffer Cache for GOSFS;
+	struct Block_Device* dev = blockDev;
+	struct FS_Buffer_Cache *cache;
+	uint_t fsBlockSize = GOSFS_FS_BLOCK_SIZE;
+	ulong_t features = 0;
+	const char *opt;
+	int optLen;
+	int rc = 0;
+
+	for(opt = options; *opt != '\0'; opt += optLen)
+	{
+		while(*opt == ',') opt++;
+		for(optLen = 0; opt[optLen] != '\0' && opt[optLen] != ','; optLen++)
+			;
+		if(optLen == 0)
+			continue;
+		if(optLen == 4 && strncmp(opt, "hdir", 4) == 0)
+			features |= GOSFS_FEATURE_HASHED_DIRS;
+		else if(optLen == 7 && strncmp(opt, "extents", 7) == 0)
+			features |= GOSFS_FEATURE_EXTENTS;
+		else if(optLen == 7 && strncmp(opt, "journal", 7) == 0)
+			features |= GOSFS_FEATURE_JOURNAL;
+		else if(optLen == 6 && strncmp(opt, "inline", 6) == 0)
+			features |= GOSFS_FEATURE_INLINE_DATA;
+		else
+		{
+			Print("gosfs: unknown format option\n");
+			return EINVALID;
+		}
+	}
+
+	// a cache of its own, synced and gone when we are done; the device
+	// can't be mounted meanwhile, and a mount reads it through a new one
+	cache = Create_FS_Buffer_Cache(dev, fsBlockSize);
+	if(cache == 0)
+		return ENOMEM;
+	rc = Do_Format(cache, features);
+	if(Destroy_FS_Buffer_Cache(cache) < 0 && rc == 0)
+		rc = EIO;
+
+	return rc;
+}
+
 // Initialize structures needed for GOSFS; including VNode list, Mount_Point, GOSFS_Superblock,
 // 	currentDir, etc.
+// Every volume gets a GOSFS_Superblock, buffer cache and reclaim thread of
+// its own, so several GOSFS volumes can be mounted side by side.
 static int GOSFS_Mount(struct Mount_Point *mountPoint)
 {
 	//first, read the superBlock-on disk into mem
 	Print("start Mounting gosfs.\n");
 	struct FS_Buffer * gosfsInstance;
 	struct GOSFS_Inode *rootDirInode;
-	struct File* rootDirVNode;
-	struct GOSFS_Dir_Entry *rootEntry;
+	int rc;
 	// struct GOSFS_Dir_Entry *dirEntry;
-	
-	Print("fetching superblock.\n");
-	int rc = Get_FS_Buffer(gosfsBufferCache, 1, &gosfsInstance);
-	if(rc < 0) return rc;
+
 	Print(" allocating superblock in mem.\n");
 	struct GOSFS_Superblock * gosfsSuperBlock = (struct GOSFS_Superblock *)Malloc(sizeof(struct GOSFS_Superblock));
 	if(gosfsSuperBlock == NULL)
 		return ENOMEM;
+	// the caches, the journal and the cursors all start out empty
+	memset(gosfsSuperBlock, '\0', sizeof(struct GOSFS_Superblock));
+	Mutex_Init(&(gosfsSuperBlock->lock));
+	Cond_Init(&(gosfsSuperBlock->cond));
+	Mutex_Init(&gosfsSuperBlock->journal.lock);
+	Cond_Init(&gosfsSuperBlock->journal.cond);
+	Mutex_Init(&gosfsSuperBlock->dcacheLock);
+	Clear_GOSFS_Dentry_List(&gosfsSuperBlock->dcacheLRU);
+	Mutex_Init(&gosfsSuperBlock->icacheLock);
+	Clear_GOSFS_Inode_List(&gosfsSuperBlock->icacheUnused);
+	Cond_Init(&gosfsSuperBlock->reclaimCond);
+	gosfsSuperBlock->mountPoint = mountPoint;
+	mountPoint->fsData = gosfsSuperBlock;
+
+	gosfsSuperBlock->cache = Create_FS_Buffer_Cache(mountPoint->dev, GOSFS_FS_BLOCK_SIZE);
+	if(gosfsSuperBlock->cache == 0) { rc = ENOMEM; goto failed; }
+
+	Print("fetching superblock.\n");
+	rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), GOSFS_SUPER_BLOCK_NUM, &gosfsInstance);
+	if(rc < 0) goto failed;
 	// get GOSFS_Instance
 	Print("	building GOSFS_Superblock.\n");
 	memcpy( &(gosfsSuperBlock->gfsInstance), (struct GOSFS_Instance *)(gosfsInstance->data), sizeof(struct GOSFS_Instance));
+	Release_FS_Buffer(GOSFS_CACHE(mountPoint), gosfsInstance);
 	Print("	gfsInstance->magic: %x\n", (int)(gosfsSuperBlock->gfsInstance.magic));
-	// finish the initialization of the rest of GOSFS_Superblock
-	gosfsSuperBlock->flags = 0;
-	gosfsSuperBlock->dirty = 0;
-	Mutex_Init(&(gosfsSuperBlock->lock));
-	Cond_Init(&(gosfsSuperBlock->cond));
-	Release_FS_Buffer(gosfsBufferCache, gosfsInstance);
+	if(gosfsSuperBlock->gfsInstance.magic != GOSFS_MAGIC)
+	{
+		// not GOSFS, or an older layout: it has to be formatted again
+		rc = EINVALID;
+		goto failed;
+	}
+
+	// finish what was committed to the journal before anything is read;
+	// that may include the superblock itself
+	if(gosfsSuperBlock->gfsInstance.features & GOSFS_FEATURE_JOURNAL)
+	{
+		rc = Journal_Load(mountPoint, gosfsSuperBlock->gfsInstance.journalStart, gosfsSuperBlock->gfsInstance.journalBlocks);
+		if(rc == 0)
+			rc = Get_FS_Buffer(GOSFS_CACHE(mountPoint), GOSFS_SUPER_BLOCK_NUM, &gosfsInstance);
+		if(rc < 0) goto failed;
+		memcpy(&gosfsSuperBlock->gfsInstance, gosfsInstance->data, sizeof(struct GOSFS_Instance));
+		Release_FS_Buffer(GOSFS_CACHE(mountPoint), gosfsInstance);
+	}
+
+	// the free counts are not on disk, so they can't disagree with the bitmaps
+	rc = Bitmap_Count(mountPoint, gosfsSuperBlock->gfsInstance.inodeBitmapStart, gosfsSuperBlock->gfsInstance.numInodes,
+		&gosfsSuperBlock->inodeFree);
+	if(rc == 0)
+		rc = Bitmap_Count(mountPoint, gosfsSuperBlock->gfsInstance.blockBitmapStart,
+			gosfsSuperBlock->gfsInstance.numDataBlocks, &gosfsSuperBlock->blockFree);
+	if(rc < 0) goto failed;
+	Print("	%d of %d blocks free, %d of %d inodes\n", (int)gosfsSuperBlock->blockFree.free,
+		(int)gosfsSuperBlock->gfsInstance.numDataBlocks, (int)gosfsSuperBlock->inodeFree.free,
+		(int)gosfsSuperBlock->gfsInstance.numInodes);
 
-	// second, initialize VNodeList
-	Init_VNode_List();
+	// every path walk starts at the root, so keep it in the inode cache;
+	// this reference is never dropped
+	rc = Iget(mountPoint, GOSFS_ROOT_INODE_NUM, &rootDirInode);
+	if(rc < 0) goto failed;
+	Print("root inode:%x\n", (int)rootDirInode);
 
 	// init part of the mountPoint
-	mountPoint->fsData = gosfsSuperBlock;
 	mountPoint->ops = &s_gosfsMountPointOps;
 
-	// init the rootDirVNode;
-	Get_Exist_Inode(GOSFS_ROOT_INODE_NUM, &rootEntry);
-	rootDirInode = Init_GOSFS_Inode(rootEntry, GOSFS_ROOT_INODE_NUM);
-	rootDirVNode = Allocate_File(&s_gosfsDirOps, 0, 0, rootDirInode, 0, mountPoint);
-	Print("root ops:(%x)\n", (int)rootDirVNode);
-	Print("read entry:%x\n", (int)rootDirVNode->ops->Read_Entry);
-	Print("close:%x\n", (int)rootDirVNode->ops->Close);
-	Add_To_Back_Of_VNode_List(&vnodeList, rootDirVNode);	
-
-	// init the standard input/output file
-	Init_Stdio();
-	
+	// one flusher syncs every mounted volume
+	Mutex_Lock(&s_volumeLock);
+	if(Is_GOSFS_Superblock_List_Empty(&s_volumeList))
+		Start_Kernel_Thread(GOSFS_Flusher, 0, PRIORITY_NORMAL, true);
+	Add_To_Back_Of_GOSFS_Superblock_List(&s_volumeList, gosfsSuperBlock);
+	Mutex_Unlock(&s_volumeLock);
+
+	// files deleted before a crash still have their blocks;
+	// the reclaim thread sees them as soon as it starts
+	if(gosfsSuperBlock->gfsInstance.numOrphans > 0)
+		Print("	%d deleted files to reclaim\n", (int)gosfsSuperBlock->gfsInstance.numOrphans);
+	Start_Kernel_Thread(GOSFS_Reclaimer, (ulong_t)mountPoint, PRIORITY_LOW, true);
+
+	// the standard input/output files are shared by all volumes
+	if(stdIn == 0)
+	{
+		// second, initialize VNodeList
+		Init_VNode_List();
+		// init the standard input/output file
+		Init_Stdio();
+	}
+
+	return 0;
+
+failed:
+	// nothing else has seen the volume yet
+	if(gosfsSuperBlock->cache != 0)
+		Destroy_FS_Buffer_Cache(gosfsSuperBlock->cache);
+	if(gosfsSuperBlock->journal.page != 0)
+		Free_Page(gosfsSuperBlock->journal.page);
+	if(gosfsSuperBlock->inodeFree.groupFree != 0)
+		Free(gosfsSuperBlock->inodeFree.groupFree);
+	if(gosfsSuperBlock->blockFree.groupFree != 0)
+		Free(gosfsSuperBlock->blockFree.groupFree);
+	Free(gosfsSuperBlock);
+	mountPoint->fsData = 0;
 	return rc;
 }
 
@@ -2231,6 +4823,9 @@ static struct Filesystem_Ops s_gosfsFilesystemOps = {
 
 void Init_GOSFS(void)
 {
+    Mutex_Init(&s_volumeLock);
+    Clear_GOSFS_Superblock_List(&s_volumeList);
+    Tlocal_Create(&s_journalCreditsKey, 0);
     Register_Filesystem("gosfs", &s_gosfsFilesystemOps);
 }
 
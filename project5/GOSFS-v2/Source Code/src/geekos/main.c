@@ -83,19 +83,24 @@ void Main(struct Boot_Info* bootInfo)
     Print("Welcome to GeekOS!\n");
     Set_Current_Attr(ATTRIB(BLACK, GRAY));
 
-	// for testing gosfs
-	int rc = Format("ide1", "gosfs");
-	if(rc == 0)
+	// for testing gosfs; ide1 may come populated (see buildGosfs),
+	// so it is only formatted if it doesn't hold a GOSFS volume
+	int rc = Mount("ide1", "d", "gosfs");
+	if(rc != 0)
 	{
-		Print("format ide1 with gosfs.\n");
-		rc = Mount("ide1", "d", "gosfs");
+		rc = Format("ide1", "gosfs");
 		if(rc == 0)
-			Print("gosfs mounted.\n");
+		{
+			Print("format ide1 with gosfs.\n");
+			rc = Mount("ide1", "d", "gosfs");
+		}
 		else
-			Print("gosfs Failed Mounting: %d\n", rc);
+			Print("gosfs formatted failed: %d\n", rc);
 	}
+	if(rc == 0)
+		Print("gosfs mounted.\n");
 	else
-		Print("gosfs formatted failed: %d\n", rc);
+		Print("gosfs Failed Mounting: %d\n", rc);
 /*
 	rc = Create_Directory("/d/a");
 	if(rc != 0)
@@ -107,7 +107,7 @@ static int PFAT_FStat(struct File *file, struct VFS_File_Stat *stat)
 /*
  * Read function for PFAT files.
  */
-static int PFAT_Read(struct File *file, void *buf, ulong_t numBytes)
+static int PFAT_Read(struct File *file, struct VFS_Buffer *buf, ulong_t numBytes)
 {
     struct PFAT_File *pfatFile = (struct PFAT_File*) file->fsData;
     struct PFAT_Instance *instance = (struct PFAT_Instance*) file->mountPoint->fsData;
@@ -180,7 +180,8 @@ static int PFAT_Read(struct File *file, void *buf, ulong_t numBytes)
      * All cached data we need is up to date,
      * so just copy it into the caller's buffer.
      */
-    memcpy(buf, pfatFile->fileDataCache + start, numBytes);
+    if (!VFS_Copy_Out(buf, 0, pfatFile->fileDataCache + start, numBytes))
+	return EINVALID;
 
     Debug("Read satisfied!\n");
 
@@ -190,7 +191,7 @@ static int PFAT_Read(struct File *file, void *buf, ulong_t numBytes)
 /*
  * Write function for PFAT files.
  */
-static int PFAT_Write(struct File *file, void *buf, ulong_t numBytes)
+static int PFAT_Write(struct File *file, struct VFS_Buffer *buf, ulong_t numBytes)
 {
     /* Read only fs: writes not allowed */
     return EACCESS;
@@ -253,6 +254,9 @@ static struct File_Ops s_pfatFileOps = {
     &PFAT_Seek,
     &PFAT_Close,
     0, /* Read_Entry */
+    0, /* Read_Entries */
+    0, /* Copy_Range */
+    0, /* Sync */
 };
 
 static int PFAT_FStat_Dir(struct File *dir, struct VFS_File_Stat *stat)
@@ -308,6 +312,9 @@ static struct File_Ops s_pfatDirOps = {
     0, /* Seek */
     &PFAT_Close_Dir,
     &PFAT_Read_Entry,
+    0, /* Read_Entries */
+    0, /* Copy_Range */
+    0, /* Sync */
 };
 
 /*
@@ -540,7 +547,8 @@ struct Mount_Point_Ops s_pfatMountPointOps = {
     PFAT_Open_Directory,
     PFAT_Stat,
     PFAT_Sync,
-    0                          /* Delete */
+    0,                         /* Delete */
+    0                          /* StatFS */
 };
 
 /*
@@ -103,13 +103,21 @@ int Read_Line(char* buf, ulong_t bufSize)
 
 
 // Read from keyboard, at most len characters
-static int StdInput_Read(struct File *file, void *buf, ulong_t len)
+static int StdInput_Read(struct File *file, struct VFS_Buffer *buf, ulong_t len)
 {
 	struct GOSFS_Inode *stdioINode = (struct GOSFS_Inode *)file->fsData;
-	Mutex_Lock(&stdioINode->lock);
-	int ret =  Read_Line(buf, len);
-	Mutex_Unlock(&stdioINode->lock);
-
+	// the line is echoed as it is typed, so it is put together here
+	char *line = (char *)Malloc(len + 1);
+	if(line == NULL)
+		return ENOMEM;
+
+	RW_Write_Lock(&stdioINode->lock);
+	int ret =  Read_Line(line, len);
+	RW_Write_Unlock(&stdioINode->lock);
+
+	if(!VFS_Copy_Out(buf, 0, line, ret))
+		ret = EINVALID;
+	Free(line);
 	return ret;
 }
 
@@ -121,40 +129,38 @@ struct File_Ops s_stdInputFileOps = {
     0, // Seek,
     0, // Close,
     0, /* Read_Entry */
+    0, /* Read_Entries */
+    0, /* Copy_Range */
+    0, /* Sync */
 };
 
 
 // simply print all the characters in the buffer out to the screen
-static int StdOutput_Write(struct File *file, void *buf, ulong_t len)
+static int StdOutput_Write(struct File *file, struct VFS_Buffer *buf, ulong_t len)
 {
 	struct GOSFS_Inode *stdioINode = (struct GOSFS_Inode *)file->fsData;
-	Mutex_Lock(&stdioINode->lock);
+	RW_Write_Lock(&stdioINode->lock);
 
-	int buflen = len;
-	char *bufend = strchr(buf, '\0');
+	int buflen;
 	char *output = (char *)Malloc(len + 1);
 	if(output == NULL){ 
 		buflen = ENOMEM;
 		goto done;
 	}
 	
-	if(bufend == 0)
-	{	
-		memcpy(output, buf, len);
-		output[len] = '\0';
-	}
+	// only what comes before a '\0' is printed
+	if(!VFS_Copy_In(output, buf, 0, len))
+		buflen = EINVALID;
 	else
 	{
-		buflen = (int)(bufend-(char *)buf);
-		memcpy(output, buf, buflen);
-		output[buflen] = '\0';
+		output[len] = '\0';
+		buflen = strlen(output);
+		Print("%s", output);
 	}
-
-	Print("%s", output);
 	Free(output);
 
 done:
-	Mutex_Unlock(&stdioINode->lock);
+	RW_Write_Unlock(&stdioINode->lock);
 	return buflen;
 }
 
@@ -165,6 +171,9 @@ struct File_Ops s_stdOutputFileOps = {
     0, // Seek,
     0, // Close,
     0, /* Read_Entry */
+    0, /* Read_Entries */
+    0, /* Copy_Range */
+    0, /* Sync */
 };
 
 struct File* Init_StdIn()
@@ -177,7 +186,8 @@ struct File* Init_StdIn()
 		return NULL;
 	//strcpy(stdioINode->name, "stdin");
 	stdioINode->inodeNumber = -1;
-	Mutex_Init(&stdioINode->lock);
+	stdioINode->mountPoint = 0;
+	RW_Lock_Init(&stdioINode->lock);
 	stdIn = Allocate_File(&s_stdInputFileOps, 0, 0, stdioINode, 0, 0);
 
 	return stdIn;
@@ -193,7 +203,8 @@ struct File* Init_Stdout()
 		return NULL;
 	//strcpy(stdioINode->name, "stdout");
 	stdioINode->inodeNumber = -1;
-	Mutex_Init(&stdioINode->lock);
+	stdioINode->mountPoint = 0;
+	RW_Lock_Init(&stdioINode->lock);
 	stdOut = Allocate_File(&s_stdOutputFileOps, 0, 0, stdioINode, 0, 0);
 
 	return stdOut;
@@ -204,3 +204,93 @@ void Cond_Broadcast(struct Condition* cond)
     Wake_Up(&cond->waitQueue);
     Enable_Interrupts();  /* resume scheduling */
 }
+
+/*
+ * Initialize given reader/writer lock.
+ */
+void RW_Lock_Init(struct RW_Lock* rwLock)
+{
+    Mutex_Init(&rwLock->mutex);
+    Cond_Init(&rwLock->readCond);
+    Cond_Init(&rwLock->writeCond);
+    rwLock->readers = 0;
+    rwLock->readersWaiting = 0;
+    rwLock->writersWaiting = 0;
+    rwLock->admit = 0;
+    rwLock->writer = 0;
+}
+
+/*
+ * Lock given reader/writer lock shared.
+ * Writers are preferred: a reader that arrives while a writer is
+ * waiting waits too, until that writer is done.  Releasing the lock
+ * exclusively lets in every reader waiting at that point, before
+ * the next writer, so neither side can starve.
+ */
+void RW_Read_Lock(struct RW_Lock* rwLock)
+{
+    Mutex_Lock(&rwLock->mutex);
+    KASSERT(rwLock->writer != g_currentThread);
+
+    rwLock->readersWaiting++;
+    while (rwLock->writer != 0 || (rwLock->writersWaiting > 0 && rwLock->admit == 0))
+	Cond_Wait(&rwLock->readCond, &rwLock->mutex);
+    rwLock->readersWaiting--;
+    if (rwLock->admit > 0)
+	rwLock->admit--;
+    rwLock->readers++;
+
+    Mutex_Unlock(&rwLock->mutex);
+}
+
+/*
+ * Release given reader/writer lock, held shared.
+ */
+void RW_Read_Unlock(struct RW_Lock* rwLock)
+{
+    Mutex_Lock(&rwLock->mutex);
+    KASSERT(rwLock->readers > 0);
+
+    /* The last reader out lets a writer in. */
+    if (--rwLock->readers == 0 && rwLock->writersWaiting > 0)
+	Cond_Signal(&rwLock->writeCond);
+
+    Mutex_Unlock(&rwLock->mutex);
+}
+
+/*
+ * Lock given reader/writer lock exclusively.
+ */
+void RW_Write_Lock(struct RW_Lock* rwLock)
+{
+    Mutex_Lock(&rwLock->mutex);
+    KASSERT(rwLock->writer != g_currentThread);
+
+    /* Readers let in ahead of us have to get in and out first. */
+    rwLock->writersWaiting++;
+    while (rwLock->writer != 0 || rwLock->readers > 0 || rwLock->admit > 0)
+	Cond_Wait(&rwLock->writeCond, &rwLock->mutex);
+    rwLock->writersWaiting--;
+    rwLock->writer = g_currentThread;
+
+    Mutex_Unlock(&rwLock->mutex);
+}
+
+/*
+ * Release given reader/writer lock, held exclusively.
+ */
+void RW_Write_Unlock(struct RW_Lock* rwLock)
+{
+    Mutex_Lock(&rwLock->mutex);
+    KASSERT(rwLock->writer == g_currentThread);
+
+    rwLock->writer = 0;
+    if (rwLock->readersWaiting > 0) {
+	rwLock->admit = rwLock->readersWaiting;
+	Cond_Broadcast(&rwLock->readCond);
+    } else if (rwLock->writersWaiting > 0) {
+	Cond_Signal(&rwLock->writeCond);
+    }
+
+    Mutex_Unlock(&rwLock->mutex);
+}
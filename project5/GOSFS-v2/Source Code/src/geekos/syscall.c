@@ -464,23 +464,12 @@ static int Sys_Read(struct Interrupt_State *state)
 	if(file == 0) return EINVALID;
 
 	int rc = 0;
-	char * buf = (char *)Malloc(state->edx);
-	if(buf == NULL)	{ rc = ENOMEM; goto done;}
 
+	// the filesystem copies straight into the user buffer
 	Enable_Interrupts();	
-	rc = Read(file, buf, (ulong_t)state->edx);
+	rc = Read_User(file, (ulong_t)state->ecx, (ulong_t)state->edx);
 	Disable_Interrupts();
-	//Print("sys_read:%s\n", buf);
-	if(rc < 0) goto done;
-	//Print("sys read buf:%s\n", buf);	
-
-	if(!Copy_To_User((ulong_t)state->ecx, buf, (ulong_t)rc))
-		rc = EUNSPECIFIED;
 
-
-done:
-	if(buf != NULL)
-		Free(buf);
 	return rc;
 }
 
@@ -537,21 +526,12 @@ static int Sys_Write(struct Interrupt_State *state)
 	if(file == 0) return EINVALID;
 	int rc = 0;
 	
-	void *buf = Malloc((ulong_t)state->edx);
-	if(buf == NULL){ rc = ENOMEM; goto done;}
-	if(!Copy_From_User(buf, (ulong_t)state->ecx, (ulong_t)state->edx))
-		rc = EUNSPECIFIED;	
-	//Print("sys write: %s\n", (char*)buf);
+	// the filesystem copies straight from the user buffer
 	Enable_Interrupts();
 	//Print("sys write thread:%x,file:%x\n", (int)g_currentThread,(int)file);	
-	rc = Write(file, buf, (ulong_t)state->edx);
+	rc = Write_User(file, (ulong_t)state->ecx, (ulong_t)state->edx);
 	Disable_Interrupts();
-	if(rc < 0) goto done;
-
 
-done:
-	if(buf != NULL)
-		Free(buf);
 	return rc;
 }
 
@@ -750,6 +730,210 @@ done:
 	return rc;
 }
 
+/*
+ * Read from an open file at a given offset; the file position
+ * is left where it was.
+ * Params:
+ *   state->ebx - file descriptor to read from
+ *   state->ecx - user address of buffer to read into
+ *   state->edx - number of bytes to read
+ *   state->esi - offset in the file to read from
+ *
+ * Returns: number of bytes read, or error code (< 0) on error
+ */
+static int Sys_PRead(struct Interrupt_State *state)
+{
+	if(state->ebx >= USER_MAX_FILES) return EUNSUPPORTED;
+	struct File *file = g_currentThread->userContext->fileList[state->ebx];
+	if(file == 0) return EINVALID;
+
+	Enable_Interrupts();
+	int rc = PRead_User(file, (ulong_t)state->ecx, (ulong_t)state->edx, (ulong_t)state->esi);
+	Disable_Interrupts();
+
+	return rc;
+}
+
+/*
+ * Write to an open file at a given offset; the file position
+ * is left where it was.
+ * Params:
+ *   state->ebx - file descriptor to write to
+ *   state->ecx - user address of buffer get data to write from
+ *   state->edx - number of bytes to write
+ *   state->esi - offset in the file to write to
+ *
+ * Returns: number of bytes written, or error code (< 0) on error
+ */
+static int Sys_PWrite(struct Interrupt_State *state)
+{
+	if(state->ebx >= USER_MAX_FILES) return EUNSUPPORTED;
+	struct File *file = g_currentThread->userContext->fileList[state->ebx];
+	if(file == 0) return EINVALID;
+
+	Enable_Interrupts();
+	int rc = PWrite_User(file, (ulong_t)state->ecx, (ulong_t)state->edx, (ulong_t)state->esi);
+	Disable_Interrupts();
+
+	return rc;
+}
+
+/*
+ * Read or write an open file through a vector of user buffers.
+ * Params:
+ *   state->ebx - file descriptor
+ *   state->ecx - user address of array of struct VFS_IO_Vector
+ *   state->edx - number of elements in the array
+ *
+ * Returns: number of bytes transferred, or error code (< 0) on error
+ */
+static int Vector_IO(struct Interrupt_State *state, bool write)
+{
+	struct VFS_IO_Vector vec[VFS_MAX_IO_VECTORS];
+	int count = (int)state->edx;
+	int rc;
+
+	if(state->ebx >= USER_MAX_FILES) return EUNSUPPORTED;
+	struct File *file = g_currentThread->userContext->fileList[state->ebx];
+	if(file == 0) return EINVALID;
+	if(count < 0 || count > VFS_MAX_IO_VECTORS) return EINVALID;
+
+	// only the vector itself is copied; the data goes straight to its buffers
+	if(!Copy_From_User(vec, (ulong_t)state->ecx, count * sizeof(struct VFS_IO_Vector)))
+		return EUNSPECIFIED;
+
+	Enable_Interrupts();
+	rc = write ? WriteV_User(file, vec, count) : ReadV_User(file, vec, count);
+	Disable_Interrupts();
+
+	return rc;
+}
+
+static int Sys_ReadV(struct Interrupt_State *state)
+{
+	return Vector_IO(state, false);
+}
+
+static int Sys_WriteV(struct Interrupt_State *state)
+{
+	return Vector_IO(state, true);
+}
+
+/*
+ * Read several directory entries from an open directory handle.
+ * Params:
+ *   state->ebx - file descriptor of the directory
+ *   state->ecx - user address of array of struct VFS_Dir_Entry to copy entries into
+ *   state->edx - number of elements in the array
+ * Returns: number of entries read, 0 if there are no more,
+ *   or error code (< 0) if unsuccessful
+ */
+static int Sys_ReadEntries(struct Interrupt_State *state)
+{
+	if(state->ebx >= USER_MAX_FILES) return EUNSUPPORTED;
+	struct File *file = g_currentThread->userContext->fileList[state->ebx];
+	if(file == 0) return EINVALID;
+
+	// entries go straight to the user array, no kernel copy of it
+	Enable_Interrupts();
+	int rc = Read_Entries_User(file, (ulong_t)state->ecx, (int)state->edx);
+	Disable_Interrupts();
+
+	return rc;
+}
+
+/*
+ * Get size and free space of a filesystem.
+ * Params:
+ *   state->ebx - address of user string containing a path on the filesystem
+ *   state->ecx - length of path
+ *   state->edx - user address of struct VFS_FS_Stat object to store them in
+ *
+ * Returns: 0 if successful, error code (< 0) if unsuccessful
+ */
+static int Sys_StatFS(struct Interrupt_State *state)
+{
+	uint_t pathLen = state->ecx;
+	if(pathLen > (VFS_MAX_PATH_LEN + 1))
+		return ENAMETOOLONG;
+
+	struct VFS_FS_Stat fsStat;
+	int rc = 0;
+	char *path = (char *)Malloc(pathLen + 1);
+	if(path == NULL)
+		return ENOMEM;
+
+	if(!Copy_From_User(path, (ulong_t)state->ebx, (ulong_t)pathLen))
+	{	rc = EUNSPECIFIED; goto done;}
+	path[pathLen] = '\0';
+
+	Enable_Interrupts();
+	rc = StatFS(path, &fsStat);
+	Disable_Interrupts();
+	if(rc < 0) goto done;
+
+	if(!Copy_To_User((ulong_t)state->edx, &fsStat, (ulong_t)sizeof(struct VFS_FS_Stat)))
+		rc = EUNSPECIFIED;
+
+done:
+	Free(path);
+	return rc;
+}
+
+/*
+ * Copy data from the current position of one open file to that of
+ * another, without it passing through user memory.
+ * Params:
+ *   state->ebx - file descriptor to copy from
+ *   state->ecx - file descriptor to copy to
+ *   state->edx - number of bytes to copy
+ * Returns: number of bytes copied, 0 at the end of the source,
+ *   or error code (< 0) if unsuccessful
+ */
+static int Sys_CopyFileRange(struct Interrupt_State *state)
+{
+	if(state->ebx >= USER_MAX_FILES || state->ecx >= USER_MAX_FILES) return EUNSUPPORTED;
+	struct File *src = g_currentThread->userContext->fileList[state->ebx];
+	struct File *dst = g_currentThread->userContext->fileList[state->ecx];
+	if(src == 0 || dst == 0) return EINVALID;
+
+	Enable_Interrupts();
+	int rc = Copy_File_Range(src, dst, (ulong_t)state->edx);
+	Disable_Interrupts();
+
+	return rc;
+}
+
+/*
+ * Write one open file to disk.
+ * Params:
+ *   state->ebx - file descriptor
+ *   dataOnly - skip metadata not needed to read the data back
+ * Returns: 0 if successful, error code (< 0) if unsuccessful
+ */
+static int File_Sync(struct Interrupt_State *state, bool dataOnly)
+{
+	if(state->ebx >= USER_MAX_FILES) return EUNSUPPORTED;
+	struct File *file = g_currentThread->userContext->fileList[state->ebx];
+	if(file == 0) return EINVALID;
+
+	Enable_Interrupts();
+	int rc = dataOnly ? FDataSync(file) : FSync(file);
+	Disable_Interrupts();
+
+	return rc;
+}
+
+static int Sys_FSync(struct Interrupt_State *state)
+{
+	return File_Sync(state, false);
+}
+
+static int Sys_FDataSync(struct Interrupt_State *state)
+{
+	return File_Sync(state, true);
+}
+
 
 /*
  * Global table of system call handler functions.
@@ -787,6 +971,15 @@ const Syscall g_syscallTable[] = {
     Sys_CreateDir,
     Sys_Sync,
     Sys_Format,
+    Sys_PRead,
+    Sys_PWrite,
+    Sys_ReadV,
+    Sys_WriteV,
+    Sys_ReadEntries,
+    Sys_StatFS,
+    Sys_CopyFileRange,
+    Sys_FSync,
+    Sys_FDataSync,
 };
 
 /*
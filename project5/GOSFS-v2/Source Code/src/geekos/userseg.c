@@ -312,6 +312,25 @@ bool Copy_To_User(ulong_t destInUser, void* srcInKernel, ulong_t bufSize)
 	return true;
 }
 
+/*
+ * Get the kernel address of a user buffer, so the kernel
+ * can use it in place rather than copy it.
+ * Params:
+ * userAddr - address of user buffer
+ * bufSize - its size
+ *
+ * Returns:
+ *   the kernel address, or 0 if the user buffer is invalid
+ */
+void *User_To_Kernel(ulong_t userAddr, ulong_t bufSize)
+{
+	if(!Validate_User_Memory(g_currentThread->userContext, userAddr, bufSize))
+		return 0;
+
+	// the process's memory is one piece, mapped into the kernel as it is
+	return g_currentThread->userContext->memory + userAddr;
+}
+
 /*
  * Switch to user address space belonging to given
  * User_Context object.
@@ -121,6 +121,22 @@ bool Copy_To_User(ulong_t destInUser, void* srcInKernel, ulong_t numBytes)
     TODO("Copy kernel data to user buffer");
 }
 
+/*
+ * Get the kernel address of a user buffer, to use it in place.
+ * Returns 0 if the buffer can't be used that way.
+ */
+void *User_To_Kernel(ulong_t userAddr, ulong_t numBytes)
+{
+    /*
+     * Hints:
+     * - Same as for Copy_From_User()
+     * - The buffer may span several pages; all of them must be
+     *   present and stay so (not PAGE_PAGEABLE) while it is used.
+     *   Returning 0 is always safe: callers then copy instead.
+     */
+    return 0;
+}
+
 /*
  * Switch to user address space.
  */
@@ -8,6 +8,7 @@
  * redistribute, and modify it as specified in the file "COPYING".
  */
 
+#include <limits.h>
 #include <geekos/errno.h>
 #include <geekos/list.h>
 #include <geekos/string.h>
@@ -15,6 +16,7 @@
 #include <geekos/malloc.h>
 #include <geekos/synch.h>
 #include <geekos/vfs.h>
+#include <geekos/user.h>
 
 /*
  * Notes:
@@ -269,20 +271,33 @@ bool Register_Filesystem(const char *fsName, struct Filesystem_Ops *fsOps)
  * Format a block device using given filesystem type.
  * Params:
  *   devname - name of block device to format
- *   fstype - fstype, e.g. "pfat", "gosfs"
+ *   fstype - fstype, e.g. "pfat", "gosfs"; filesystem specific
+ *     options may follow a comma, e.g. "gosfs,hdir"
  * Returns: 0 if successful, error code (< 0) if not
  */
 int Format(const char *devname, const char *fstype)
 {
     struct Filesystem *fs;
     struct Block_Device *dev = 0;
+    char fsName[VFS_MAX_FS_NAME_LEN + 1];
+    const char *options;
+    size_t nameLen;
     int rc;
 
+    /* Split off the format options, if any */
+    options = strchr(fstype, ',');
+    nameLen = (options != 0) ? (size_t) (options - fstype) : strlen(fstype);
+    if (nameLen > VFS_MAX_FS_NAME_LEN)
+	return ENOFILESYS;
+    memcpy(fsName, fstype, nameLen);
+    fsName[nameLen] = '\0';
+    options = (options != 0) ? options + 1 : "";
+
     /* Find the named filesystem type */
-    fs = Lookup_Filesystem(fstype);
+    fs = Lookup_Filesystem(fsName);
     if (fs == 0)
 	return ENOFILESYS;
-    Debug("Found %s filesystem type\n", fstype);
+    Debug("Found %s filesystem type\n", fsName);
 
     /* The Format() operation is optional. */
     if (fs->ops->Format == 0)
@@ -294,7 +309,7 @@ int Format(const char *devname, const char *fstype)
     Debug("Opened device %s\n", dev->name);
 
     /* Dispatch to fs Format() function. */
-    rc = fs->ops->Format(dev);
+    rc = fs->ops->Format(dev, options);
 
     Close_Block_Device(dev);
 
@@ -445,6 +460,32 @@ int Stat(const char *path, struct VFS_File_Stat *stat)
 	return mountPoint->ops->Stat(mountPoint, suffix, stat);
 }
 
+/*
+ * Get size and free space of the filesystem containing given path.
+ * Params:
+ *   path - any path on the filesystem
+ *   stat - pointer to VFS_FS_Stat
+ * Return: 0 if successful, error code (< 0) if not
+ */
+int StatFS(const char *path, struct VFS_FS_Stat *stat)
+{
+    char prefix[MAX_PREFIX_LEN + 1];
+    const char *suffix;
+    struct Mount_Point *mountPoint;
+
+    if (!Unpack_Path(path, prefix, &suffix))
+	return ENOTFOUND;
+
+    mountPoint = Lookup_Mount_Point(prefix);
+    if (mountPoint == 0)
+	return ENOTFOUND;
+
+    if (mountPoint->ops->StatFS == 0)
+	return EUNSUPPORTED;
+    else
+	return mountPoint->ops->StatFS(mountPoint, stat);
+}
+
 /*
  * Sync all mounted filesystems.
  * Returns: 0 if successful, error code (< 0) if not
@@ -512,6 +553,39 @@ int FStat(struct File *file, struct VFS_File_Stat *stat)
 	return file->ops->FStat(file, stat);
 }
 
+/*
+ * Put a file on disk, or just what is needed to read its data back.
+ * A filesystem without a Sync file operation is synced whole;
+ * a file on no filesystem has nothing to write.
+ */
+static int Sync_File(struct File *file, bool dataOnly)
+{
+    if (file->ops->Sync != 0)
+	return file->ops->Sync(file, dataOnly);
+    if (file->mountPoint == 0)
+	return 0;
+    return file->mountPoint->ops->Sync(file->mountPoint);
+}
+
+/*
+ * Write the data and metadata of given file to disk.
+ * Returns: 0 if successful, error code (< 0) if not
+ */
+int FSync(struct File *file)
+{
+    return Sync_File(file, false);
+}
+
+/*
+ * Write the data of given file to disk, and only as much of its
+ * metadata as is needed to read the data back.
+ * Returns: 0 if successful, error code (< 0) if not
+ */
+int FDataSync(struct File *file)
+{
+    return Sync_File(file, true);
+}
+
 /*
  * Read bytes from the current position in a file.
  * Params:
@@ -523,6 +597,8 @@ int FStat(struct File *file, struct VFS_File_Stat *stat)
  */
 int Read(struct File *file, void *buf, ulong_t len)
 {
+    struct VFS_Buffer vbuf = { false, buf, 0, 0, 0 };
+
     if (file->ops->Read == 0)
     {	Debug("no read.\n");
 	return EUNSUPPORTED;
@@ -530,10 +606,28 @@ int Read(struct File *file, void *buf, ulong_t len)
     else
     {
 	Debug("vfs read:\n");
-	return file->ops->Read(file, buf, len);
+	return file->ops->Read(file, &vbuf, len);
     }
 }
 
+/*
+ * Read bytes from the current position in a file
+ * straight into the current process's memory.
+ * Params:
+ *   file - the File object
+ *   userAddr - user address where data read from file should be stored
+ *   len - number of bytes to read
+ * Returns: as Read()
+ */
+int Read_User(struct File *file, ulong_t userAddr, ulong_t len)
+{
+    struct VFS_Buffer vbuf = { true, 0, userAddr, 0, 0 };
+
+    if (file->ops->Read == 0)
+	return EUNSUPPORTED;
+    return file->ops->Read(file, &vbuf, len);
+}
+
 /*
  * Write bytes to the current position of a file.
  * Params:
@@ -544,6 +638,8 @@ int Read(struct File *file, void *buf, ulong_t len)
  */
 int Write(struct File *file, void *buf, ulong_t len)
 {
+    struct VFS_Buffer vbuf = { false, buf, 0, 0, 0 };
+
     if (file->ops->Write == 0)
     {
 	Debug("no write:%x\n", (int)file);
@@ -555,8 +651,268 @@ int Write(struct File *file, void *buf, ulong_t len)
 	Debug("filepos:%d\n", (int)file->filePos);
 	Debug("write op:%x\n", (int)file->ops->Write);
 	Debug("read op:%x\n", (int)file->ops->Read);
-	return file->ops->Write(file, buf, len);
+	return file->ops->Write(file, &vbuf, len);
+    }
+}
+
+/*
+ * Write bytes from the current process's memory
+ * to the current position of a file.
+ * Params:
+ *   file - the File object
+ *   userAddr - user address of the data to be written
+ *   len - number of bytes to write
+ * Returns: as Write()
+ */
+int Write_User(struct File *file, ulong_t userAddr, ulong_t len)
+{
+    struct VFS_Buffer vbuf = { true, 0, userAddr, 0, 0 };
+
+    if (file->ops->Write == 0)
+	return EUNSUPPORTED;
+    return file->ops->Write(file, &vbuf, len);
+}
+
+/*
+ * Read or write at pos, leaving the current position of the file alone.
+ * A File belongs to one process, and its filesystem only looks at
+ * filePos while the operation runs, so it is simply moved and put back.
+ */
+static int Positional_IO(struct File *file, struct VFS_Buffer *buf, ulong_t len, ulong_t pos, bool write)
+{
+    ulong_t oldPos = file->filePos;
+    int rc;
+
+    if ((write ? file->ops->Write : file->ops->Read) == 0)
+	return EUNSUPPORTED;
+
+    file->filePos = pos;
+    rc = write ? file->ops->Write(file, buf, len) : file->ops->Read(file, buf, len);
+    file->filePos = oldPos;
+    return rc;
+}
+
+/*
+ * Read bytes from position pos of a file into the current process's
+ * memory, without changing the current position.
+ * Returns: as Read()
+ */
+int PRead_User(struct File *file, ulong_t userAddr, ulong_t len, ulong_t pos)
+{
+    struct VFS_Buffer vbuf = { true, 0, userAddr, 0, 0 };
+
+    return Positional_IO(file, &vbuf, len, pos, false);
+}
+
+/*
+ * Write bytes from the current process's memory to position pos
+ * of a file, without changing the current position.
+ * Returns: as Write()
+ */
+int PWrite_User(struct File *file, ulong_t userAddr, ulong_t len, ulong_t pos)
+{
+    struct VFS_Buffer vbuf = { true, 0, userAddr, 0, 0 };
+
+    return Positional_IO(file, &vbuf, len, pos, true);
+}
+
+/* Total length of the buffers of a vector, or -1 if it doesn't fit */
+static long Vector_Length(const struct VFS_IO_Vector *vec, int count)
+{
+    ulong_t total = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+	if (vec[i].len > INT_MAX - total)
+	    return -1;
+	total += vec[i].len;
+    }
+    return total;
+}
+
+/*
+ * Read bytes from the current position in a file into the buffers
+ * vec[0..count) of the current process, in a single operation.
+ * Returns: as Read()
+ */
+int ReadV_User(struct File *file, const struct VFS_IO_Vector *vec, int count)
+{
+    struct VFS_Buffer vbuf = { true, 0, 0, vec, count };
+    long len = Vector_Length(vec, count);
+
+    if (file->ops->Read == 0)
+	return EUNSUPPORTED;
+    if (len < 0)
+	return EINVALID;
+    if (len == 0)
+	return 0;
+    return file->ops->Read(file, &vbuf, len);
+}
+
+/*
+ * Write the buffers vec[0..count) of the current process to the
+ * current position of a file, in a single operation.
+ * Returns: as Write()
+ */
+int WriteV_User(struct File *file, const struct VFS_IO_Vector *vec, int count)
+{
+    struct VFS_Buffer vbuf = { true, 0, 0, vec, count };
+    long len = Vector_Length(vec, count);
+
+    if (file->ops->Write == 0)
+	return EUNSUPPORTED;
+    if (len < 0)
+	return EINVALID;
+    if (len == 0)
+	return 0;
+    return file->ops->Write(file, &vbuf, len);
+}
+
+/* Bytes moved at a time when Copy_File_Range() copies through a buffer */
+#define VFS_COPY_CHUNK 4096
+
+/*
+ * Copy len bytes from the current position of src to the current
+ * position of dst without the data leaving the kernel; both positions
+ * move on. Files of the same mount point whose filesystem has a
+ * Copy_Range operation are copied by it; others go through a
+ * kernel buffer.
+ * Returns: number of bytes copied, 0 if src is at its end,
+ *   or error code (< 0) if nothing could be copied
+ */
+int Copy_File_Range(struct File *src, struct File *dst, ulong_t len)
+{
+    char *chunk;
+    ulong_t copied = 0;
+    int n, rc = 0;
+
+    if (len > INT_MAX)
+	len = INT_MAX;
+    if (src->ops->Copy_Range != 0 && src->ops->Copy_Range == dst->ops->Copy_Range
+	&& src->mountPoint == dst->mountPoint) {
+	rc = src->ops->Copy_Range(src, dst, len);
+	if (rc != EUNSUPPORTED)
+	    return rc;
+    }
+    if (src->ops->Read == 0 || dst->ops->Write == 0)
+	return EUNSUPPORTED;
+
+    chunk = (char *) Malloc(VFS_COPY_CHUNK);
+    if (chunk == 0)
+	return ENOMEM;
+    while (copied < len) {
+	n = Read(src, chunk, len - copied < VFS_COPY_CHUNK ? len - copied : VFS_COPY_CHUNK);
+	if (n <= 0) {
+	    rc = n;
+	    break;
+	}
+	rc = Write(dst, chunk, n);
+	if (rc < 0) {
+	    src->filePos -= n;	/* nothing of it was copied */
+	    break;
+	}
+	copied += rc;
+	if (rc < n) {
+	    src->filePos -= n - rc;
+	    break;
+	}
+    }
+    Free(chunk);
+
+    return (copied == 0 && rc < 0) ? rc : copied;
+}
+
+/*
+ * Copy len bytes between data and the user buffers of a vector,
+ * starting offset bytes into the vector.
+ */
+static bool Copy_Vector(struct VFS_Buffer *buf, ulong_t offset, char *data, ulong_t len, bool out)
+{
+    const struct VFS_IO_Vector *vec = buf->vec;
+    ulong_t userAddr, n;
+    int i;
+
+    for (i = 0; i < buf->vecCount && len > 0; i++) {
+	if (offset >= vec[i].len) {
+	    offset -= vec[i].len;
+	    continue;
+	}
+	userAddr = (ulong_t)vec[i].base + offset;
+	n = vec[i].len - offset;
+	if (n > len)
+	    n = len;
+	if (!(out ? Copy_To_User(userAddr, data, n) : Copy_From_User(data, userAddr, n)))
+	    return false;
+	data += n;
+	len -= n;
+	offset = 0;
+    }
+    return len == 0;
+}
+
+/*
+ * Copy file data into the buffer of a Read.
+ * Params:
+ *   buf - the buffer
+ *   offset - where in the buffer the data goes
+ *   src - kernel address of the data
+ *   len - number of bytes to copy
+ * Returns: false if the buffer is user memory the process may not access
+ */
+bool VFS_Copy_Out(struct VFS_Buffer *buf, ulong_t offset, void *src, ulong_t len)
+{
+    if (buf->vec != 0)
+	return Copy_Vector(buf, offset, src, len, true);
+    if (buf->user)
+	return Copy_To_User(buf->userAddr + offset, src, len);
+    memcpy((char *)buf->kernel + offset, src, len);
+    return true;
+}
+
+/*
+ * Copy data to be written to a file out of the buffer of a Write.
+ * Params:
+ *   dest - kernel address the data goes to
+ *   buf - the buffer
+ *   offset - where in the buffer the data is
+ *   len - number of bytes to copy
+ * Returns: false if the buffer is user memory the process may not access
+ */
+bool VFS_Copy_In(void *dest, struct VFS_Buffer *buf, ulong_t offset, ulong_t len)
+{
+    if (buf->vec != 0)
+	return Copy_Vector(buf, offset, dest, len, false);
+    if (buf->user)
+	return Copy_From_User(dest, buf->userAddr + offset, len);
+    memcpy(dest, (char *)buf->kernel + offset, len);
+    return true;
+}
+
+/*
+ * Get a kernel address for len bytes of a buffer, so file data
+ * can be moved to or from them in place, e.g. by the disk.
+ * Params:
+ *   buf - the buffer
+ *   offset - where in the buffer the bytes start
+ *   len - number of bytes
+ * Returns: the address, or 0 if the bytes aren't in one piece
+ *   the kernel can reach; the caller must copy then
+ */
+void *VFS_Buffer_Address(struct VFS_Buffer *buf, ulong_t offset, ulong_t len)
+{
+    const struct VFS_IO_Vector *vec = buf->vec;
+    int i;
+
+    if (vec != 0) {
+	for (i = 0; i < buf->vecCount && offset >= vec[i].len; i++)
+	    offset -= vec[i].len;
+	if (i == buf->vecCount || len > vec[i].len - offset)
+	    return 0;
+	return User_To_Kernel((ulong_t)vec[i].base + offset, len);
     }
+    if (buf->user)
+	return User_To_Kernel(buf->userAddr + offset, len);
+    return (char *)buf->kernel + offset;
 }
 
 /*
@@ -727,6 +1083,45 @@ int Read_Entry(struct File *file, struct VFS_Dir_Entry *entry)
 	return file->ops->Read_Entry(file, entry);
 }
 
+/*
+ * Read up to maxEntries directory entries straight into an array
+ * of struct VFS_Dir_Entry in the current process's memory.
+ * A filesystem without a Read_Entries operation is asked for
+ * one entry at a time.
+ * Returns: number of entries read, 0 if there are no more,
+ *   or error code (< 0) if the first one can't be read
+ */
+int Read_Entries_User(struct File *file, ulong_t userAddr, int maxEntries)
+{
+    struct VFS_Buffer vbuf = { true, 0, userAddr, 0, 0 };
+    struct VFS_Dir_Entry *entry;
+    int n, rc = 0;
+
+    if (maxEntries <= 0)
+	return EINVALID;
+    if (file->ops->Read_Entries != 0)
+	return file->ops->Read_Entries(file, &vbuf, maxEntries);
+    if (file->ops->Read_Entry == 0)
+	return EUNSUPPORTED;
+
+    entry = (struct VFS_Dir_Entry *) Malloc(sizeof(*entry));
+    if (entry == 0)
+	return ENOMEM;
+    for (n = 0; n < maxEntries; ++n) {
+	memset(entry, '\0', sizeof(*entry));
+	rc = file->ops->Read_Entry(file, entry);
+	if (rc != 0)
+	    break;
+	if (!VFS_Copy_Out(&vbuf, n * sizeof(*entry), entry, sizeof(*entry))) {
+	    rc = EINVALID;
+	    break;
+	}
+    }
+    Free(entry);
+
+    return (n == 0 && rc < 0) ? rc : n;
+}
+
 /*
  * Register a paging device.
  */
@@ -19,6 +19,9 @@ DEF_SYSCALL(Stat,SYS_STAT,int, (const char *filename, struct VFS_File_Stat *stat
 DEF_SYSCALL(FStat,SYS_FSTAT,int, (int fd, struct VFS_File_Stat *stat),
     int arg0 = fd; struct VFS_File_Stat *arg1 = stat;,
     SYSCALL_REGS_2)
+DEF_SYSCALL(StatFS,SYS_STATFS,int, (const char *path, struct VFS_FS_Stat *stat),
+    const char *arg0 = path; size_t arg1 = strlen(path); struct VFS_FS_Stat *arg2 = stat;,
+    SYSCALL_REGS_3)
 DEF_SYSCALL(Open,SYS_OPEN,int, (const char *filename, int mode),
     const char *arg0 = filename; size_t arg1 = strlen(filename); int arg2 = mode;,
     SYSCALL_REGS_3)
@@ -32,6 +35,9 @@ DEF_SYSCALL(Close,SYS_CLOSE,int, (int fd), int arg0 = fd;, SYSCALL_REGS_1)
 DEF_SYSCALL(Read_Entry,SYS_READENTRY,int, (int fd, struct VFS_Dir_Entry *entry),
     int arg0 = fd; struct VFS_Dir_Entry *arg1 = entry;,
     SYSCALL_REGS_2)
+DEF_SYSCALL(Read_Entries,SYS_READENTRIES,int, (int fd, struct VFS_Dir_Entry *entries, int maxEntries),
+    int arg0 = fd; struct VFS_Dir_Entry *arg1 = entries; int arg2 = maxEntries;,
+    SYSCALL_REGS_3)
 DEF_SYSCALL(Read,SYS_READ,int, (int fd, void *buf, ulong_t len),
     int arg0 = fd; void *arg1 = buf; ulong_t arg2 = len;,
     SYSCALL_REGS_3)
@@ -39,6 +45,8 @@ DEF_SYSCALL(Write,SYS_WRITE,int, (int fd, const void *buf, ulong_t len),
     int arg0 = fd; const void *arg1 = buf; ulong_t arg2 = len;,
     SYSCALL_REGS_3)
 DEF_SYSCALL(Sync,SYS_SYNC,int,(void),,SYSCALL_REGS_0)
+DEF_SYSCALL(FSync,SYS_FSYNC,int,(int fd),int arg0 = fd;,SYSCALL_REGS_1)
+DEF_SYSCALL(FDataSync,SYS_FDATASYNC,int,(int fd),int arg0 = fd;,SYSCALL_REGS_1)
 DEF_SYSCALL(Format,SYS_FORMAT,int,(const char *devname, const char *fstype),
     const char *arg0 = devname; size_t arg1 = strlen(devname); const char *arg2 = fstype; size_t arg3 = strlen(fstype);,
     SYSCALL_REGS_4)
@@ -48,6 +56,21 @@ DEF_SYSCALL(Seek,SYS_SEEK,int,(int fd, int pos),
 DEF_SYSCALL(Delete,SYS_DELETE,int,(const char *path),
     const char *arg0 = path; size_t arg1 = strlen(path);,
     SYSCALL_REGS_2)
+DEF_SYSCALL(PRead,SYS_PREAD,int, (int fd, void *buf, ulong_t len, ulong_t pos),
+    int arg0 = fd; void *arg1 = buf; ulong_t arg2 = len; ulong_t arg3 = pos;,
+    SYSCALL_REGS_4)
+DEF_SYSCALL(PWrite,SYS_PWRITE,int, (int fd, const void *buf, ulong_t len, ulong_t pos),
+    int arg0 = fd; const void *arg1 = buf; ulong_t arg2 = len; ulong_t arg3 = pos;,
+    SYSCALL_REGS_4)
+DEF_SYSCALL(ReadV,SYS_READV,int, (int fd, const struct VFS_IO_Vector *vec, int count),
+    int arg0 = fd; const struct VFS_IO_Vector *arg1 = vec; int arg2 = count;,
+    SYSCALL_REGS_3)
+DEF_SYSCALL(WriteV,SYS_WRITEV,int, (int fd, const struct VFS_IO_Vector *vec, int count),
+    int arg0 = fd; const struct VFS_IO_Vector *arg1 = vec; int arg2 = count;,
+    SYSCALL_REGS_3)
+DEF_SYSCALL(Copy_File_Range,SYS_COPYFILERANGE,int, (int srcFd, int dstFd, unsigned long len),
+    int arg0 = srcFd; int arg1 = dstFd; unsigned long arg2 = len;,
+    SYSCALL_REGS_3)
 
 
 
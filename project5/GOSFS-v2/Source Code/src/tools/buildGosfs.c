@@ -0,0 +1,1005 @@
+/*
+ * buildGosfs - build, dump or check a GOSFS image on the host
+ *
+ *   buildGosfs [-o <options>] [-s <sectors>] <diskImage> <files or directories>
+ *	Format diskImage (created with the given number of sectors if -s is
+ *	given) and copy the files and directory trees into its root.
+ *	options is the comma separated list GOSFS_Format takes:
+ *	hdir, extents, journal, inline.
+ *   buildGosfs -d <diskImage>
+ *	Print the superblock, bitmap usage and directory tree.
+ *   buildGosfs -c <diskImage>
+ *	Check the bitmaps, inode table and directories against each other.
+ *
+ * Every file gets one contiguous run of blocks, so a populated image reads
+ * as fast as it can. Files are always mapped through blockList (the kernel
+ * maps each inode the way its flags say, whatever the volume features).
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * The on-disk format, as in <geekos/gosfs.h>, which can't be compiled on
+ * the host; keep the two in step. Images are for the 32-bit kernel, so
+ * every ulong_t there is a uint32_t here.
+ */
+#define SECTOR_SIZE		512
+#define BLOCK_SIZE		4096
+#define SECTORS_PER_BLOCK	(BLOCK_SIZE / SECTOR_SIZE)
+
+#define GOSFS_MAGIC		0x78330002
+
+#define DIRENTRY_USED		0x01
+#define DIRENTRY_ISDIRECTORY	0x02
+#define DIRENTRY_SETUID		0x04
+#define DIRENTRY_OLD		0x08
+#define DIRENTRY_HASHED		0x10
+#define DIRENTRY_EXTENTS	0x20
+#define DIRENTRY_INLINE		0x40
+#define DIRENTRY_ORPHAN		0x80
+
+#define FEATURE_HASHED_DIRS	0x01
+#define FEATURE_EXTENTS		0x02
+#define FEATURE_JOURNAL		0x04
+#define FEATURE_INLINE_DATA	0x08
+
+#define FILENAME_MAX_LEN	127
+#define NUM_DIRECT_BLOCKS	8
+#define NUM_BLOCK_PTRS		10
+#define NUM_ACL_ENTRIES		10
+#define PTRS_PER_BLOCK		(BLOCK_SIZE / 4)
+#define MAX_FILE_BLOCKS		(NUM_DIRECT_BLOCKS + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+#define INLINE_DATA_MAX		(4 * NUM_BLOCK_PTRS + 4 * NUM_ACL_ENTRIES)
+
+#define SUPER_BLOCK_NUM		1
+#define ROOT_INODE_NUM		1
+#define BITS_PER_BLOCK		(BLOCK_SIZE * 8)
+#define BLOCKS_PER_INODE	4
+#define MIN_INODES		64
+#define MIN_DATA_BLOCKS		64
+#define MAX_ORPHANS		16
+
+#define JOURNAL_MAGIC		0x4a4c4f47
+#define JOURNAL_BLOCKS		256
+#define JOURNAL_SUPER		1
+
+#define HDIR_MAGIC		0x48444952
+#define HDIR_MAX_DEPTH		9
+#define HDIR_TABLE_SIZE		(1 << HDIR_MAX_DEPTH)
+#define HDIR_REC_LEN(nameLen)	((16 + (nameLen) + 1 + 3) & ~3)
+
+struct dirEntry {
+    uint32_t size;
+    uint32_t flags;
+    char filename[FILENAME_MAX_LEN + 1];
+    uint32_t blockList[NUM_BLOCK_PTRS];
+    uint32_t acl[NUM_ACL_ENTRIES];
+};
+
+#define DIR_ENTRIES_PER_BLOCK	(BLOCK_SIZE / sizeof(struct dirEntry))
+
+struct instance {
+    uint32_t magic;
+    uint32_t numLogicBlocks;
+    uint32_t numInodes;
+    uint32_t firstDataBlock;
+    uint32_t dev;			/* a kernel pointer; meaningless on disk */
+    uint32_t inodeBitmapStart, inodeBitmapBlocks;
+    uint32_t blockBitmapStart, blockBitmapBlocks;
+    uint32_t inodeTableStart, inodeTableBlocks;
+    uint32_t numDataBlocks;
+    uint32_t features;
+    uint32_t journalStart;
+    uint32_t journalBlocks;
+    uint32_t numOrphans;
+    uint32_t orphans[MAX_ORPHANS];
+};
+
+struct journalHeader {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t sequence;
+    uint32_t count;
+    uint32_t tail;
+};
+
+struct hdirHeader {
+    uint32_t magic;
+    uint32_t globalDepth;
+    uint32_t numBlocks;
+    uint32_t table[HDIR_TABLE_SIZE];
+};
+
+struct hdirLeaf {
+    uint32_t localDepth;
+    uint32_t used;
+    unsigned char records[BLOCK_SIZE - 8];
+};
+
+struct hdirRecord {
+    uint32_t hash;
+    uint32_t inodeNum;
+    uint32_t flags;
+    uint16_t recLen;
+    uint16_t nameLen;
+    char name[4];
+};
+
+struct extentHeader {
+    uint16_t entries;
+    uint16_t depth;
+};
+
+struct extent {
+    uint32_t lblock;
+    uint32_t pblock;
+    uint32_t len;
+};
+
+struct extentIndex {
+    uint32_t lblock;
+    uint32_t leaf;
+};
+
+/* The whole image is worked on in memory and written back at the end. */
+static unsigned char *image;
+static uint32_t imageBlocks;
+static struct instance *sb;
+static uint32_t nextBlock;		/* build: next free data block */
+static uint32_t nextInode;		/* build: next free inode */
+static int errors;
+
+#define BLOCK(n)	(image + (size_t) (n) * BLOCK_SIZE)
+
+static void usage(void)
+{
+    printf("usage: buildGosfs [-o <options>] [-s <sectors>] <diskImage> <files>\n"
+	   "       buildGosfs -d <diskImage>\n"
+	   "       buildGosfs -c <diskImage>\n");
+    exit(-1);
+}
+
+static void problem(const char *fmt, uint32_t a, uint32_t b)
+{
+    printf("error: ");
+    printf(fmt, a, b);
+    printf("\n");
+    errors++;
+}
+
+/* ----------------------------------------------------------------------
+ * Bitmaps and the inode table
+ * ---------------------------------------------------------------------- */
+
+static int testBit(uint32_t start, uint32_t bit)
+{
+    unsigned char *map = BLOCK(start + bit / BITS_PER_BLOCK);
+    bit %= BITS_PER_BLOCK;
+    return (map[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void setBit(uint32_t start, uint32_t bit)
+{
+    unsigned char *map = BLOCK(start + bit / BITS_PER_BLOCK);
+    bit %= BITS_PER_BLOCK;
+    map[bit / 8] |= 1 << (bit % 8);
+}
+
+static uint32_t countBits(uint32_t start, uint32_t totalBits)
+{
+    uint32_t i, n = 0;
+
+    for (i = 0; i < totalBits; i++)
+	n += testBit(start, i);
+    return n;
+}
+
+static struct dirEntry *inode(uint32_t num)
+{
+    struct dirEntry *table = (struct dirEntry *) BLOCK(sb->inodeTableStart + num / DIR_ENTRIES_PER_BLOCK);
+    return &table[num % DIR_ENTRIES_PER_BLOCK];
+}
+
+static int validBlock(uint32_t blockNum)
+{
+    return blockNum >= sb->firstDataBlock && blockNum < sb->numLogicBlocks;
+}
+
+/* ----------------------------------------------------------------------
+ * Building an image
+ * ---------------------------------------------------------------------- */
+
+/* The layout GOSFS_Format gives a device of numBlocks blocks; see Init_GOSFS_Instance() */
+static int geometry(struct instance *geo, uint32_t numBlocks)
+{
+    uint32_t numInodes;
+
+    memset(geo, '\0', sizeof(*geo));
+    geo->magic = GOSFS_MAGIC;
+    geo->numLogicBlocks = numBlocks;
+
+    numInodes = numBlocks / BLOCKS_PER_INODE;
+    if (numInodes < MIN_INODES)
+	numInodes = MIN_INODES;
+    geo->inodeTableBlocks = (numInodes + DIR_ENTRIES_PER_BLOCK - 1) / DIR_ENTRIES_PER_BLOCK;
+    geo->numInodes = geo->inodeTableBlocks * DIR_ENTRIES_PER_BLOCK;
+
+    geo->inodeBitmapStart = SUPER_BLOCK_NUM + 1;
+    geo->inodeBitmapBlocks = (geo->numInodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    geo->blockBitmapStart = geo->inodeBitmapStart + geo->inodeBitmapBlocks;
+    geo->blockBitmapBlocks = (numBlocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    geo->inodeTableStart = geo->blockBitmapStart + geo->blockBitmapBlocks;
+    geo->firstDataBlock = geo->inodeTableStart + geo->inodeTableBlocks;
+
+    if (numBlocks < geo->firstDataBlock + MIN_DATA_BLOCKS)
+	return -1;
+    geo->numDataBlocks = numBlocks - geo->firstDataBlock;
+    return 0;
+}
+
+static uint32_t allocBlocks(uint32_t count)
+{
+    uint32_t start = nextBlock, i;
+
+    if (count > sb->numLogicBlocks - nextBlock) {
+	printf("Error: image is full\n");
+	exit(-1);
+    }
+    for (i = 0; i < count; i++)
+	setBit(sb->blockBitmapStart, start + i - sb->firstDataBlock);
+    nextBlock += count;
+    return start;
+}
+
+static uint32_t allocInode(const char *name, uint32_t flags)
+{
+    struct dirEntry *entry;
+    uint32_t num = nextInode++;
+
+    if (num >= sb->numInodes) {
+	printf("Error: out of inodes\n");
+	exit(-1);
+    }
+    setBit(sb->inodeBitmapStart, num);
+    entry = inode(num);
+    memset(entry, '\0', sizeof(*entry));
+    strcpy(entry->filename, name);
+    entry->flags = flags;
+    return num;
+}
+
+/* Map logical blocks 0..count-1 of entry to start..start+count-1 */
+static void mapBlocks(struct dirEntry *entry, uint32_t start, uint32_t count)
+{
+    uint32_t *ind, *ind2;
+    uint32_t i, j, n;
+
+    if (count > MAX_FILE_BLOCKS) {
+	printf("Error: %s is too large\n", entry->filename);
+	exit(-1);
+    }
+
+    for (i = 0; i < count && i < NUM_DIRECT_BLOCKS; i++)
+	entry->blockList[i] = start + i;
+    if (count <= NUM_DIRECT_BLOCKS)
+	return;
+
+    /* indirect blocks go after the data, which stays in one piece */
+    count -= NUM_DIRECT_BLOCKS;
+    start += NUM_DIRECT_BLOCKS;
+    entry->blockList[8] = allocBlocks(1);
+    ind = (uint32_t *) BLOCK(entry->blockList[8]);
+    for (i = 0; i < count && i < PTRS_PER_BLOCK; i++)
+	ind[i] = start + i;
+    if (count <= PTRS_PER_BLOCK)
+	return;
+
+    count -= PTRS_PER_BLOCK;
+    start += PTRS_PER_BLOCK;
+    entry->blockList[9] = allocBlocks(1);
+    ind2 = (uint32_t *) BLOCK(entry->blockList[9]);
+    for (i = 0; count > 0; i++) {
+	ind2[i] = allocBlocks(1);
+	ind = (uint32_t *) BLOCK(ind2[i]);
+	n = count < PTRS_PER_BLOCK ? count : PTRS_PER_BLOCK;
+	for (j = 0; j < n; j++)
+	    ind[j] = start + j;
+	start += n;
+	count -= n;
+    }
+}
+
+static uint32_t addFile(const char *path, const char *name)
+{
+    struct dirEntry *entry;
+    struct stat sbuf;
+    uint32_t num, numBlocks, start;
+    ssize_t ret;
+    int fd;
+
+    if (stat(path, &sbuf) != 0) {
+	printf("Error stating %s\n", path);
+	exit(-1);
+    }
+    fd = open(path, O_RDONLY, 0);
+    if (fd < 0) {
+	perror(path);
+	exit(-1);
+    }
+
+    /* a small file keeps its data in the inode, when the volume allows */
+    if ((sb->features & FEATURE_INLINE_DATA) && sbuf.st_size <= INLINE_DATA_MAX) {
+	num = allocInode(name, DIRENTRY_INLINE);
+	entry = inode(num);
+	ret = read(fd, entry->blockList, sbuf.st_size);
+    } else {
+	num = allocInode(name, 0);
+	entry = inode(num);
+	numBlocks = (sbuf.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	start = allocBlocks(numBlocks);
+	ret = read(fd, BLOCK(start), sbuf.st_size);
+	mapBlocks(entry, start, numBlocks);
+    }
+    if (ret != sbuf.st_size) {
+	printf("Error reading %s\n", path);
+	exit(-1);
+    }
+    close(fd);
+    entry->size = sbuf.st_size;
+
+    printf("file %s: inode %u, %u bytes\n", path, num, entry->size);
+    return num;
+}
+
+/* Directory contents, gathered before they are laid out */
+struct child {
+    char name[FILENAME_MAX_LEN + 1];
+    uint32_t inodeNum;
+    uint32_t flags;
+};
+
+static uint32_t hdirHash(const char *name)
+{
+    uint32_t hash = 2166136261U;
+
+    while (*name != '\0') {
+	hash ^= (unsigned char) *name++;
+	hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* Insert into a hashed directory held in blocks[]; the same splits as Hdir_Insert() */
+static void hdirInsert(unsigned char *blocks, const struct child *c)
+{
+    struct hdirHeader *hdr = (struct hdirHeader *) blocks;
+    struct hdirLeaf *leaf, *newLeaf;
+    struct hdirRecord *rec;
+    uint32_t hash = hdirHash(c->name);
+    uint32_t nameLen = strlen(c->name);
+    uint32_t recLen = HDIR_REC_LEN(nameLen);
+    uint32_t leafLblk, newLblk, bit, off, keep, len, i;
+
+    for (;;) {
+	leafLblk = hdr->table[hash & ((1 << hdr->globalDepth) - 1)];
+	leaf = (struct hdirLeaf *) (blocks + leafLblk * BLOCK_SIZE);
+	if (leaf->used + recLen <= sizeof(leaf->records))
+	    break;
+
+	if (leaf->localDepth == hdr->globalDepth) {
+	    if (hdr->globalDepth == HDIR_MAX_DEPTH) {
+		printf("Error: too many entries in directory\n");
+		exit(-1);
+	    }
+	    for (i = 0; i < (1U << hdr->globalDepth); i++)
+		hdr->table[i + (1 << hdr->globalDepth)] = hdr->table[i];
+	    hdr->globalDepth++;
+	}
+
+	newLblk = hdr->numBlocks++;
+	newLeaf = (struct hdirLeaf *) (blocks + newLblk * BLOCK_SIZE);
+	bit = 1 << leaf->localDepth;
+	leaf->localDepth++;
+	newLeaf->localDepth = leaf->localDepth;
+	newLeaf->used = 0;
+	off = keep = 0;
+	while (off < leaf->used) {
+	    rec = (struct hdirRecord *) (leaf->records + off);
+	    len = rec->recLen;
+	    if (rec->hash & bit) {
+		memcpy(newLeaf->records + newLeaf->used, rec, len);
+		newLeaf->used += len;
+	    } else {
+		if (keep != off)
+		    memmove(leaf->records + keep, rec, len);
+		keep += len;
+	    }
+	    off += len;
+	}
+	leaf->used = keep;
+	for (i = 0; i < (1U << hdr->globalDepth); i++) {
+	    if (hdr->table[i] == leafLblk && (i & bit))
+		hdr->table[i] = newLblk;
+	}
+    }
+
+    rec = (struct hdirRecord *) (leaf->records + leaf->used);
+    rec->hash = hash;
+    rec->inodeNum = c->inodeNum;
+    rec->flags = c->flags;
+    rec->recLen = recLen;
+    rec->nameLen = nameLen;
+    strcpy(rec->name, c->name);
+    leaf->used += recLen;
+}
+
+/* Lay out directory dirNum with its n children */
+static void writeDir(uint32_t dirNum, const struct child *children, int n)
+{
+    struct dirEntry *dir = inode(dirNum);
+    unsigned char *blocks;
+    uint32_t numBlocks, start;
+    int i;
+
+    dir->size = n;
+    if (n == 0)
+	return;
+
+    if (!(dir->flags & DIRENTRY_HASHED)) {
+	if (n > NUM_BLOCK_PTRS) {
+	    printf("Error: %s has more than %d entries; use -o hdir\n", dir->filename, NUM_BLOCK_PTRS);
+	    exit(-1);
+	}
+	for (i = 0; i < n; i++)
+	    dir->blockList[i] = children[i].inodeNum;
+	return;
+    }
+
+    /* the header, and at most one leaf for each table slot */
+    blocks = (unsigned char *) calloc(1 + HDIR_TABLE_SIZE, BLOCK_SIZE);
+    if (blocks == 0) {
+	printf("Error: out of memory\n");
+	exit(-1);
+    }
+    ((struct hdirHeader *) blocks)->magic = HDIR_MAGIC;
+    ((struct hdirHeader *) blocks)->numBlocks = 2;
+    ((struct hdirHeader *) blocks)->table[0] = 1;
+    for (i = 0; i < n; i++)
+	hdirInsert(blocks, &children[i]);
+
+    numBlocks = ((struct hdirHeader *) blocks)->numBlocks;
+    start = allocBlocks(numBlocks);
+    memcpy(BLOCK(start), blocks, (size_t) numBlocks * BLOCK_SIZE);
+    mapBlocks(dir, start, numBlocks);
+    free(blocks);
+}
+
+static uint32_t addPath(const char *path, const char *name);
+
+static uint32_t addDir(const char *path, const char *name)
+{
+    struct child *children = 0;
+    struct dirent *ent;
+    char childPath[4096];
+    uint32_t num;
+    int n = 0, max = 0;
+    DIR *d;
+
+    num = allocInode(name, DIRENTRY_ISDIRECTORY |
+	((sb->features & FEATURE_HASHED_DIRS) ? DIRENTRY_HASHED : 0));
+
+    d = opendir(path);
+    if (d == 0) {
+	perror(path);
+	exit(-1);
+    }
+    while ((ent = readdir(d)) != 0) {
+	if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+	    continue;
+	if (n == max) {
+	    max = max ? 2 * max : 16;
+	    children = (struct child *) realloc(children, max * sizeof(struct child));
+	    if (children == 0) {
+		printf("Error: out of memory\n");
+		exit(-1);
+	    }
+	}
+	snprintf(childPath, sizeof(childPath), "%s/%s", path, ent->d_name);
+	strncpy(children[n].name, ent->d_name, FILENAME_MAX_LEN);
+	children[n].name[FILENAME_MAX_LEN] = '\0';
+	children[n].inodeNum = addPath(childPath, ent->d_name);
+	children[n].flags = inode(children[n].inodeNum)->flags;
+	n++;
+    }
+    closedir(d);
+
+    writeDir(num, children, n);
+    free(children);
+    printf("directory %s: inode %u, %d entries\n", path, num, n);
+    return num;
+}
+
+static uint32_t addPath(const char *path, const char *name)
+{
+    struct stat sbuf;
+
+    if (strlen(name) >= FILENAME_MAX_LEN) {
+	printf("Error: name %s is too long\n", name);
+	exit(-1);
+    }
+    if (stat(path, &sbuf) != 0) {
+	printf("Error stating %s\n", path);
+	exit(-1);
+    }
+    return S_ISDIR(sbuf.st_mode) ? addDir(path, name) : addFile(path, name);
+}
+
+static uint32_t parseOptions(const char *options)
+{
+    uint32_t features = 0;
+    size_t len;
+
+    for (; *options != '\0'; options += len) {
+	while (*options == ',')
+	    options++;
+	len = strcspn(options, ",");
+	if (len == 0)
+	    continue;
+	if (len == 4 && !strncmp(options, "hdir", 4))
+	    features |= FEATURE_HASHED_DIRS;
+	else if (len == 7 && !strncmp(options, "extents", 7))
+	    features |= FEATURE_EXTENTS;
+	else if (len == 7 && !strncmp(options, "journal", 7))
+	    features |= FEATURE_JOURNAL;
+	else if (len == 6 && !strncmp(options, "inline", 6))
+	    features |= FEATURE_INLINE_DATA;
+	else {
+	    printf("unknown format option %.*s\n", (int) len, options);
+	    exit(-1);
+	}
+    }
+    return features;
+}
+
+/* Format the image and copy files[0..count) into its root; see GOSFS_Format() */
+static void build(uint32_t features, char **files, int count)
+{
+    struct journalHeader *jh;
+    struct dirEntry *root;
+    struct child *children;
+    const char *name;
+    int i;
+
+    /* the image starts out all zeros: boot block, bitmaps and inode table alike */
+    sb = (struct instance *) BLOCK(SUPER_BLOCK_NUM);
+    if (imageBlocks <= SUPER_BLOCK_NUM || geometry(sb, imageBlocks) != 0 ||
+	((features & FEATURE_JOURNAL) && sb->numDataBlocks < JOURNAL_BLOCKS + MIN_DATA_BLOCKS)) {
+	printf("Error: image is too small\n");
+	exit(-1);
+    }
+    sb->features = features;
+    printf("%u blocks, %u inodes, data from block %u\n",
+	sb->numLogicBlocks, sb->numInodes, sb->firstDataBlock);
+
+    setBit(sb->inodeBitmapStart, 0);
+    setBit(sb->inodeBitmapStart, ROOT_INODE_NUM);
+    nextInode = ROOT_INODE_NUM + 1;
+    nextBlock = sb->firstDataBlock;
+
+    if (features & FEATURE_JOURNAL) {
+	sb->journalStart = allocBlocks(JOURNAL_BLOCKS);
+	sb->journalBlocks = JOURNAL_BLOCKS;
+	memset(BLOCK(sb->journalStart), '\0', 2 * BLOCK_SIZE);
+	jh = (struct journalHeader *) BLOCK(sb->journalStart);
+	jh->magic = JOURNAL_MAGIC;
+	jh->type = JOURNAL_SUPER;
+	jh->sequence = ((uint32_t) time(0) << 16) + 1;
+	jh->tail = 0;
+    }
+
+    root = inode(ROOT_INODE_NUM);
+    memset(root, '\0', sizeof(*root));
+    strcpy(root->filename, "d");
+    root->flags = DIRENTRY_ISDIRECTORY | DIRENTRY_USED;
+    if (features & FEATURE_HASHED_DIRS)
+	root->flags |= DIRENTRY_HASHED;
+
+    children = (struct child *) calloc(count + 1, sizeof(struct child));
+    for (i = 0; i < count; i++) {
+	/* Remove leading directory path components */
+	name = strrchr(files[i], '/') != 0 ? strrchr(files[i], '/') + 1 : files[i];
+	strncpy(children[i].name, name, FILENAME_MAX_LEN);
+	children[i].inodeNum = addPath(files[i], name);
+	children[i].flags = inode(children[i].inodeNum)->flags;
+    }
+    writeDir(ROOT_INODE_NUM, children, count);
+    free(children);
+
+    printf("%u of %u data blocks used\n", nextBlock - sb->firstDataBlock, sb->numDataBlocks);
+}
+
+/* ----------------------------------------------------------------------
+ * Walking an image
+ * ---------------------------------------------------------------------- */
+
+typedef void (*blockFunc)(uint32_t blockNum, int meta);
+
+static void walkIndirect(uint32_t blockNum, int levels, blockFunc f)
+{
+    uint32_t *ind;
+    uint32_t i;
+
+    f(blockNum, 1);
+    if (!validBlock(blockNum))
+	return;
+    ind = (uint32_t *) BLOCK(blockNum);
+    for (i = 0; i < PTRS_PER_BLOCK; i++) {
+	if (ind[i] == 0)
+	    continue;
+	if (levels > 1)
+	    walkIndirect(ind[i], levels - 1, f);
+	else
+	    f(ind[i], 0);
+    }
+}
+
+/* Call f for every block entry owns, data and mapping blocks alike */
+static void walkBlocks(struct dirEntry *entry, blockFunc f)
+{
+    struct extentHeader *root = (struct extentHeader *) entry->blockList;
+    struct extent *ext;
+    struct extentIndex *idx;
+    uint32_t i, j, k;
+
+    if (entry->flags & DIRENTRY_INLINE)
+	return;
+    if ((entry->flags & DIRENTRY_ISDIRECTORY) && !(entry->flags & DIRENTRY_HASHED))
+	return; /* blockList holds children */
+
+    if (entry->flags & DIRENTRY_EXTENTS) {
+	if (root->depth == 0) {
+	    ext = (struct extent *) (root + 1);
+	    for (i = 0; i < root->entries && i < 3; i++)
+		for (k = 0; k < ext[i].len; k++)
+		    f(ext[i].pblock + k, 0);
+	    return;
+	}
+	idx = (struct extentIndex *) (root + 1);
+	for (i = 0; i < root->entries && i < 4; i++) {
+	    f(idx[i].leaf, 1);
+	    if (!validBlock(idx[i].leaf))
+		continue;
+	    root = (struct extentHeader *) BLOCK(idx[i].leaf);
+	    ext = (struct extent *) (root + 1);
+	    for (j = 0; j < root->entries && j < (BLOCK_SIZE - 4) / sizeof(struct extent); j++)
+		for (k = 0; k < ext[j].len; k++)
+		    f(ext[j].pblock + k, 0);
+	}
+	return;
+    }
+
+    for (i = 0; i < NUM_DIRECT_BLOCKS; i++)
+	if (entry->blockList[i] != 0)
+	    f(entry->blockList[i], 0);
+    if (entry->blockList[8] != 0)
+	walkIndirect(entry->blockList[8], 1, f);
+    if (entry->blockList[9] != 0)
+	walkIndirect(entry->blockList[9], 2, f);
+}
+
+/* Disk block of logical block lblock of a blockList-mapped directory, 0 if none */
+static uint32_t dirBlock(struct dirEntry *dir, uint32_t lblock)
+{
+    uint32_t *ind;
+
+    if (lblock < NUM_DIRECT_BLOCKS)
+	return dir->blockList[lblock];
+    lblock -= NUM_DIRECT_BLOCKS;
+    if (lblock < PTRS_PER_BLOCK && validBlock(dir->blockList[8])) {
+	ind = (uint32_t *) BLOCK(dir->blockList[8]);
+	return ind[lblock];
+    }
+    return 0;
+}
+
+typedef void (*childFunc)(uint32_t dirNum, const char *name, uint32_t inodeNum, int depth);
+
+/* Call f for every child of directory dirNum */
+static void walkDir(uint32_t dirNum, childFunc f, int depth)
+{
+    struct dirEntry *dir = inode(dirNum);
+    struct hdirHeader *hdr;
+    struct hdirLeaf *leaf;
+    struct hdirRecord *rec;
+    uint32_t i, b, off;
+
+    if (!(dir->flags & DIRENTRY_HASHED)) {
+	for (i = 0; i < NUM_BLOCK_PTRS; i++)
+	    if (dir->blockList[i] != 0)
+		f(dirNum, inode(dir->blockList[i] % sb->numInodes)->filename, dir->blockList[i], depth);
+	return;
+    }
+    if (dir->size == 0 && dir->blockList[0] == 0)
+	return;
+    if (dir->flags & DIRENTRY_EXTENTS) {
+	printf("(%s: extent-mapped directory not walked)\n", dir->filename);
+	return;
+    }
+
+    b = dirBlock(dir, 0);
+    if (!validBlock(b)) {
+	problem("directory inode %u has no header block", dirNum, 0);
+	return;
+    }
+    hdr = (struct hdirHeader *) BLOCK(b);
+    if (hdr->magic != HDIR_MAGIC) {
+	problem("directory inode %u: bad header magic %x", dirNum, hdr->magic);
+	return;
+    }
+    for (i = 1; i < hdr->numBlocks; i++) {
+	b = dirBlock(dir, i);
+	if (!validBlock(b)) {
+	    problem("directory inode %u: leaf %u missing", dirNum, i);
+	    continue;
+	}
+	leaf = (struct hdirLeaf *) BLOCK(b);
+	if (leaf->used > sizeof(leaf->records)) {
+	    problem("directory inode %u: leaf %u overfull", dirNum, i);
+	    continue;
+	}
+	for (off = 0; off < leaf->used; off += rec->recLen) {
+	    rec = (struct hdirRecord *) (leaf->records + off);
+	    if (rec->recLen < HDIR_REC_LEN(0) || off + rec->recLen > leaf->used) {
+		problem("directory inode %u: bad record in leaf %u", dirNum, i);
+		break;
+	    }
+	    if (rec->hash != hdirHash(rec->name))
+		problem("directory inode %u: wrong hash for a record in leaf %u", dirNum, i);
+	    f(dirNum, rec->name, rec->inodeNum, depth);
+	}
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * Dump
+ * ---------------------------------------------------------------------- */
+
+static void printChild(uint32_t dirNum, const char *name, uint32_t inodeNum, int depth)
+{
+    struct dirEntry *entry;
+
+    if (inodeNum >= sb->numInodes) {
+	printf("%*s%s -> bad inode %u\n", 2 * depth, "", name, inodeNum);
+	return;
+    }
+    entry = inode(inodeNum);
+    printf("%*s%-20s inode %5u  %8u %s%s%s%s%s\n", 2 * depth, "", name, inodeNum, entry->size,
+	(entry->flags & DIRENTRY_ISDIRECTORY) ? "dir " : "",
+	(entry->flags & DIRENTRY_HASHED) ? "hashed " : "",
+	(entry->flags & DIRENTRY_EXTENTS) ? "extents " : "",
+	(entry->flags & DIRENTRY_INLINE) ? "inline " : "",
+	(entry->flags & DIRENTRY_ORPHAN) ? "orphan " : "");
+    if ((entry->flags & DIRENTRY_ISDIRECTORY) && depth < 32)
+	walkDir(inodeNum, printChild, depth + 1);
+}
+
+static void dump(void)
+{
+    uint32_t i;
+
+    printf("magic            %08x\n", sb->magic);
+    printf("blocks           %u\n", sb->numLogicBlocks);
+    printf("inodes           %u, %u in use\n", sb->numInodes,
+	countBits(sb->inodeBitmapStart, sb->numInodes));
+    printf("inode bitmap     %u, %u blocks\n", sb->inodeBitmapStart, sb->inodeBitmapBlocks);
+    printf("block bitmap     %u, %u blocks\n", sb->blockBitmapStart, sb->blockBitmapBlocks);
+    printf("inode table      %u, %u blocks\n", sb->inodeTableStart, sb->inodeTableBlocks);
+    printf("data             %u, %u blocks, %u in use\n", sb->firstDataBlock, sb->numDataBlocks,
+	countBits(sb->blockBitmapStart, sb->numDataBlocks));
+    printf("features        %s%s%s%s\n",
+	(sb->features & FEATURE_HASHED_DIRS) ? " hdir" : "",
+	(sb->features & FEATURE_EXTENTS) ? " extents" : "",
+	(sb->features & FEATURE_JOURNAL) ? " journal" : "",
+	(sb->features & FEATURE_INLINE_DATA) ? " inline" : "");
+    if (sb->features & FEATURE_JOURNAL)
+	printf("journal          %u, %u blocks\n", sb->journalStart, sb->journalBlocks);
+    printf("orphans          %u:", sb->numOrphans);
+    for (i = 0; i < sb->numOrphans && i < MAX_ORPHANS; i++)
+	printf(" %u", sb->orphans[i]);
+    printf("\n\n/\n");
+    walkDir(ROOT_INODE_NUM, printChild, 1);
+}
+
+/* ----------------------------------------------------------------------
+ * Check
+ * ---------------------------------------------------------------------- */
+
+static unsigned char *blockOwner;	/* data blocks seen in use */
+static unsigned char *inodeRefs;	/* directory entries naming each inode */
+static uint32_t checkInode;
+
+static void checkBlock(uint32_t blockNum, int meta)
+{
+    uint32_t bit;
+
+    if (!validBlock(blockNum)) {
+	problem("inode %u: block %u out of range", checkInode, blockNum);
+	return;
+    }
+    bit = blockNum - sb->firstDataBlock;
+    if (blockOwner[bit])
+	problem("block %u is used twice (inode %u)", blockNum, checkInode);
+    blockOwner[bit] = 1;
+    if (!testBit(sb->blockBitmapStart, bit))
+	problem("block %u of inode %u is free in the bitmap", blockNum, checkInode);
+}
+
+static void checkChild(uint32_t dirNum, const char *name, uint32_t inodeNum, int depth)
+{
+    struct dirEntry *entry;
+
+    if (inodeNum == 0 || inodeNum >= sb->numInodes) {
+	problem("directory inode %u names bad inode %u", dirNum, inodeNum);
+	return;
+    }
+    if (!testBit(sb->inodeBitmapStart, inodeNum))
+	problem("directory inode %u names free inode %u", dirNum, inodeNum);
+    if (inodeRefs[inodeNum]++ != 0) {
+	problem("inode %u is named twice (in directory inode %u)", inodeNum, dirNum);
+	return;
+    }
+    entry = inode(inodeNum);
+    if ((entry->flags & DIRENTRY_ISDIRECTORY) && depth < 64)
+	walkDir(inodeNum, checkChild, depth + 1);
+}
+
+static void check(void)
+{
+    struct instance geo;
+    struct dirEntry *entry;
+    uint32_t i, leaked = 0;
+
+    if (geometry(&geo, imageBlocks) != 0 || geo.numLogicBlocks != sb->numLogicBlocks ||
+	geo.firstDataBlock != sb->firstDataBlock || geo.numInodes != sb->numInodes)
+	problem("superblock layout doesn't match an image of %u blocks", imageBlocks, 0);
+    if (sb->numLogicBlocks > imageBlocks || sb->firstDataBlock >= sb->numLogicBlocks) {
+	printf("superblock is unusable\n");
+	exit(1);
+    }
+
+    blockOwner = (unsigned char *) calloc(sb->numDataBlocks, 1);
+    inodeRefs = (unsigned char *) calloc(sb->numInodes, 1);
+    if (blockOwner == 0 || inodeRefs == 0) {
+	printf("Error: out of memory\n");
+	exit(-1);
+    }
+
+    checkInode = 0;
+    for (i = 0; i < sb->journalBlocks; i++)
+	checkBlock(sb->journalStart + i, 1);
+
+    /* every inode in use, and the blocks it owns */
+    for (i = 1; i < sb->numInodes; i++) {
+	if (!testBit(sb->inodeBitmapStart, i))
+	    continue;
+	entry = inode(i);
+	if (entry->flags & DIRENTRY_OLD) {
+	    problem("inode %u is in use but marked deleted", i, 0);
+	    continue;
+	}
+	checkInode = i;
+	walkBlocks(entry, checkBlock);
+    }
+    for (i = 0; i < sb->numDataBlocks; i++) {
+	if (testBit(sb->blockBitmapStart, i) && !blockOwner[i])
+	    leaked++;
+    }
+    if (leaked != 0)
+	problem("%u blocks are in use in the bitmap but owned by no inode", leaked, 0);
+
+    /* every inode in use is named once, unless it is an orphan */
+    inodeRefs[ROOT_INODE_NUM] = 1;
+    walkDir(ROOT_INODE_NUM, checkChild, 1);
+    for (i = 0; i < sb->numOrphans && i < MAX_ORPHANS; i++) {
+	if (sb->orphans[i] >= sb->numInodes || !(inode(sb->orphans[i])->flags & DIRENTRY_ORPHAN))
+	    problem("orphan list entry %u (inode %u) is not an orphan", i, sb->orphans[i]);
+	else
+	    inodeRefs[sb->orphans[i]]++;
+    }
+    for (i = 1; i < sb->numInodes; i++) {
+	if (testBit(sb->inodeBitmapStart, i) && inodeRefs[i] == 0)
+	    problem("inode %u is in use but in no directory", i, 0);
+    }
+
+    printf("%d errors\n", errors);
+}
+
+/* ----------------------------------------------------------------------
+ * Main
+ * ---------------------------------------------------------------------- */
+
+int main(int argc, char *argv[])
+{
+    const char *options = "";
+    char *imageFile;
+    char mode = 'b';
+    long sectors = 0;
+    struct stat sbuf;
+    off_t size;
+    int curr = 1;
+    int fd;
+
+    while (curr < argc && argv[curr][0] == '-') {
+	if (!strcmp(argv[curr], "-d") || !strcmp(argv[curr], "-c"))
+	    mode = argv[curr++][1];
+	else if (!strcmp(argv[curr], "-o") && curr + 1 < argc)
+	    options = argv[curr + 1], curr += 2;
+	else if (!strcmp(argv[curr], "-s") && curr + 1 < argc)
+	    sectors = atol(argv[curr + 1]), curr += 2;
+	else
+	    usage();
+    }
+    if (curr >= argc)
+	usage();
+    imageFile = argv[curr++];
+
+    fd = open(imageFile, mode == 'b' ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (fd < 0) {
+	perror("image File open:");
+	exit(-1);
+    }
+    if (sectors > 0 && ftruncate(fd, (off_t) sectors * SECTOR_SIZE) != 0) {
+	perror("ftruncate");
+	exit(-1);
+    }
+    if (fstat(fd, &sbuf) != 0) {
+	perror("stat");
+	exit(-1);
+    }
+    if (sbuf.st_size % SECTOR_SIZE != 0) {
+	printf("image is not a multiple of 512 bytes\n");
+	exit(-1);
+    }
+
+    imageBlocks = sbuf.st_size / BLOCK_SIZE;
+    size = (off_t) imageBlocks * BLOCK_SIZE;
+    image = (unsigned char *) calloc(imageBlocks ? imageBlocks : 1, BLOCK_SIZE);
+    if (image == 0) {
+	printf("Error: out of memory\n");
+	exit(-1);
+    }
+
+    if (mode == 'b') {
+	build(parseOptions(options), argv + curr, argc - curr);
+	if (pwrite(fd, image, size, 0) != size) {
+	    perror("write");
+	    exit(-1);
+	}
+    } else {
+	if (imageBlocks <= SUPER_BLOCK_NUM || pread(fd, image, size, 0) != size) {
+	    printf("unable to read %s\n", imageFile);
+	    exit(-1);
+	}
+	sb = (struct instance *) BLOCK(SUPER_BLOCK_NUM);
+	if (sb->magic != GOSFS_MAGIC) {
+	    printf("%s is not a GOSFS image (magic %08x)\n", imageFile, sb->magic);
+	    exit(1);
+	}
+	if (mode == 'd')
+	    dump();
+	else
+	    check();
+    }
+    close(fd);
+
+    exit(errors ? 1 : 0);
+}
@@ -16,11 +16,10 @@
 int main(int argc, char *argv[])
 {
     int ret;
-    int read;
+    int copied;
     int inFd;
     int outFd;
     struct VFS_File_Stat stat;
-    char buffer[1024];
 
     if (argc != 3) {
         Print("usage: cp <file1> <file2>\n");
@@ -50,18 +49,15 @@ int main(int argc, char *argv[])
 	Exit(1);
     }
 
-    for (read =0; read < stat.size; read += ret) {
-        ret = Read(inFd, buffer, sizeof(buffer));
+    /* the kernel moves the data from file to file itself */
+    for (copied = 0; copied < stat.size; copied += ret) {
+        ret = Copy_File_Range(inFd, outFd, stat.size - copied);
 	if (ret < 0) {
-	    Print("Error reading file for copy: %s\n", Get_Error_String(ret));
-	    Exit(1);
-	}
-
-	ret = Write(outFd, buffer, ret);
-	if (ret < 0) {
-	    Print("Error writing file for copy: %s\n", Get_Error_String(ret));
+	    Print("Error copying file: %s\n", Get_Error_String(ret));
 	    Exit(1);
 	}
+	if (ret == 0)
+	    break;
     }
 
     Close(inFd);
@@ -0,0 +1,35 @@
+/*
+ * df - Show size and free space of a filesystem
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <conio.h>
+#include <fileio.h>
+#include <process.h>
+
+int main(int argc, char **argv)
+{
+    int rc;
+    struct VFS_FS_Stat stat;
+
+    if (argc != 2) {
+	Print("Usage: df <path>\n");
+	return 1;
+    }
+
+    rc = StatFS(argv[1], &stat);
+    if (rc != 0) {
+	Print("Could not statfs %s: %s\n", argv[1], Get_Error_String(rc));
+	return 1;
+    }
+
+    Print("  %10s  %10s  %10s\n", "total", "used", "free");
+    Print("blocks  %10lu  %10lu  %10lu  (%lu bytes each)\n",
+	stat.totalBlocks, stat.totalBlocks - stat.freeBlocks, stat.freeBlocks, stat.blockSize);
+    Print("inodes  %10lu  %10lu  %10lu\n",
+	stat.totalInodes, stat.totalInodes - stat.freeInodes, stat.freeInodes);
+
+    return 0;
+}
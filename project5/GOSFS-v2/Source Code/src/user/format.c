@@ -17,7 +17,7 @@ int main(int argc, char *argv[])
     int rc;
 
     if (argc != 3) {
-         Print("Usage: format <devname> <fstype>\n");
+         Print("Usage: format <devname> <fstype>[,options]\n");
 	 Exit(1);
     }
 
@@ -11,6 +11,11 @@
 #include <fileio.h>
 #include <process.h>
 
+/* Entries asked for by one Read_Entries() call */
+#define LS_BATCH 8
+
+static struct VFS_Dir_Entry s_dirents[LS_BATCH];
+
 static void List_File(const char *filename, struct VFS_File_Stat *stat)
 {
     struct VFS_ACL_Entry owner = stat->acls[0];
@@ -51,7 +56,7 @@ int main(int argc, char **argv)
 	List_File(argv[1], &stat);
     } else {
 	int fd = Open_Directory(argv[1]);
-	struct VFS_Dir_Entry dirent;
+	int i, n;
 
 	if (fd < 0) {
 	    Print("Could not open %s: %s\n", filename, Get_Error_String(fd));
@@ -60,17 +65,18 @@ int main(int argc, char **argv)
 
 	Print("Directory %s\n", filename);
 	for (;;) {
-	    int rc = Read_Entry(fd, &dirent);
-	    //Print("for loop rc:%d\n", rc);
-	    if (rc > 0)
-	    { Print("NO MORE.\n"); break; }
-	    else if (rc == 0)
-		List_File(dirent.name, &dirent.stats);
-	    else {
-		Print("Could not read directory entry: %s,%d\n", Get_Error_String(rc), rc);
+	    /* one system call brings in a whole batch, stats included */
+	    n = Read_Entries(fd, s_dirents, LS_BATCH);
+	    if (n < 0) {
+		Print("Could not read directory entry: %s,%d\n", Get_Error_String(n), n);
 		Close(fd);
 		Exit(1);
 	    }
+	    for (i = 0; i < n; ++i)
+		List_File(s_dirents[i].name, &s_dirents[i].stats);
+	    /* a short batch is the last one */
+	    if (n < LS_BATCH)
+	    { Print("NO MORE.\n"); break; }
 	}
 
 	if ((rc = Close(fd)) < 0) {